@@ -1,5 +1,8 @@
 #include <user_config.h>
 #include <SmingCore/SmingCore.h>
+#ifdef SENSOR_PIN
+#include <Libraries/DS18S20/ds18s20.h>
+#endif
 //#include <SystemClock.h>
 
 /*! \brief Controlador de temperaturas para fases da cerveja
@@ -20,7 +23,8 @@
 #define MQTT_TOPIC  "beer/temperature"
 
 #define INI_FILE "/flash/program.ini"
-#define LOG_FILE "/flash/yevesta.log"
+#define LOG_FILE "/flash/yevesta.bin"
+#define LOG_OLD_FILE "/flash/yevesta.0.bin"
 #define LIM_FILE "/flash/limits.ini"
 
 //#define MY_SSID   "Ye VESTA"
@@ -31,178 +35,767 @@
 
 #define RELAY_ONE_PIN 12
 #define RELAY_TWO_PIN 13
+
+//Cubas do controlador, uma VESSEL(compressor, pulso) por cuba e no maximo
+//MAX_VESSELS. Sem VESSEL_TABLE, uma cuba nos pinos acima.
+//#define VESSEL_TABLE VESSEL(12,13) VESSEL(14,16)
+
+//DS18B20 local no barramento OneWire. Sem SENSOR_PIN o controle depende
+//apenas das leituras publicadas em beer/temperature.
+//#define SENSOR_PIN 4
+
+//Compila a bateria de regressao (ver SELFTEST no fim do arquivo). Apenas
+//para placas de bancada: a repeticao aciona os reles.
+//#define SELFTEST
+
+//Nivel das mensagens na serial (ver CONSOLE): CON_LEVEL_NONE, _ERR, _WARN,
+//_INFO ou _DEBUG. Niveis acima deste nem sao compilados.
+#ifndef CONSOLE_LEVEL
+#define CONSOLE_LEVEL CON_LEVEL_INFO
+#endif
+
+//Instrumentacao dos caminhos quentes, publicada em freezer/stats (ver
+//INSTRUMENTACAO). Sem STATS nenhuma medicao e compilada.
+//#define STATS
 //-----------------FIM DEFINES-------------------//
 
-/*! O arquivo program.ini devera conter 1 byte, sendo:
- * F - para Fermentacao
- * M - para Maturacao
- * P - para Priming
- * Sempre que o programa for iniciado, a primeira tarefa
- * sera verificar a existencia de um programa (mais adiante 
- * serao vistos detalhes). Se o arquivo de programa existir,
- * seu conteudo alimenta essa variavel program_to
+//! Temperatura em centesimos de grau.
+/*! O ESP8266 nao tem FPU; todas as temperaturas do caminho de controle
+ * (leituras, limites, comparacoes, arquivos e MQTT) sao inteiros de 16 bits
+ * em centesimos de grau. 19.5 graus sao 1950.
  */
-String program_to = "M"; //!< Variavel que recebe a flag do estilo de programa
+typedef int16_t centi_t;
+
+//! Graus para centesimos, arredondando; constexpr para as constantes.
+constexpr centi_t toCenti(double value){
+    return (centi_t)(value >= 0 ? value*100 + 0.5 : value*100 - 0.5);
+}
 
 //! Valores de maxima e minima para as temperaturas
-/*! As variaveis temp_max e temp_min sao alimentadas conforme a definicao das
+/*! Os campos temp_max e temp_min de cada cuba sao alimentados conforme a definicao das
  * variaveis abaixo, conforme a fase selecionada no celular via MQTT. 
 */
 struct progs{
-    double fermentation_min; /*!< Temperatura minima para fermentacao */
-    double fermentation_max; /*!< Temperatura maxima para fermentacao */
-    double maturation_min; /*!< Temperatura minima para maturacao */
-    double maturation_max; /*!< Temperatura maxima para maturacao */
-    double priming_min; /*!< Temperatura minima para priming */
-    double priming_max; /*!< Temperatura maxima para priming */
-};
-
-static progs programs = {19.0,22.0,1.0,2.0,20.0,22.0};
-
-//! Atribuicao de temperatura minima
-double temp_min = programs.fermentation_min;
-//! Atribuicao de temperatura maxima
-double temp_max = programs.fermentation_max;
-
-Timer procTimer;
-Timer checkConn;
-Timer ESPlives;
-Timer loadLimits;
-//inicializador do mqtt
-void startMqttClient();
+    centi_t fermentation_min; /*!< Temperatura minima para fermentacao */
+    centi_t fermentation_max; /*!< Temperatura maxima para fermentacao */
+    centi_t maturation_min; /*!< Temperatura minima para maturacao */
+    centi_t maturation_max; /*!< Temperatura maxima para maturacao */
+    centi_t priming_min; /*!< Temperatura minima para priming */
+    centi_t priming_max; /*!< Temperatura maxima para priming */
+};
+
+//! Limites de fabrica, usados ate existir um registro de configuracoes.
+#define DEFAULT_PROGS {toCenti(19.0),toCenti(22.0),toCenti(1.0), \
+                       toCenti(2.0),toCenti(20.0),toCenti(22.0)}
+
+//! Estado de uma cuba (fermentador).
+/*! Cada cuba tem seus proprios limites, programa e par de reles. O programa
+ * e um byte, sendo:
+ * F - para Fermentacao
+ * M - para Maturacao
+ * P - para Priming
+ * As variaveis temp_min e temp_max recebem os limites do programa ativo.
+ */
+struct vessel{
+    progs   programs;  /*!< limites dos tres programas */
+    centi_t temp_min;  /*!< minima do programa ativo */
+    centi_t temp_max;  /*!< maxima do programa ativo */
+    centi_t last_temp; /*!< ultima leitura aceita (registrada no log) */
+    char    program;   /*!< flag do programa ativo */
+    uint8_t pins[2];   /*!< GPIO do compressor e do rele de pulso */
+    uint32_t reading_ms; /*!< millis() da ultima leitura; 0 se nenhuma */
+};
+
+//! Tabela de cubas deste controlador, no maximo MAX_VESSELS.
+/*! A cuba 0 e a dos topicos sem numero (beer/temperature); as demais usam
+ * beer/<cuba>/temperature, beer/<cuba>/program etc.
+ */
+#define VESSEL(one, two) {DEFAULT_PROGS, toCenti(19.0), toCenti(22.0), INT16_MIN, 'F', {one, two}},
+#ifndef VESSEL_TABLE
+#define VESSEL_TABLE VESSEL(RELAY_ONE_PIN, RELAY_TWO_PIN)
+#endif
+static vessel vessels[] = {
+    VESSEL_TABLE
+};
+
+#define MAX_VESSELS  8
+#ifdef VESSEL_COUNT
+#error "VESSEL_COUNT vem de vessels[]; defina VESSEL_TABLE"
+#endif
+#define VESSEL_COUNT (sizeof(vessels)/sizeof(vessels[0]))
+static_assert(VESSEL_COUNT <= MAX_VESSELS, "cubas demais");
+
 //Apenas declaracao do callback
 void onMessageReceived(String topic, String message);
 //! Criacao do objeto para comunicacao via MQTT.
 MqttClient mqtt(MQTT_BROKER,MQTT_PORT,onMessageReceived);
+//verdadeiro com a sessao MQTT aberta
+bool mqttOnline();
 //lista o sistema de arquivos
 void ls();
 
-void sleep(unsigned long interval_ms);
+//registro de eventos no log binario (cuba 0 quando nao informada)
+void logEvent(uint8_t event, uint8_t v = 0);
+//agenda a gravacao das configuracoes
+void settingsChanged();
+//fileRead() com contagem de leituras
+int flashRead(file_t f, void *data, size_t len);
+//copia o estado de controle para a memoria do RTC
+void rtcSave();
 
+//! Codigos de evento gravados no log (6 bits).
+enum logEventCode{
+    EV_TEMPERATURE   = 0, /*!< leitura periodica da sonda */
+    EV_BOOT          = 1, /*!< inicializacao */
+    EV_RELAY         = 2, /*!< mudanca de estado de um rele */
+    EV_PROGRAM       = 3, /*!< novo programa escolhido */
+    EV_LIMITS        = 4, /*!< novos limites de temperatura */
+    EV_BAD_PROGRAM   = 5, /*!< mensagem invalida em beer/program */
+    EV_BAD_INI       = 6, /*!< program.ini vazio ou corrompido */
+    EV_NET_FAIL      = 7, /*!< falha na conexao de rede */
+    EV_BAD_LIMITS    = 8, /*!< beer/minMax ou limits.ini mal formado */
+    EV_CONTROL       = 9, /*!< nova configuracao do controlador */
+    EV_PROFILE       = 10, /*!< perfil iniciado, avancou de passo ou terminou */
+    EV_STALE         = 11, /*!< sem leitura recente; compressor desligado */
+    EV_ALERT         = 12, /*!< anomalia do compressor (detalhe em freezer/alert) */
+};
 
-//! Reatribuição da struct programs.
-/*! Quando modificados os valores da struct de limites dos programas de 
- * temperatura, é necessário carregá-los. Essa função se encarrega de fazer a
- * reatribuição dos valores.
+//-------------------- ESCALONADOR ------------------//
+/*! Todo trabalho periodico ou adiado passa por um unico escalonador
+ * cooperativo. schedTimer chama schedTick() a cada SCHED_TICK_MS; as tarefas
+ * vencidas rodam na ordem de taskId, que e a ordem de prioridade: controle,
+ * sensor, perfis, fila de entrada e MQTT vem antes de qualquer tarefa de
+ * manutencao (gravacoes, log, telemetria, historico, arquivos, pre-alocacao,
+ * estatisticas, selftest, console). Depois de SCHED_SLICE_US num mesmo tick as tarefas de manutencao
+ * ficam para o proximo (contado em sched_deferred); as de controle rodam
+ * sempre.
+ *
+ * taskStart() tem a mesma forma do Timer::initializeMs(): funcao, espera
+ * inicial e periodo (0 para uma vez so). Uma tarefa que ainda tem trabalho
+ * pode se reagendar com taskStart(id,fn,0,0) e devolver a CPU: e assim que
+ * as tarefas longas seguem aos pedacos em vez de bloquear.
+ *
+ * Cada execucao e medida: runs, maior duracao, overruns (execucoes acima do
+ * budget da tarefa em task_info[]) e o maior atraso em relacao ao horario
+ * previsto (jitter). Os periodicos avancam next_ms pelo periodo, sem
+ * acumular deriva; quem perde um periodo inteiro volta a contar de agora.
+ *
+ * Os Timers por objeto dos reles e das janelas de PWM continuam como Timers
+ * do Sming: marcam a duracao de pulsos e nao fazem outro trabalho.
  */
-void split(char *buf, int size){
-    char value[5] = {0};
-    int j         = 0;
-    Vector <String> str_temps;   
-    
-    for (int i=0;i<size;i++){
-        if (buf[i] == '|'){
-            value[j] = 0;
-            //Adiciona char* ao vetor de strings...
-            str_temps.add(value);
-            
-            //zerar o array que guarda o valor
-            for (int k=0;k<5;k++){
-                value[k] = 0;
+#define SCHED_TICK_MS  10
+#define SCHED_SLICE_US 10000
+
+//! Tarefas, em ordem de prioridade.
+enum taskId{
+    TASK_CONTROL,   /*!< ctrlTick() */
+    TASK_SENSOR,    /*!< sensorSample() */
+    TASK_PROFILE,   /*!< profileTickAll() */
+    TASK_INBOUND,   /*!< inDrain() */
+    TASK_MQTT,      /*!< mqttConnect() / mqttPoll() */
+    TASK_POWER,     /*!< janelas de rede e contagem do radio (ENERGIA) */
+    TASK_SETTINGS,  /*!< settingsFlush(); primeira de manutencao */
+    TASK_ANALYTICS, /*!< anaTick() */
+    TASK_LOG,       /*!< logFlush() */
+    TASK_OUTBOX,    /*!< outboxDrain() */
+    TASK_TELEMETRY, /*!< telemetryFlush() */
+    TASK_HISTORY,   /*!< histSendChunk() */
+    TASK_FILE,      /*!< fileSend() */
+    TASK_PRESIZE,   /*!< presizeStep() */
+    TASK_STATS,     /*!< statsHeapSample() */
+    TASK_SELFTEST,  /*!< bateria e carga do SELFTEST */
+    TASK_ALIVE,     /*!< publishIamLive() */
+    TASK_CONSOLE,   /*!< conDrain() */
+    TASK_COUNT
+};
+
+#define TASK_FIRST_HOUSEKEEPING TASK_SETTINGS
+
+//! Nome e budget de cada tarefa.
+struct taskInfo{
+    const char *name;
+    uint32_t    budget_us;
+};
+
+static const taskInfo task_info[TASK_COUNT] = {
+    {"control",   2000}, {"sensor",    2000}, {"profile",   5000},
+    {"inbound",  10000}, {"mqtt",      5000}, {"power",    20000},
+    {"settings", 30000}, {"analytics",30000}, {"log",      30000},
+    {"outbox",   10000}, {"telemetry",10000}, {"history",  10000},
+    {"file",     10000}, {"presize",  30000}, {"stats",    10000},
+    {"selftest",500000}, {"alive",     5000}, {"console",   1000},
+};
+
+//! Estado de uma tarefa.
+struct task{
+    void   (*fn)();
+    uint32_t period_ms;   /*!< 0: uma vez so */
+    uint32_t next_ms;     /*!< millis() previsto para a proxima execucao */
+    bool     active;
+    uint32_t runs;
+    uint32_t overruns;    /*!< execucoes acima de budget_us */
+    uint32_t max_us;
+    uint32_t late_max_ms; /*!< maior atraso em relacao a next_ms */
+};
+
+static task     tasks[TASK_COUNT];
+static uint32_t sched_deferred = 0;
+Timer schedTimer;
+
+//! Agenda fn em delay_ms e, com period_ms, a cada period_ms depois disso.
+void taskStart(uint8_t id, void (*fn)(), uint32_t delay_ms, uint32_t period_ms){
+    task &t    = tasks[id];
+    t.fn        = fn;
+    t.period_ms = period_ms;
+    t.next_ms   = millis() + delay_ms;
+    t.active    = true;
+}
+
+//! Cancela a tarefa.
+void taskStop(uint8_t id){
+    tasks[id].active = false;
+}
+
+//! Verdadeiro com a tarefa agendada.
+bool taskActive(uint8_t id){
+    return tasks[id].active;
+}
+
+//! Callback do schedTimer: roda as tarefas vencidas por prioridade.
+void schedTick(){
+    uint32_t slice = system_get_time();
+    for (uint8_t i=0;i<TASK_COUNT;i++){
+        task &t = tasks[i];
+        uint32_t now = millis();
+        if (!t.active || (int32_t)(now - t.next_ms) < 0){
+            continue;
+        }
+        if (i >= TASK_FIRST_HOUSEKEEPING && system_get_time() - slice > SCHED_SLICE_US){
+            sched_deferred++;
+            break;
+        }
+        uint32_t late = now - t.next_ms;
+        if (late > t.late_max_ms){
+            t.late_max_ms = late;
+        }
+        //reagenda antes de chamar: a tarefa pode se reagendar ou parar
+        if (t.period_ms){
+            t.next_ms += t.period_ms;
+            if ((int32_t)(now - t.next_ms) >= 0){
+                t.next_ms = now + t.period_ms;
             }
-            //reinicia o contador da variavel 'value'
-            j = 0;
         }
         else{
-            //um,dois,tres, pin...
-            value[j] = buf[i];
-            j++;
+            t.active = false;
         }
+        uint32_t start = system_get_time();
+        t.fn();
+        uint32_t us = system_get_time() - start;
+        t.runs++;
+        if (us > t.max_us){
+            t.max_us = us;
+        }
+        if (us > task_info[i].budget_us){
+            t.overruns++;
+        }
+    }
+}
+
+//! Liga o escalonador; taskStart() pode ser chamada antes.
+void schedBegin(){
+    schedTimer.initializeMs(SCHED_TICK_MS,schedTick).start();
+}
+//-----------------FIM ESCALONADOR-------------------//
+
+//-------------------- CONSOLE ------------------//
+/*! Mensagens de texto para a serial. CON_ERR, CON_WARN, CON_INFO e CON_DEBUG
+ * recebem um formato printf (m_vsnprintf) e seus argumentos; niveis acima
+ * de CONSOLE_LEVEL viram um comando vazio, sem codigo e sem avaliar os
+ * argumentos.
+ *
+ * conPrintf() formata a linha na pilha e a copia para con_ring; quem chama
+ * nunca espera pela UART. TASK_CONSOLE esvazia o anel a cada CON_DRAIN_MS,
+ * escrevendo apenas o que cabe na FIFO de transmissao (a 115200 baud a FIFO
+ * de 128 bytes esvazia em ~11 ms). Uma linha que nao cabe no anel e
+ * descartada inteira e contada em con_dropped.
+ */
+#define CON_LEVEL_NONE  0
+#define CON_LEVEL_ERR   1
+#define CON_LEVEL_WARN  2
+#define CON_LEVEL_INFO  3
+#define CON_LEVEL_DEBUG 4
+
+#define CON_RING_LEN 1024
+#define CON_LINE_LEN 96
+#define CON_DRAIN_MS 10
+#define CON_TX_FIFO  128
+
+static char     con_ring[CON_RING_LEN];
+static uint16_t con_head    = 0; //proximo byte a enviar
+static uint16_t con_count   = 0; //bytes pendentes
+static uint32_t con_dropped = 0; //linhas descartadas com o anel cheio
+
+//! Bytes livres na FIFO de transmissao da UART0.
+static inline uint8_t conTxFifoFree(){
+    return CON_TX_FIFO - ((READ_PERI_REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT);
+}
+
+//! Tarefa TASK_CONSOLE: passa para a FIFO o que couber, sem esperar.
+void conDrain(){
+    uint16_t room = conTxFifoFree();
+    while (room > 0 && con_count > 0){
+        uint16_t chunk = CON_RING_LEN - con_head; //ate o fim do anel
+        if (chunk > con_count) chunk = con_count;
+        if (chunk > room)      chunk = room;
+        Serial.write((const uint8_t*)&con_ring[con_head],chunk);
+        con_head   = (con_head + chunk) % CON_RING_LEN;
+        con_count -= chunk;
+        room      -= chunk;
     }
-    str_temps.add(value);
-    Serial.println("---------------------");
-    for (int k=0;k<str_temps.count();k++){
-        Serial.println(str_temps.at(k));
+    if (con_count > 0){
+        taskStart(TASK_CONSOLE,conDrain,CON_DRAIN_MS,0);
     }
-    Serial.println("---------------------");
-    
-    programs.fermentation_min = str_temps[0].toFloat();
-    programs.fermentation_max = str_temps[1].toFloat();
-    programs.maturation_min   = str_temps[2].toFloat();
-    programs.maturation_max   = str_temps[3].toFloat();
-    programs.priming_min      = str_temps[4].toFloat();
-    programs.priming_max      = str_temps[5].toFloat();
-    Serial.println("Novos valores atribuidos.");
 }
+
+//! Formata uma linha e a coloca no anel.
+void conPrintf(const char *fmt, ...){
+    char    line[CON_LINE_LEN];
+    va_list args;
+    va_start(args,fmt);
+    int n = m_vsnprintf(line,sizeof(line)-2,fmt,args);
+    va_end(args);
+    if (n < 0){
+        return;
+    }
+    if (n > (int)sizeof(line)-3){
+        n = sizeof(line)-3; //linha truncada
+    }
+    line[n++] = '\r';
+    line[n++] = '\n';
+
+    if (con_count + n > CON_RING_LEN){
+        con_dropped++;
+        return;
+    }
+    bool idle = con_count == 0;
+    for (int i=0;i<n;i++){
+        con_ring[(con_head + con_count + i) % CON_RING_LEN] = line[i];
+    }
+    con_count += n;
+    if (idle){
+        taskStart(TASK_CONSOLE,conDrain,CON_DRAIN_MS,0);
+    }
+}
+
+#if CONSOLE_LEVEL >= CON_LEVEL_ERR
+#define CON_ERR(...)   conPrintf(__VA_ARGS__)
+#else
+#define CON_ERR(...)   do{}while(0)
+#endif
+#if CONSOLE_LEVEL >= CON_LEVEL_WARN
+#define CON_WARN(...)  conPrintf(__VA_ARGS__)
+#else
+#define CON_WARN(...)  do{}while(0)
+#endif
+#if CONSOLE_LEVEL >= CON_LEVEL_INFO
+#define CON_INFO(...)  conPrintf(__VA_ARGS__)
+#else
+#define CON_INFO(...)  do{}while(0)
+#endif
+#if CONSOLE_LEVEL >= CON_LEVEL_DEBUG
+#define CON_DEBUG(...) conPrintf(__VA_ARGS__)
+#else
+#define CON_DEBUG(...) do{}while(0)
+#endif
+//-----------------FIM CONSOLE-------------------//
+
+//-------------------- BLOCOS DE TRABALHO ------------------//
+/*! Buffers temporarios das rotinas que montam ou leem mensagens grandes
+ * (caixa de saida, telemetria, historico, arquivos, fila de entrada,
+ * relatorio de STATS e o preenchimento dos arquivos zerados) saem de um pool
+ * estatico de POOL_BLOCKS blocos de POOL_BLOCK bytes, em vez de um buffer
+ * estatico por rotina ou do heap. Como as tarefas rodam ate o fim, um bloco
+ * so fica preso durante uma chamada; o pior caso e inDrain() segurando a
+ * mensagem enquanto o handler usa outro bloco.
+ *
+ * poolBuf pega um bloco no construtor e o devolve no destrutor. Sem bloco
+ * livre p fica NULL, pool_fail conta a falha e a rotina desiste ou tenta de
+ * novo na proxima chamada. pool_high guarda o maior numero de blocos em uso
+ * ao mesmo tempo.
+ */
+#define POOL_BLOCK  1024
+#define POOL_BLOCKS 2
+
+static uint8_t  pool_mem[POOL_BLOCKS][POOL_BLOCK] __attribute__((aligned(4)));
+static uint8_t  pool_used = 0; //bit i: bloco i em uso
+static uint8_t  pool_high = 0;
+static uint32_t pool_fail = 0;
+
+//! Pega um bloco livre; NULL se todos estao em uso.
+void *poolAlloc(){
+    uint8_t in_use = 0;
+    void   *p      = NULL;
+    for (uint8_t i=0;i<POOL_BLOCKS;i++){
+        if (pool_used & (1 << i)){
+            in_use++;
+        }
+        else if (p == NULL){
+            pool_used |= 1 << i;
+            p = pool_mem[i];
+            in_use++;
+        }
+    }
+    if (p == NULL){
+        pool_fail++;
+    }
+    if (in_use > pool_high){
+        pool_high = in_use;
+    }
+    return p;
+}
+
+//! Devolve um bloco de poolAlloc().
+void poolFree(void *p){
+    if (p != NULL){
+        pool_used &= ~(1 << (((uint8_t*)p - pool_mem[0]) / POOL_BLOCK));
+    }
+}
+
+//! Bloco do pool enquanto o objeto existir.
+struct poolBuf{
+    uint8_t *p;
+    poolBuf() : p((uint8_t*)poolAlloc()) {}
+    ~poolBuf(){ poolFree(p); }
+};
+//-----------------FIM BLOCOS DE TRABALHO-------------------//
+
+
+//-------------------- PARSER ------------------//
+/*! Parser unico para as mensagens de beer/minMax (MINIMA|MAXIMA|PROGRAMA) e
+ * para o conteudo do limits.ini (seis temperaturas separadas por '|'). Nao
+ * aloca memoria: os campos sao lidos direto do buffer recebido e convertidos
+ * para centesimos de grau (centi_t). Qualquer entrada fora do formato e
+ * recusada com um parseError, sem alterar os valores atuais.
+ */
+#define CENTI_MIN  -4000 //!< -40.00 graus
+#define CENTI_MAX  12500 //!< 125.00 graus
+#define LIMITS_LEN 6     //!< campos do limits.ini
+#define LIM_BUF_LEN 64   //!< tamanho maximo aceito para o limits.ini
+
+//! Erros do parser.
+enum parseError{
+    PARSE_OK = 0,   /*!< sucesso */
+    PARSE_EMPTY,    /*!< campo vazio */
+    PARSE_BAD_CHAR, /*!< caractere fora do formato */
+    PARSE_RANGE,    /*!< temperatura fora de CENTI_MIN..CENTI_MAX ou min > max */
+    PARSE_FIELDS,   /*!< quantidade de campos incorreta */
+    PARSE_PROGRAM,  /*!< programa diferente de F, M ou P */
+    PARSE_TOO_LONG, /*!< entrada maior que o buffer */
+};
+
+//! Nome do erro, para a serial.
+const char *parseErrorStr(parseError err){
+    switch (err){
+        case PARSE_OK:       return "ok";
+        case PARSE_EMPTY:    return "campo vazio";
+        case PARSE_BAD_CHAR: return "caractere invalido";
+        case PARSE_RANGE:    return "fora da faixa";
+        case PARSE_FIELDS:   return "numero de campos";
+        case PARSE_PROGRAM:  return "programa invalido";
+        case PARSE_TOO_LONG: return "entrada longa demais";
+    }
+    return "?";
+}
+
+static inline bool isBlank(char c){
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+//! Converte "[-]NN[.NNN]" em centesimos, arredondando na terceira casa.
+parseError parseCenti(const char *s, size_t len, centi_t *out){
+    while (len > 0 && isBlank(*s)){
+        s++;
+        len--;
+    }
+    while (len > 0 && isBlank(s[len-1])){
+        len--;
+    }
+    if (len == 0){
+        return PARSE_EMPTY;
+    }
+
+    bool neg = false;
+    if (*s == '-' || *s == '+'){
+        neg = *s == '-';
+        s++;
+        len--;
+    }
+    int32_t value   = 0;
+    int     digits  = 0;  //digitos lidos
+    int     decimal = -1; //casas decimais lidas; -1 antes do ponto
+    bool    round_up = false;
+    for (size_t i=0;i<len;i++){
+        char c = s[i];
+        if (c == '.' && decimal < 0){
+            decimal = 0;
+            continue;
+        }
+        if (c < '0' || c > '9'){
+            return PARSE_BAD_CHAR;
+        }
+        digits++;
+        if (decimal < 0){
+            value = value*10 + (c-'0');
+            if (value > 1000){
+                return PARSE_RANGE;
+            }
+        }
+        else if (decimal < 2){
+            value = value*10 + (c-'0');
+            decimal++;
+        }
+        else if (decimal == 2){
+            round_up = c >= '5';
+            decimal++;
+        }
+    }
+    if (digits == 0){
+        return PARSE_EMPTY;
+    }
+    if (decimal < 0){
+        decimal = 0;
+    }
+    for (;decimal<2;decimal++){
+        value *= 10;
+    }
+    if (round_up){
+        value++;
+    }
+    if (neg){
+        value = -value;
+    }
+    if (value < CENTI_MIN || value > CENTI_MAX){
+        return PARSE_RANGE;
+    }
+    *out = (centi_t)value;
+    return PARSE_OK;
+}
+
+//! Escreve v como "[-]N.NN" em buf (minimo 8 bytes); retorna o tamanho.
+size_t formatCenti(char *buf, centi_t v){
+    char    *p = buf;
+    int32_t  a = v;
+    if (a < 0){
+        *p++ = '-';
+        a    = -a;
+    }
+    char tmp[6];
+    int  n = 0;
+    int32_t whole = a / 100;
+    do{
+        tmp[n++] = '0' + whole % 10;
+        whole   /= 10;
+    } while (whole > 0);
+    while (n > 0){
+        *p++ = tmp[--n];
+    }
+    *p++ = '.';
+    *p++ = '0' + (a / 10) % 10;
+    *p++ = '0' + a % 10;
+    *p   = 0;
+    return p - buf;
+}
+
+//! Imprime "label N.NN" na serial (nivel CON_LEVEL_INFO).
+void printCenti(const char *label, centi_t v){
+#if CONSOLE_LEVEL >= CON_LEVEL_INFO
+    char buf[8];
+    formatCenti(buf,v);
+    CON_INFO("%s%s",label,buf);
+#endif
+}
+
+//! Converte um inteiro decimal dentro de lo..hi.
+parseError parseInt(const char *s, size_t len, int32_t lo, int32_t hi, int32_t *out){
+    while (len > 0 && isBlank(*s)){
+        s++;
+        len--;
+    }
+    while (len > 0 && isBlank(s[len-1])){
+        len--;
+    }
+    bool neg = len > 0 && *s == '-';
+    if (neg){
+        s++;
+        len--;
+    }
+    if (len == 0){
+        return PARSE_EMPTY;
+    }
+    int32_t value = 0;
+    for (size_t i=0;i<len;i++){
+        if (s[i] < '0' || s[i] > '9'){
+            return PARSE_BAD_CHAR;
+        }
+        value = value*10 + (s[i]-'0');
+        if (value > 100000){
+            return PARSE_RANGE;
+        }
+    }
+    if (neg){
+        value = -value;
+    }
+    if (value < lo || value > hi){
+        return PARSE_RANGE;
+    }
+    *out = value;
+    return PARSE_OK;
+}
+
+//! Converte um inteiro decimal sem sinal de 32 bits (timestamps), sem teto.
+parseError parseUint(const char *s, size_t len, uint32_t *out){
+    while (len > 0 && isBlank(*s)){
+        s++;
+        len--;
+    }
+    while (len > 0 && isBlank(s[len-1])){
+        len--;
+    }
+    if (len == 0){
+        return PARSE_EMPTY;
+    }
+    uint32_t value = 0;
+    for (size_t i=0;i<len;i++){
+        if (s[i] < '0' || s[i] > '9'){
+            return PARSE_BAD_CHAR;
+        }
+        uint32_t digit = s[i]-'0';
+        if (value > (UINT32_MAX - digit) / 10){
+            return PARSE_RANGE;
+        }
+        value = value*10 + digit;
+    }
+    *out = value;
+    return PARSE_OK;
+}
+
+//! Separa ate max campos por '|'; retorna o numero de campos encontrados.
+size_t splitFields(const char *s, size_t len, const char **field, size_t *flen, size_t max){
+    size_t n     = 0;
+    size_t begin = 0;
+    for (size_t i=0;i<=len;i++){
+        if (i == len || s[i] == '|'){
+            if (n == max){
+                return max+1;
+            }
+            field[n] = s+begin;
+            flen[n]  = i-begin;
+            n++;
+            begin = i+1;
+        }
+    }
+    return n;
+}
+
+//! Le MINIMA|MAXIMA|PROGRAMA (ex.: 13.5|14.5|M).
+parseError parseMinMax(const char *s, size_t len, centi_t *min, centi_t *max, char *prog){
+    const char *field[3];
+    size_t      flen[3];
+    if (splitFields(s,len,field,flen,3) != 3){
+        return PARSE_FIELDS;
+    }
+    parseError err = parseCenti(field[0],flen[0],min);
+    if (err == PARSE_OK){
+        err = parseCenti(field[1],flen[1],max);
+    }
+    if (err != PARSE_OK){
+        return err;
+    }
+    if (*min > *max){
+        return PARSE_RANGE;
+    }
+
+    const char *p = field[2];
+    size_t      n = flen[2];
+    while (n > 0 && isBlank(p[n-1])){
+        n--;
+    }
+    if (n != 1 || (p[0] != 'F' && p[0] != 'M' && p[0] != 'P')){
+        return PARSE_PROGRAM;
+    }
+    *prog = p[0];
+    return PARSE_OK;
+}
+
+//! Le as seis temperaturas do limits.ini, na ordem da struct progs.
+parseError parseLimits(const char *s, size_t len, centi_t out[LIMITS_LEN]){
+    const char *field[LIMITS_LEN];
+    size_t      flen[LIMITS_LEN];
+    if (splitFields(s,len,field,flen,LIMITS_LEN) != LIMITS_LEN){
+        return PARSE_FIELDS;
+    }
+    centi_t tmp[LIMITS_LEN];
+    for (int i=0;i<LIMITS_LEN;i++){
+        parseError err = parseCenti(field[i],flen[i],&tmp[i]);
+        if (err != PARSE_OK){
+            return err;
+        }
+    }
+    for (int i=0;i<LIMITS_LEN;i+=2){
+        if (tmp[i] > tmp[i+1]){
+            return PARSE_RANGE;
+        }
+    }
+    memcpy(out,tmp,sizeof(tmp));
+    return PARSE_OK;
+}
+//-----------------FIM PARSER-------------------//
+
+//! Reatribuição da struct programs.
+/*! Quando modificados os valores da struct de limites dos programas de 
+ * temperatura, é necessário carregá-los. Essa função se encarrega de fazer a
+ * reatribuição dos valores, na ordem em que aparecem no limits.ini.
+ */
+void limitsToProg(vessel &v, const centi_t lim[LIMITS_LEN]){
+    v.programs.fermentation_min = lim[0];
+    v.programs.fermentation_max = lim[1];
+    v.programs.maturation_min   = lim[2];
+    v.programs.maturation_max   = lim[3];
+    v.programs.priming_min      = lim[4];
+    v.programs.priming_max      = lim[5];
+    CON_INFO("Novos valores atribuidos.");
+}
+
 //! Carrega os valores do arquivo limits.ini
-/*! Quando há qualquer modificação em um dos valores do struct programs, um
- * arquivo limits.ini é criado com todos os valores de atribuição do struct
- * programs. Se houver um reboot, os valores predefinidos in flow não serão 
- * perdidos, pois serão caregados desse arquivo. Essa função se encarrega de
- * fazer essa carga. Ela é chamada a partir da primeira função do init
- * (adjustments()).
+/*! O limits.ini era o arquivo em que versoes anteriores gravavam os valores
+ * do struct programs. Hoje eles ficam no registro de configuracoes (ver
+ * settingsLoad()) e essa função só é usada para migrar um limits.ini antigo
+ * para a cuba 0.
  */
 void strToProg(){
     if (!fileExist(LIM_FILE)){
-        Serial.println("Arquivo nao existe. Fui.");
+        CON_INFO("Arquivo nao existe. Fui.");
         return;
     }
-    Serial.println("Pegando tamanho do arquivo em Bytes...");
-    int size = fileGetSize(LIM_FILE);
-    char buf[size];
-    for (int i=0;i<size;i++){
-        buf[i] = 0;
-    }
-    Serial.println("Abrindo o arquivo de limites...");
+    char buf[LIM_BUF_LEN];
     file_t limits_ini = fileOpen(LIM_FILE, eFO_ReadOnly);
-    fileSeek(limits_ini,0,eSO_FileStart);
-    int size_return   = fileRead(limits_ini,&buf,size);
-    Serial.print("size_return: ");
-    Serial.println(size_return);
+    if (limits_ini < 0){
+        CON_ERR("Erro ao abrir o arquivo de limites.");
+        return;
+    }
+    int size = flashRead(limits_ini,buf,sizeof(buf));
     fileClose(limits_ini);
 
-    Serial.println("Imprimindo valores do arquivo:");
-    Serial.print("Valores limites: ");
-    Serial.println(buf);
-    split(buf,size);
-}
-
-//! Converte valores do enumerador @programs em String
-/*! Essa conversão é feita para utilização no método @writePrograms(), para
- * carregamento de definições no próximo boot do ESP8266. O caminho reverso é
- * feito pela função strToProg().
- */
-String progToStr(){
-    String convert = String(programs.fermentation_min);
-    convert.concat("|");
-    convert.concat(programs.fermentation_max);
-    convert.concat("|");
-    convert.concat(programs.maturation_min);
-    convert.concat("|");
-    convert.concat(programs.maturation_max);
-    convert.concat("|");
-    convert.concat(programs.priming_min);
-    convert.concat("|");
-    convert.concat(programs.priming_max);
-    
-    Serial.println("Resultado da conversao:");
-    Serial.println(convert);
-    return convert;
-}
-
-//! Escreve os limites de temperatura no arquivo limits.ini.
-/*! Inicialmente o programa é iniciado com predefinições da inicialização do 
- * struct programs. Caso exista em disco o arquivo limits.ini, esses
- * valores são carregados para o enumerador programs com a função de carga
- *  @strToProg().
- * A seleção de um novo valor para qualquer um dos 3 programs é feita no tópico
- * "beer/minMax" e a mensagem deve ter o formato descrito na função
- *  @settingTemps(String toSlice) .
- */
-void writePrograms(){
-    if (fileExist(LIM_FILE)){
-        fileDelete(LIM_FILE);
-    }
-    sleep(15);
-    char buf[40] = {'\0'};
-    file_t limits_ini = fileOpen(LIM_FILE,eFO_ReadWrite | eFO_CreateIfNotExist);
-    String result = progToStr();
-    fileWrite(limits_ini,result.c_str(),result.length());
-    fileSeek(limits_ini,0,eSO_FileStart);
-    fileRead(limits_ini,&buf,result.length()-1);
-    fileClose(limits_ini);
-    
+    centi_t lim[LIMITS_LEN];
+    parseError err = size >= (int)sizeof(buf) ? PARSE_TOO_LONG : parseLimits(buf,size > 0 ? size : 0,lim);
+    if (err != PARSE_OK){
+        CON_WARN("limits.ini invalido: %s",parseErrorStr(err));
+        logEvent(EV_BAD_LIMITS);
+        return;
+    }
+    limitsToProg(vessels[0],lim);
 }
+
 //! Configuração das temperaturas
 /*! Essa função permite mudar as temperaturas pré-definidas para quando o tipo
  * de programa for escolhido, a mínima e máxima desse programa já estejam dentro
@@ -217,49 +810,41 @@ void writePrograms(){
  
  Essa função substitui os valores do respectivo programa no enumerador programs.
  */
-void settingTemps(String toSlice){
-    float tempMin = 0;
-    float tempMax = 0;
-    
-    Serial.println(toSlice);
-    //String toSlice = "13.0|17.5|F";
-    int first    = toSlice.indexOf('|');
-    tempMin      = toSlice.substring(0,first).toFloat();
-    
-    int last     = toSlice.lastIndexOf('|');
-    tempMax      = toSlice.substring(first+1,last).toFloat();
-    
-    Serial.println("Minima e Maxima:");
-    Serial.println(tempMin);
-    Serial.println(tempMax);
-    Serial.println("----====----====----====----");
-    
-    char FMP     = toSlice.charAt(toSlice.length()-1);
-    
-    Serial.print("Nova minima: ");
-    Serial.println(tempMin);
-    Serial.print("Nova maxima: ");
-    Serial.println(tempMax);
-    Serial.print("Programa: ");
-    Serial.println(FMP);
+void settingTemps(uint8_t v, const char *msg, size_t len){
+    centi_t tempMin;
+    centi_t tempMax;
+    char    FMP;
+
+    parseError err = parseMinMax(msg,len,&tempMin,&tempMax,&FMP);
+    if (err != PARSE_OK){
+        CON_WARN("beer/minMax invalido: %s",parseErrorStr(err));
+        logEvent(EV_BAD_LIMITS,v);
+        return;
+    }
+
+    progs &programs = vessels[v].programs;
+    printCenti("Nova minima: ",tempMin);
+    printCenti("Nova maxima: ",tempMax);
+    CON_INFO("Programa: %c",FMP);
     
     if (FMP == 'F'){
         programs.fermentation_min = tempMin;
         programs.fermentation_max = tempMax;
-        Serial.println("Novos valores atribuidos ao programa Fermentation.");
+        CON_INFO("Novos valores atribuidos ao programa Fermentation.");
     }
     else if (FMP == 'M'){
         programs.maturation_min   = tempMin;
         programs.maturation_max   = tempMax;
-        Serial.println("Novos valores atribuidos ao programa Maturation.");
+        CON_INFO("Novos valores atribuidos ao programa Maturation.");
     }
     else if (FMP == 'P'){
         programs.priming_min      = tempMin;
         programs.priming_max      = tempMax;
-        Serial.println("Novos valores atribuidos ao programa Priming.");
+        CON_INFO("Novos valores atribuidos ao programa Priming.");
     }
-    Serial.println("Não esqueca de escolher o programa de atuacao agora.");
-    writePrograms();
+    CON_INFO("Não esqueca de escolher o programa de atuacao agora.");
+    logEvent(EV_LIMITS,v);
+    settingsChanged();
 }
 
 //! Configuração dos pinos de GPIO
@@ -274,364 +859,4235 @@ void adjustment(int A, int B, int C){
     pinMode(2,OUTPUT);
     pinMode(15,OUTPUT);
     
-    pinMode(RELAY_ONE_PIN,OUTPUT);
-    pinMode(RELAY_TWO_PIN,OUTPUT);
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        pinMode(vessels[v].pins[0],OUTPUT);
+        pinMode(vessels[v].pins[1],OUTPUT);
+    }
 
     digitalWrite(0,A);
     digitalWrite(2,B);
     digitalWrite(15,C);
 }
 
-//! Função de sleep sem delay no hardware
-/*! Essa função faz o delay sem causar paralização de hardware, de modo que
- * nunca acontecerá um reset por WDT (Watch Dog Timer), pois as tarefas  de
- * background continuam funcionando livremente (toda a parte relacionada ao
- * wifi, por exemplo).
- * O parâmetro recebido é o intervalo desejado em milisegundos. Dentro da 
- * função pode-se reparar que há um delayMilliseconds(1), que é 1ms de delay
- *  por loop, para que o processador não seja ocupado integralmente na execução
- *  do loop.
- * Atenção: Utilizar sleep() é a melhor forma de garantir que não haverá uma 
- * indisponibilidade de recursos para a tarefa de background, o que poderia 
- * ocasionar um reset do WDT (Watch Dog Timer).
- */
-void sleep(unsigned long interval_ms){
-    unsigned long initial_time = millis();
-    unsigned long delta        = millis()-initial_time;
-    
-    while (delta < interval_ms){
-        delta = millis()-initial_time;
-        delayMilliseconds(1); //apenas para a CPU 'respirar'
+//-------------------- SEQUENCIADOR DE RELES ------------------//
+/*! Cada rele tem uma pequena fila de passos (nivel, duracao). O passo da
+ * frente e aplicado no pino e mantido pela duracao indicada; o Timer do
+ * proprio rele dispara a passagem para o passo seguinte. Assim um pulso de
+ * rele nao segura o callback do MQTT: quem pede o pulso apenas enfileira os
+ * passos e retorna.
+ *
+ * Os reles da cuba v ficam em relays[2*v + RELAY_ONE] (compressor) e
+ * relays[2*v + RELAY_TWO] (pulso); relayInit() copia os pinos de vessels[].
+ */
+#define RELAY_QUEUE_LEN 4
+
+//! Passo de acionamento: aplica level e o mantem por duration_ms.
+struct relayStep{
+    uint8_t  level;       /*!< HIGH ou LOW */
+    uint16_t duration_ms; /*!< tempo ate o proximo passo */
+};
+
+//! Fila de passos de um rele.
+struct relaySeq{
+    uint8_t   pin;   /*!< GPIO do rele */
+    uint8_t   vessel; /*!< cuba dona do rele */
+    uint8_t   level; /*!< ultimo nivel aplicado */
+    uint8_t   head;  /*!< indice do proximo passo */
+    uint8_t   count; /*!< passos pendentes */
+    bool      busy;  /*!< Timer armado aguardando o fim de um passo */
+    uint32_t  changed_ms; /*!< millis() da ultima mudanca de nivel */
+    relayStep steps[RELAY_QUEUE_LEN];
+    Timer     timer;
+
+    void tick();
+};
+
+#define RELAY_ONE 0
+#define RELAY_TWO 1
+relaySeq relays[VESSEL_COUNT*2];
+
+//! Rele do compressor (RELAY_ONE) ou do pulso (RELAY_TWO) da cuba v.
+static inline relaySeq &relayOf(uint8_t v, uint8_t which){
+    return relays[2*v + which];
+}
+
+//! Associa cada relaySeq ao pino e a cuba da tabela vessels[].
+void relayInit(){
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        for (uint8_t k=0;k<2;k++){
+            relaySeq &r = relayOf(v,k);
+            r.pin    = vessels[v].pins[k];
+            r.vessel = v;
+        }
     }
 }
 
-//!Log de excessões.
-void logEvent(String msg){
-    file_t logF = fileOpen(LOG_FILE, eFO_CreateIfNotExist|eFO_Append);
-    if (logF < 0){
-        Serial.println("Nao pude criar o arquivo de log.");
-        fileClose(logF);
-        return;
+//! Aplica o nivel no pino, registrando no log quando houver mudanca.
+void relayWrite(relaySeq &r, uint8_t level){
+    digitalWrite(r.pin,level);
+    if (r.level != level){
+        r.level      = level;
+        r.changed_ms = millis();
+        logEvent(EV_RELAY,r.vessel);
+        rtcSave();
     }
-    fileWrite(logF,msg.c_str(),1);
-    fileClose(logF);
-    
-    Serial.println("Arquivo yevesta.log criado com sucesso");
-    Serial.println("Reiniciando agora...");
-    sleep(300);
-    //System.restart();
 }
 
-//! Se existir, carrega o valor do arquivo program.ini.
-/*! Quando existe o arquivo program.ini, le o conteudo para a variavel
- program_to .*/
-void programLoader(){
-    char flag;
-    if (fileExist(INI_FILE)){
-        file_t inifile = fileOpen(INI_FILE,eFO_ReadOnly);
-        fileSeek(inifile,0,eSO_FileStart);
-        fileRead(inifile,&flag,1);
-        fileClose(inifile);
-        //program_to = fileGetContent(INI_FILE);
-        //TODO: check file stat
-        if (flag == 'F'){
-            temp_min = programs.fermentation_min;
-            temp_max = programs.fermentation_max;
-            
-            Serial.println("Programa carregado: FERMENTATION");
-            Serial.print("Minima: ");
-            Serial.println(programs.fermentation_min);
-            Serial.print("Maxima: ");
-            Serial.println(programs.fermentation_max);
-        }
-        else if (flag == 'M'){
-            temp_min = programs.maturation_min;
-            temp_max = programs.maturation_max;
-            
-            Serial.println("Programa carregado: MATURATION");
-            Serial.print("Minima: ");
-            Serial.println(programs.maturation_min);
-            Serial.print("Maxima: ");
-            Serial.println(programs.maturation_max);
-        }
-        else if (flag == 'P'){
-            temp_min = programs.priming_min;
-            temp_max = programs.priming_max;
-            
-            Serial.println("Programa carregado: PRIMING");
-            Serial.print("Minima: ");
-            Serial.println(programs.priming_min);
-            Serial.print("Maxima: ");
-            Serial.println(programs.priming_max);
+//! Executa os passos pendentes ate encontrar um com duracao.
+void relayRun(relaySeq &r){
+    r.busy = false;
+    while (r.count > 0){
+        relayStep step = r.steps[r.head];
+        r.head = (r.head+1) % RELAY_QUEUE_LEN;
+        r.count--;
+
+        relayWrite(r,step.level);
+        if (step.duration_ms > 0){
+            r.busy = true;
+            r.timer.initializeMs(step.duration_ms,TimerDelegate(&relaySeq::tick,&r)).startOnce();
+            return;
         }
-        else{
-            logEvent("O arquivo ini esta vazio ou corrompido.");
-            Serial.println("Arquivo ini vazio ou corrompido.");
-        }  
     }
 }
 
-//! Escolha da fase
-/*! Quando publicado por MQTT o programa desejado (sendo Fermentation, 
- Maturation ou Priming), o callback onMessageReceived(String topic, String msg)
- *  se encarrega de chamar essa função. O parâmetro recebido é o tipo escolhido,
- sendo as opções 'F' para fermentação, 'M' para maturação e 'P' para priming.*/
-void defineProgram(String flag){
-    char data[5] = "";
-    
-    if (fileExist(INI_FILE)){
-        Serial.println("Removendo arquivo anterior...");
-        fileDelete(INI_FILE);
-    }
-    
-    file_t program_ini = fileOpen(INI_FILE,eFO_ReadWrite | eFO_CreateIfNotExist);
-    
-    if (program_ini < 0){
-        Serial.print("Erro ao abrir arquivo");
-        return;
-    }
-    char teste = flag.charAt(0);
-    fileWrite(program_ini,&teste,1);
-    
-    fileSeek(program_ini,0,eSO_FileStart);
-    char wrote;
-    int content = fileRead(program_ini,&wrote,1);
-    Serial.print("Content: ");
-    Serial.println(content);
-    Serial.print("Arquivo contem: ");
-    Serial.println(wrote);
-    
-    fileClose(program_ini);
-    
-    programLoader();
+void relaySeq::tick(){
+    relayRun(*this);
 }
 
-//! Leitor do conteúdo de um arquivo
-/*! No momento essa função faz exclusivamente a leitura do primeiro byte do
- arquivo de modo de operação (program.ini). Utilizado apenas em debug.
- */
-void readFile(String fileToRead){
-    ls();
-    Serial.println("Abrindo arquivo...");
-    file_t fileChoose = fileOpen(fileToRead,eFO_ReadOnly);
-    if (fileChoose == -10002){
-        Serial.println("Arquivo nao encontrado. Conteudo existente:");
-        ls();
-        return;
-    }
-    else if (fileChoose == -10010){
-        Serial.println("Descritor de arquivo incorreto");
-        ls();
-        return;
+//! Enfileira um passo; retorna false se a fila estiver cheia.
+bool relayPush(relaySeq &r, uint8_t level, uint16_t duration_ms){
+    if (r.count >= RELAY_QUEUE_LEN){
+        return false;
     }
-    char result[2] = {'\0'};
-    Serial.println("Lendo conteudo...");
-    
-    fileSeek(fileChoose,0,eSO_FileStart);
-    char wrote[40];
-    for (int i=0; i<40;i++){
-        wrote[i] = 0;
+    r.steps[(r.head+r.count) % RELAY_QUEUE_LEN] = {level,duration_ms};
+    r.count++;
+    if (!r.busy){
+        relayRun(r);
     }
-    int size = fileGetSize(fileToRead);
-    int content = fileRead(fileChoose,&wrote,size);
-    Serial.print("Conteudo do arquivo: ");
-    Serial.println(wrote);
-    fileClose(fileChoose);
+    return true;
 }
 
-//! Callback do MQTT
-/*! Essa funcao é utilizada como callback da comunicação MQTT.*/
-void onMessageReceived(String topic,String msg){
-   Serial.println(topic);
-   Serial.println(msg);
-   Serial.print("Temperaturas do programa atual: ");
-   Serial.println(temp_min);
-   Serial.println(temp_max);
-   
-   if (topic == "beer/program"){
-       if (msg.charAt(0) == 'F'){
-           defineProgram("F");
-       }
-       else if (msg.charAt(0) == 'M'){
-           defineProgram("M");
-       }
-       else if (msg.charAt(0) == 'P'){
-           defineProgram("P");
-       }
-       else{
-           Serial.print("Mensagem invalida: ");
-           Serial.println(msg);
-           logEvent("Mensagem invalida no topico beer/program");
-       }
-   }
-   else if (topic == "beer/temperature"){
-       /*
-       for (int i=0;i<msg.length();i++){
-           if (!isdigit(msg.charAt(i)) && msg.charAt(i) != '.'){
-           Serial.println("Nao parece temperatura. Abortando...");
-           return;
-           }
-       }
-       */
-       
-       float temp = msg.toFloat();
-       Serial.print("Conversao de String para float. Resultado: ");
-       Serial.println(temp);
-       if (temp <= temp_min){
-           //rele off
-           digitalWrite(RELAY_ONE_PIN,LOW);
-       }
-       if (temp >= temp_max){
-           //rele on
-           digitalWrite(RELAY_ONE_PIN,HIGH);
-           sleep(300);
-           digitalWrite(RELAY_TWO_PIN,HIGH);
-           sleep(1500);
-           digitalWrite(RELAY_TWO_PIN,LOW);
-       }
-   }
-   else if (topic == "beer/ls"){
-       ls();            
-   }
-   else if (topic == "beer/ini"){
-       readFile(msg);
-   }
-   else if (topic == "beer/relay"){
-       if (msg.charAt(0) == '0'){
-           digitalWrite(RELAY_ONE_PIN,HIGH);
-       }
-       else if (msg.charAt(0) == '1'){
-           digitalWrite(RELAY_ONE_PIN,LOW);
-       }
-       else if (msg.charAt(0) == '2'){
-           digitalWrite(RELAY_TWO_PIN,HIGH);
-       }
-       else if (msg.charAt(0) == '3'){
-           digitalWrite(RELAY_TWO_PIN,LOW);
-       }
-   }
-   else if (topic == "beer/minMax"){
-       settingTemps(msg);
-   }
-   else if (topic == "beer/limits"){
-       strToProg();
-   }
-}
-
-//! Reinicia a conexão com o broker em caso de desconexão.
-void checkMQTTDisconnect(TcpClient& client, bool flag){
-    if (flag == true){
-        Serial.println("MQTT Broker Disconnected!!");
-    }
-    else {
-        Serial.println("MQTT Broker Unreachable!!");
-    }
-
-    procTimer.initializeMs(2000, startMqttClient).start();
+//! Descarta a fila e aplica o nivel imediatamente.
+void relaySet(relaySeq &r, uint8_t level){
+    r.timer.stop();
+    r.busy  = false;
+    r.count = 0;
+    relayWrite(r,level);
 }
 
-//! Apenas publica o status da conexão.
-/*! Esse publishing é feito a partir de um timer disparado de dentro da função
- init().
- */
-void publishIamLive(){
-	if (mqtt.getConnectionState() != eTCS_Connected)
-		startMqttClient(); // Auto reconnect
-
-	Serial.println("Publicando status");
-	mqtt.publish("freezer/alive", "Alive");
+//! Verdadeiro enquanto houver passos em execucao ou pendentes.
+bool relayBusy(const relaySeq &r){
+    return r.busy || r.count > 0;
 }
 
-//! Inicializador da conexão com o broker.
-void startMqttClient(){
-    procTimer.stop();
-    TcpClientState state_is = mqtt.getConnectionState();
-    Serial.println("------------------------");
-    Serial.println(state_is);
-    Serial.println("------------------------");
-    mqtt.connect("ElectroDragon", MQTT_USER, MQTT_PASSWD);
-    //mqtt.setCompleteDelegate(checkMQTTDisconnect);
-    mqtt.subscribe("beer/#");
+//! Estado dos reles da cuba v em 2 bits.
+uint8_t relayBits(uint8_t v){
+    return (relayOf(v,RELAY_ONE).level ? 0x01 : 0) | (relayOf(v,RELAY_TWO).level ? 0x02 : 0);
 }
+//-----------------FIM SEQUENCIADOR DE RELES-------------------//
 
-//! Lista arquivos no sistema de arquivos SPIFFS
-/*! Uma listagem simples, apenas para ver os arquivos disponíveis.*/
-void ls(){
-    Vector<String> files = fileList();
-    Serial.println("Listando arquivos:");
-    for (int i=0; i<files.count(); i++){
-        Serial.println(files.get(i) + " - " + String(fileGetSize(files.get(i))) + " Bytes");
+//! Gravacoes na flash, contadas para a bateria de regressao.
+static uint32_t flash_writes = 0;
+//! Bytes gravados na flash.
+static uint32_t flash_bytes  = 0;
+//! Leituras da flash e bytes lidos.
+static uint32_t flash_reads      = 0;
+static uint32_t flash_read_bytes = 0;
+
+//! Verdadeiro quando files_index pode estar desatualizado (ver ARQUIVOS).
+static bool files_dirty = true;
+
+//! fileWrite() com contagem de gravacoes e bytes.
+int flashWrite(file_t f, const void *data, size_t len){
+    int n = fileWrite(f,data,len);
+    flash_writes++;
+    files_dirty = true;
+    if (n > 0){
+        flash_bytes += n;
     }
+    return n;
 }
 
-//! Chamada em caso de falha da conexão com o broker.
-void failed(){
-    Serial.println("Falha na conexao de rede!");
-    //qualquer coisa mais, colocar por aqui.
-    logEvent("Falha na conexao de rede");
+//! fileRead() com contagem de leituras e bytes.
+int flashRead(file_t f, void *data, size_t len){
+    int n = fileRead(f,data,len);
+    flash_reads++;
+    if (n > 0){
+        flash_read_bytes += n;
+    }
+    return n;
 }
 
-//! Chamada em caso de sucesso na conexão com o broker.
-void successful(){
-    Serial.println("Conexao bem sucedida. Iniciando MQTT...");
-    mqtt.publish("freezer/alive", "Starting");
-    startMqttClient();
-    ls();
-}
+//! Arquivos a criar zerados, na ordem em que foram pedidos.
+#define PRESIZE_TMP  "/flash/presize.tmp"
+#define PRESIZE_JOBS (2*MAX_VESSELS + 1)
 
-//! Configuração inicial da interface sta e desabilitação do modo AP.
-/*! Essa função se encarrega de fazer a primeira conexão com a rede WiFi
- * especificada nos defines no inicio do programa. Após confirmada a conexão,
- * o modo AP é desabilitado. Nos resets do ESP8266 essa função não terá mais
- *  efeito. 
- */
-void sta_if(){
+struct presizeJob{
+    char     name[28];
+    uint32_t size;
+};
+
+static presizeJob presize_jobs[PRESIZE_JOBS];
+static uint8_t    presize_count = 0;
+static uint32_t   presize_done  = 0; //bytes ja gravados do primeiro da fila
+
+void presizeStep();
+
+//! Cria name com size bytes zerados, se ele nao existir com esse tamanho.
+/*! Nao grava nada aqui: TASK_PRESIZE monta o arquivo em PRESIZE_TMP, um
+ * bloco do pool por execucao, e so o renomeia no fim. Ate la name nao
+ * existe e quem grava nele desiste, como antes do primeiro boot; uma queda
+ * no meio deixa apenas o temporario, refeito no proximo boot. */
+void flashPresize(const char *name, uint32_t size){
+    if (fileExist(name) && (uint32_t)fileGetSize(name) == size){
+        return;
+    }
+    for (uint8_t i=0;i<presize_count;i++){
+        if (strcmp(presize_jobs[i].name,name) == 0){
+            return;
+        }
+    }
+    if (presize_count == PRESIZE_JOBS){
+        CON_ERR("Nao pude criar %s",name);
+        return;
+    }
+    fileDelete(name); //tamanho errado: os slots nao valem
+    presizeJob &j = presize_jobs[presize_count++];
+    strncpy(j.name,name,sizeof(j.name) - 1);
+    j.name[sizeof(j.name) - 1] = 0;
+    j.size = size;
+    if (!taskActive(TASK_PRESIZE)){
+        taskStart(TASK_PRESIZE,presizeStep,0,0);
+    }
+}
+
+//! Tira o primeiro arquivo da fila.
+static void presizeNext(){
+    presize_count--;
+    memmove(&presize_jobs[0],&presize_jobs[1],presize_count*sizeof(presizeJob));
+    presize_done = 0;
+}
+
+//! Tarefa TASK_PRESIZE: grava um bloco de zeros do primeiro arquivo da fila.
+void presizeStep(){
+    if (presize_count == 0){
+        return;
+    }
+    poolBuf zero;
+    if (zero.p != NULL){
+        presizeJob &j  = presize_jobs[0];
+        uint32_t   len = j.size - presize_done < POOL_BLOCK ? j.size - presize_done : POOL_BLOCK;
+        file_t     f   = fileOpen(PRESIZE_TMP,presize_done == 0 ? eFO_CreateNewAlways|eFO_WriteOnly
+                                                                : eFO_WriteOnly|eFO_Append);
+        int        n   = -1;
+        if (f >= 0){
+            memset(zero.p,0,len);
+            n = flashWrite(f,zero.p,len);
+            fileClose(f);
+        }
+        if (n != (int)len){
+            CON_ERR("Nao pude criar %s",j.name);
+            fileDelete(PRESIZE_TMP);
+            presizeNext();
+        }
+        else if ((presize_done += len) == j.size){
+            fileDelete(j.name);
+            fileRename(PRESIZE_TMP,j.name);
+            presizeNext();
+        }
+    }
+    if (presize_count > 0){
+        taskStart(TASK_PRESIZE,presizeStep,0,0); //sem bloco livre: tenta no proximo tick
+    }
+}
+
+//-------------------- INSTRUMENTACAO ------------------//
+/*! Com STATS definido, STATS_SCOPE(slot) no inicio de uma funcao mede o
+ * tempo ate o retorno pelo contador de ciclos do Xtensa (CCOUNT, 12,5 ns a
+ * 80 MHz) e acumula no slot: chamadas, minimo, media, maximo e um
+ * histograma de STATS_BUCKETS faixas de 4x (<8 us, <32 us, ... >=32 ms).
+ * Tudo fica em stats_slots[], de tamanho fixo.
+ *
+ * TASK_STATS amostra a cada STATS_HEAP_MS o heap livre e guarda o minimo.
+ * O SDK nao informa o maior bloco alocavel, entao ele e sondado por busca
+ * binaria com malloc/free; como a sondagem mexe no proprio heap, ela so
+ * roda no boot e a cada relatorio pedido, nunca na tarefa periodica. A
+ * amostra do boot fica em stats_block_boot e nao e zerada: boot menos o
+ * minimo das sondagens e a deriva (fragmentacao) acumulada desde o boot.
+ *
+ * Uma mensagem em beer/stats publica o relatorio em freezer/stats, montado
+ * num bloco do pool e dividido em mensagens de linhas inteiras (ver
+ * statsPublish()); a mensagem "reset" zera os slots depois de publicar.
+ * Sem STATS, STATS_SCOPE nao gera codigo e o topico nao existe.
+ */
+#ifdef STATS
+#define STATS_BUCKETS  8
+#define STATS_HEAP_MS  10000
+
+//! Slots medidos.
+enum statsSlotId{
+    ST_MESSAGE,  /*!< onMessageReceived(): so enfileira */
+    ST_PROGRAM,  /*!< defineProgram() */
+    ST_SETTINGS, /*!< settingsFlush() */
+    ST_LOG,      /*!< logEvent() */
+    ST_LOG_WRITE,/*!< logWrite() */
+    ST_CONTROL,  /*!< ctrlUpdate() */
+    ST_INBOUND,  /*!< handler chamado por inDrain() */
+    ST_COUNT
+};
+
+static const char *const stats_names[ST_COUNT] = {
+    "message", "program", "settings", "log", "logWrite", "control", "inbound"
+};
+
+//! Acumulado de um slot, em ciclos.
+struct statsSlot{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t hist[STATS_BUCKETS];
+};
+
+static statsSlot stats_slots[ST_COUNT];
+static uint32_t  stats_heap_min  = 0xFFFFFFFF;
+static uint32_t  stats_block_min = 0xFFFFFFFF;
+static uint32_t  stats_block_boot = 0; //primeira amostra; referencia da deriva
+
+//! Registrador CCOUNT do Xtensa; fora dele, ciclos estimados pelo relogio.
+static inline uint32_t statsCycles(){
+#ifdef __XTENSA__
+    uint32_t ccount;
+    asm volatile("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+#else
+    return system_get_time() * system_get_cpu_freq();
+#endif
+}
+
+//! Acumula uma medicao de cycles ciclos no slot.
+void statsRecord(uint8_t id, uint32_t cycles){
+    statsSlot &st = stats_slots[id];
+    if (st.count == 0 || cycles < st.min){
+        st.min = cycles;
+    }
+    if (cycles > st.max){
+        st.max = cycles;
+    }
+    st.count++;
+    st.sum += cycles;
+
+    uint32_t us = cycles / system_get_cpu_freq();
+    uint8_t  b  = 0;
+    for (uint32_t edge=8;b < STATS_BUCKETS-1 && us >= edge;edge <<= 2){
+        b++;
+    }
+    st.hist[b]++;
+}
+
+//! Mede do construtor ao destrutor (retorno da funcao).
+struct statsScope{
+    uint8_t  id;
+    uint32_t start;
+    statsScope(uint8_t slot) : id(slot), start(statsCycles()) {}
+    ~statsScope(){ statsRecord(id,statsCycles() - start); }
+};
+
+#define STATS_SCOPE(slot) statsScope stats_scope_(slot)
+
+//! Maior bloco que o malloc consegue entregar agora.
+uint32_t statsLargestBlock(){
+    uint32_t lo = 0;
+    uint32_t hi = system_get_free_heap_size();
+    while (hi - lo > 16){
+        uint32_t mid = (lo + hi) / 2;
+        void *p = malloc(mid);
+        if (p != NULL){
+            free(p);
+            lo = mid;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//! Tarefa TASK_STATS: atualiza o minimo do heap livre, sem alocar.
+void statsHeapSample(){
+    uint32_t heap = system_get_free_heap_size();
+    if (heap < stats_heap_min){
+        stats_heap_min = heap;
+    }
+}
+
+//! Sonda o maior bloco; so no boot e quando o relatorio e pedido.
+void statsBlockSample(){
+    uint32_t block = statsLargestBlock();
+    if (block < stats_block_min){
+        stats_block_min = block;
+    }
+    if (stats_block_boot == 0){
+        stats_block_boot = block;
+    }
+}
+
+void statsBegin(){
+    statsHeapSample();
+    statsBlockSample();
+    taskStart(TASK_STATS,statsHeapSample,STATS_HEAP_MS,STATS_HEAP_MS);
+}
+#else
+#define STATS_SCOPE(slot)
+#endif
+//-----------------FIM INSTRUMENTACAO-------------------//
+
+//-------------------- LOG BINARIO ------------------//
+/*! O log de eventos e temperaturas e um arquivo binario de registros de 8
+ * bytes (logRecord), gravados em little-endian na ordem em que ocorreram:
+ *
+ *   offset 0  uint32 timestamp  segundos desde o boot
+ *   offset 4  int16  temp       ultima leitura em centesimos de grau
+ *                               (INT16_MIN se nao houve leitura ainda)
+ *   offset 6  uint8  program    bits 0-1: programa (0 nenhum, 1 F, 2 M,
+ *                               3 P), bits 2-4: cuba
+ *   offset 7  uint8  flags      bit 0: rele 1, bit 1: rele 2,
+ *                               bits 2-7: codigo do evento (logEventCode)
+ *
+ * Os registros ficam em um anel na RAM e a tarefa TASK_LOG os descarrega no
+ * SPIFFS somente em lotes de paginas inteiras (LOG_PAGE_RECORDS registros),
+ * exceto quando o registro mais antigo ja espera ha LOG_MAX_AGE_S segundos.
+ * Quando LOG_FILE passa de LOG_MAX_BYTES ele vira LOG_OLD_FILE, de modo que
+ * o log nunca ocupa mais que 2 * LOG_MAX_BYTES de flash.
+ *
+ * Os eventos (tudo menos EV_TEMPERATURE, que ja vai na telemetria) tambem
+ * sao copiados para log_events e publicados em freezer/events, como
+ * registros de 8 bytes concatenados, junto com o lote de telemetria.
+ */
+#define LOG_RING_LEN        64      //registros em RAM
+#define LOG_PAGE_RECORDS    32      //256 bytes, uma pagina do SPIFFS
+#define LOG_CHECK_MS        10000   //intervalo de TASK_LOG
+#define LOG_MAX_AGE_S       300     //espera maxima de um registro na RAM
+#define LOG_MAX_BYTES       32768   //tamanho para rotacao
+#define LOG_TEMP_INTERVAL_S 60      //intervalo minimo entre registros de leitura
+#define LOG_EVENTS_LEN      16      //eventos aguardando publicacao
+
+//! Registro do log binario.
+struct __attribute__((packed)) logRecord{
+    uint32_t timestamp; /*!< segundos desde o boot */
+    int16_t  temp;      /*!< centesimos de grau */
+    uint8_t  program;   /*!< programa ativo e cuba */
+    uint8_t  flags;     /*!< estado dos reles e codigo do evento */
+};
+
+//! Flag do programa ('F', 'M' ou 'P') em 2 bits; 0 para desconhecido.
+uint8_t programCode(char flag){
+    switch (flag){
+        case 'F': return 1;
+        case 'M': return 2;
+        case 'P': return 3;
+    }
+    return 0;
+}
+
+static logRecord log_ring[LOG_RING_LEN];
+static uint8_t   log_head    = 0;  //registro mais antigo
+static uint8_t   log_count   = 0;  //registros pendentes
+static uint32_t  log_dropped = 0;  //registros sobrescritos antes da gravacao
+static int32_t   log_size    = -1; //tamanho de LOG_FILE; -1 ate a primeira gravacao
+static uint32_t  log_last_temp_s[VESSEL_COUNT];
+static logRecord log_events[LOG_EVENTS_LEN];
+static uint8_t   log_events_count = 0;
+
+//! Relogio do log, em segundos.
+uint32_t nowSeconds(){
+    return millis() / 1000;
+}
+
+//! Coloca um registro da cuba v no anel da RAM; nunca acessa a flash.
+void logEvent(uint8_t event, uint8_t v){
+    STATS_SCOPE(ST_LOG);
+    if (log_count == LOG_RING_LEN){
+        //anel cheio: descarta o mais antigo
+        log_head = (log_head+1) % LOG_RING_LEN;
+        log_count--;
+        log_dropped++;
+    }
+    logRecord &rec = log_ring[(log_head+log_count) % LOG_RING_LEN];
+    rec.timestamp  = nowSeconds();
+    rec.temp       = vessels[v].last_temp;
+    rec.program    = programCode(vessels[v].program) | (v << 2);
+    rec.flags      = relayBits(v) | (event << 2);
+    log_count++;
+
+    if (event != EV_TEMPERATURE){
+        if (log_events_count == LOG_EVENTS_LEN){
+            memmove(&log_events[0],&log_events[1],(LOG_EVENTS_LEN-1)*sizeof(logRecord));
+            log_events_count--;
+        }
+        log_events[log_events_count++] = rec;
+    }
+}
+
+//! Registra a leitura da cuba v, no maximo uma vez a cada LOG_TEMP_INTERVAL_S.
+void logTemperature(uint8_t v){
+    uint32_t now = nowSeconds();
+    if (log_last_temp_s[v] != 0 && now - log_last_temp_s[v] < LOG_TEMP_INTERVAL_S){
+        return;
+    }
+    log_last_temp_s[v] = now;
+    logEvent(EV_TEMPERATURE,v);
+}
+
+//! Grava os n registros mais antigos do anel em LOG_FILE.
+void logWrite(uint8_t n){
+    STATS_SCOPE(ST_LOG_WRITE);
+    if (log_size < 0){
+        log_size = fileExist(LOG_FILE) ? fileGetSize(LOG_FILE) : 0;
+    }
+    if (log_size + n*sizeof(logRecord) > LOG_MAX_BYTES){
+        fileDelete(LOG_OLD_FILE);
+        fileRename(LOG_FILE,LOG_OLD_FILE);
+        log_size = 0;
+    }
+
+    file_t logF = fileOpen(LOG_FILE, eFO_CreateIfNotExist|eFO_Append|eFO_WriteOnly);
+    if (logF < 0){
+        CON_ERR("Nao pude abrir o arquivo de log.");
+        return;
+    }
+    //o anel pode dar a volta: no maximo 2 escritas
+    uint8_t first = n;
+    if (log_head + first > LOG_RING_LEN){
+        first = LOG_RING_LEN - log_head;
+    }
+    flashWrite(logF,&log_ring[log_head],first*sizeof(logRecord));
+    if (first < n){
+        flashWrite(logF,&log_ring[0],(n-first)*sizeof(logRecord));
+    }
+    fileClose(logF);
+
+    log_size += n*sizeof(logRecord);
+    log_head  = (log_head+n) % LOG_RING_LEN;
+    log_count -= n;
+}
+
+//! Tarefa TASK_LOG: grava paginas inteiras ou registros antigos demais.
+void logFlush(){
+    if (log_count == 0){
+        return;
+    }
+    uint8_t n = (log_count / LOG_PAGE_RECORDS) * LOG_PAGE_RECORDS;
+    if (nowSeconds() - log_ring[log_head].timestamp >= LOG_MAX_AGE_S){
+        n = log_count;
+    }
+    if (n > 0){
+        logWrite(n);
+    }
+}
+//-----------------FIM LOG BINARIO-------------------//
+
+//-------------------- CONTROLE ------------------//
+/*! Cada cuba tem seu controlador, que decide quando ligar o compressor
+ * (pins[0]) a partir das leituras e da faixa temp_min..temp_max do programa
+ * ativo. Sempre que o compressor liga, pins[1] recebe o mesmo pulso de antes.
+ *
+ * Modo CTRL_BANG (padrao): liga com leitura >= temp_max + hysteresis e
+ * desliga com leitura <= temp_min - hysteresis. Com hysteresis zero e o
+ * comportamento original.
+ *
+ * Modo CTRL_PID: o alvo e o meio da faixa. A cada leitura o PID recalcula o
+ * duty (0 a 100%) e window_timer liga o compressor durante duty% de cada
+ * janela de window_s segundos (controle proporcional no tempo).
+ *
+ * Modo CTRL_PRED: as mesmas bordas do CTRL_BANG, mas a decisao usa a
+ * temperatura prevista pelo modelo da cuba (ver ctrlModel) ao fim do atraso
+ * aprendido: o compressor liga quando o aquecimento previsto ate o frio
+ * chegar a sonda alcancaria temp_max + hysteresis, e desliga quando o
+ * resfriamento que ainda vem alcancaria temp_min - hysteresis. A antecipacao
+ * nunca passa do meio da faixa; enquanto o modelo nao for confiavel o modo
+ * se comporta como CTRL_BANG.
+ *
+ * Nos dois modos o compressor fica ligado pelo menos min_on_s e desligado
+ * pelo menos min_off_s segundos, inclusive apos o boot. A configuracao chega
+ * pelo topico beer/control (ou beer/<cuba>/control) e e gravada junto com
+ * as demais configuracoes.
+ *
+ * As decisoes saem de TASK_CONTROL, a cada CTRL_TICK_MS, com a ultima leitura
+ * de cada cuba; nada depende do MQTT estar no ar. Com o sensor local o
+ * controle segue normal sem rede. Se uma cuba passa CTRL_STALE_MS sem
+ * leitura o compressor e desligado (respeitando min_on_s) ate a proxima.
+ */
+#define CTRL_BANG 'B'
+#define CTRL_PID  'P'
+#define CTRL_PRED 'M'
+
+//! Configuracao do controlador (persistida no settingsRecord).
+struct ctrlConfig{
+    uint8_t  mode;       /*!< CTRL_BANG, CTRL_PID ou CTRL_PRED */
+    uint8_t  reserved;
+    centi_t  hysteresis; /*!< centesimos alem de temp_min/temp_max */
+    uint16_t min_on_s;   /*!< tempo minimo ligado */
+    uint16_t min_off_s;  /*!< tempo minimo desligado */
+    int16_t  kp;         /*!< % de duty por grau de erro */
+    int16_t  ki;         /*!< % de duty por grau*hora acumulado */
+    int16_t  kd;         /*!< % de duty por grau/minuto de variacao */
+    uint16_t window_s;   /*!< janela do modo PID */
+};
+
+//! Configuracao de fabrica do controlador.
+#define CTRL_DEFAULT {CTRL_BANG,0,0,60,180,20,10,0,600}
+
+static ctrlConfig ctrl_cfg[VESSEL_COUNT];
+
+//! Estado do PID de uma cuba e os Timers da sua janela.
+struct ctrlState{
+    int32_t  integral; /*!< centesimos*segundo */
+    centi_t  last_err; /*!< erro da leitura anterior */
+    uint32_t last_ms;  /*!< millis() da leitura anterior; 0 se nenhuma */
+    uint8_t  duty;     /*!< % da janela com o compressor ligado */
+    uint8_t  vessel;   /*!< cuba controlada */
+    bool     stale;    /*!< sem leitura recente */
+    Timer    window_timer;
+    Timer    off_timer;
+    void window();
+    void windowOff();
+};
+
+static ctrlState ctrl[VESSEL_COUNT];
+
+//! Liga ou desliga o compressor da cuba v respeitando os tempos minimos.
+bool ctrlCompressor(uint8_t v, bool on){
+    relaySeq &r = relayOf(v,RELAY_ONE);
+    bool is_on  = r.level == HIGH;
+    if (on == is_on){
+        return false;
+    }
+    uint32_t elapsed_s = (millis() - r.changed_ms) / 1000;
+    if (elapsed_s < (is_on ? ctrl_cfg[v].min_on_s : ctrl_cfg[v].min_off_s)){
+        return false;
+    }
+    relaySet(r,on ? HIGH : LOW);
+    relaySeq &pulse = relayOf(v,RELAY_TWO);
+    if (on && !relayBusy(pulse)){
+        relayPush(pulse,LOW,300);
+        relayPush(pulse,HIGH,1500);
+        relayPush(pulse,LOW,0);
+    }
+    return true;
+}
+
+//! Liga/desliga com histerese nas bordas da faixa.
+void ctrlBang(uint8_t v, centi_t temp, centi_t min, centi_t max){
+    if (temp <= min - ctrl_cfg[v].hysteresis){
+        ctrlCompressor(v,false);
+    }
+    else if (temp >= max + ctrl_cfg[v].hysteresis){
+        ctrlCompressor(v,true);
+    }
+}
+
+/*! Modelo termico de primeira ordem com tempo morto, aprendido em todos os
+ * modos a cada CTRL_MODEL_SAMPLE_MS com a ultima leitura:
+ *
+ *   dT[k] = warm + drop * u[k - d]
+ *
+ * dT e a variacao em centesimos desde a amostra anterior, u o compressor
+ * (guardado bit a bit em u_hist, uma amostra por bit) e d o atraso em
+ * amostras. warm e drop saem de um minimos quadrados recursivo (RLS) com
+ * esquecimento CTRL_MODEL_LAMBDA, todo em ponto fixo Q16: theta = {warm,
+ * drop} e a matriz de covariancia p[2][2]. O aquecimento e warm e o
+ * resfriamento warm + drop, em centesimos por amostra.
+ *
+ * O atraso vem das trocas do compressor: depois de ligar, o tempo ate a
+ * amostra seguinte ao pico da leitura, confirmado quando ela cai
+ * CTRL_MODEL_NOISE abaixo dele; depois de desligar, ate a seguinte ao vale,
+ * confirmado quando sobe CTRL_MODEL_NOISE.
+ * A distancia e medida do extremo e nao entre duas amostras, senao uma cuba
+ * que varia menos de CTRL_MODEL_NOISE por amostra nunca teria atraso. Cada
+ * medida entra em lag_s por media movel exponencial (1/4). Memoria
+ * constante: nada alem de ctrlModel por cuba.
+ */
+#define CTRL_MODEL_SAMPLE_MS 30000
+#define CTRL_MODEL_LAMBDA    65405      //0.998 em Q16
+#define CTRL_MODEL_P0        (100L << 16)
+#define CTRL_MODEL_P_MAX     (1000L << 16)
+#define CTRL_MODEL_WARMUP    20         //amostras antes de confiar no modelo
+#define CTRL_MODEL_NOISE     3          //centesimos
+#define CTRL_MODEL_LAG_MAX   63         //amostras (bits em u_hist)
+
+//! Estado do estimador de uma cuba.
+struct ctrlModel{
+    int32_t  theta[2];   /*!< warm, drop em centesimos/amostra, Q16 */
+    int32_t  p[2][2];    /*!< covariancia, Q16 */
+    uint64_t u_hist;     /*!< bit i: compressor i amostras atras */
+    centi_t  last_temp;  /*!< leitura da amostra anterior */
+    uint32_t last_ms;    /*!< millis() da amostra anterior; 0 se nenhuma */
+    uint16_t samples;    /*!< amostras usadas, saturado */
+    uint16_t lag_s;      /*!< atraso aprendido */
+    uint32_t switch_ms;  /*!< millis() da ultima troca ainda sem resposta; 0 se nenhuma */
+    uint32_t peak_ms;    /*!< millis() do extremo desde a troca */
+    centi_t  peak_temp;  /*!< extremo da leitura desde a troca */
+    bool     switch_on;  /*!< sentido da ultima troca */
+};
+
+static ctrlModel ctrl_model[VESSEL_COUNT];
+
+//! Volta o modelo da cuba v ao estado inicial.
+void ctrlModelReset(uint8_t v){
+    ctrlModel &m = ctrl_model[v];
+    memset(&m,0,sizeof(m));
+    m.p[0][0] = CTRL_MODEL_P0;
+    m.p[1][1] = CTRL_MODEL_P0;
+}
+
+//! Um passo do RLS com regressor {1, u} e saida dT (centesimos).
+static void ctrlModelRls(ctrlModel &m, int32_t u, int32_t dT){
+    int32_t phi[2] = {1, u};
+    int64_t pphi[2];
+    for (int i=0;i<2;i++){
+        pphi[i] = (int64_t)m.p[i][0]*phi[0] + (int64_t)m.p[i][1]*phi[1];
+    }
+    int64_t den = CTRL_MODEL_LAMBDA + phi[0]*pphi[0] + phi[1]*pphi[1];
+    int64_t err = ((int64_t)dT << 16) - ((int64_t)m.theta[0]*phi[0] + (int64_t)m.theta[1]*phi[1]);
+    int64_t k[2];
+    for (int i=0;i<2;i++){
+        k[i] = (pphi[i] << 16) / den;
+        m.theta[i] += (k[i] * err) >> 16;
+    }
+    //sem excitacao a covariancia cresce com 1/lambda: limita em P_MAX
+    bool forget = m.p[0][0] < CTRL_MODEL_P_MAX && m.p[1][1] < CTRL_MODEL_P_MAX;
+    for (int i=0;i<2;i++){
+        for (int j=0;j<2;j++){
+            int64_t pij = m.p[i][j] - ((k[i] * pphi[j]) >> 16);
+            if (forget){
+                pij = (pij << 16) / CTRL_MODEL_LAMBDA;
+            }
+            m.p[i][j] = pij;
+        }
+    }
+}
+
+//! Amostra do modelo da cuba v; chamada a cada tick com a ultima leitura.
+void ctrlModelUpdate(uint8_t v, centi_t temp, uint32_t now){
+    ctrlModel &m  = ctrl_model[v];
+    bool       on = relayOf(v,RELAY_ONE).level == HIGH;
+    if (m.last_ms == 0 && m.samples == 0){
+        ctrlModelReset(v);
+    }
+    if (m.last_ms != 0 && now - m.last_ms < CTRL_MODEL_SAMPLE_MS){
+        return;
+    }
+    //buraco nas leituras (cuba sem leitura): recomeca a partir desta amostra
+    if (m.last_ms != 0 && now - m.last_ms > 2*CTRL_MODEL_SAMPLE_MS){
+        m.last_ms   = 0;
+        m.switch_ms = 0;
+    }
+    bool was_on = m.u_hist & 1;
+    if (m.last_ms != 0){
+        int32_t  dT = temp - m.last_temp;
+        uint8_t  d  = (m.lag_s * 1000UL + CTRL_MODEL_SAMPLE_MS/2) / CTRL_MODEL_SAMPLE_MS;
+        if (d > CTRL_MODEL_LAG_MAX){
+            d = CTRL_MODEL_LAG_MAX;
+        }
+        ctrlModelRls(m,(m.u_hist >> d) & 1,dT);
+        if (m.samples < 0xFFFF){
+            m.samples++;
+        }
+        //resposta a ultima troca: o extremo ficou CTRL_MODEL_NOISE para tras
+        if (m.switch_ms != 0 && (m.switch_on ? temp >= m.peak_temp : temp <= m.peak_temp)){
+            m.peak_temp = temp;
+            m.peak_ms   = now;
+        }
+        else if (m.switch_ms != 0 && (m.switch_on ? temp <= m.peak_temp - CTRL_MODEL_NOISE
+                                                  : temp >= m.peak_temp + CTRL_MODEL_NOISE)){
+            uint32_t lag = (m.peak_ms + CTRL_MODEL_SAMPLE_MS - m.switch_ms) / 1000;
+            if (lag > (uint32_t)CTRL_MODEL_LAG_MAX * CTRL_MODEL_SAMPLE_MS / 1000){
+                lag = (uint32_t)CTRL_MODEL_LAG_MAX * CTRL_MODEL_SAMPLE_MS / 1000;
+            }
+            m.lag_s     = m.lag_s == 0 ? lag : m.lag_s + ((int32_t)lag - m.lag_s) / 4;
+            m.switch_ms = 0;
+        }
+    }
+    if (m.last_ms == 0 || on != was_on){
+        m.switch_ms = m.last_ms == 0 ? 0 : now;
+        m.switch_on = on;
+        m.peak_ms   = now;
+        m.peak_temp = temp;
+    }
+    m.u_hist    = (m.u_hist << 1) | (on ? 1 : 0);
+    m.last_temp = temp;
+    m.last_ms   = now;
+}
+
+//! Verdadeiro quando o modelo da cuba v ja pode antecipar trocas.
+bool ctrlModelReady(uint8_t v){
+    const ctrlModel &m = ctrl_model[v];
+    return m.samples >= CTRL_MODEL_WARMUP && m.lag_s > 0 &&
+           m.theta[0] > 0 && m.theta[0] + m.theta[1] < 0;
+}
+
+//! Variacao prevista em centesimos ao longo do atraso aprendido.
+static centi_t ctrlModelDrift(const ctrlModel &m, bool on){
+    int64_t rate = on ? (int64_t)m.theta[0] + m.theta[1] : m.theta[0];
+    return (rate * m.lag_s * 1000 / CTRL_MODEL_SAMPLE_MS) >> 16;
+}
+
+//! Bordas do CTRL_BANG aplicadas a temperatura prevista ao fim do atraso.
+void ctrlPred(uint8_t v, centi_t temp, centi_t min, centi_t max){
+    if (!ctrlModelReady(v)){
+        ctrlBang(v,temp,min,max);
+        return;
+    }
+    const ctrlModel &m   = ctrl_model[v];
+    centi_t          h   = ctrl_cfg[v].hysteresis;
+    centi_t          mid = (min + max) / 2;
+    if (relayOf(v,RELAY_ONE).level == HIGH){
+        if (temp <= min - h || (temp < mid && temp + ctrlModelDrift(m,true) <= min - h)){
+            ctrlCompressor(v,false);
+        }
+    }
+    else{
+        if (temp >= max + h || (temp > mid && temp + ctrlModelDrift(m,false) >= max + h)){
+            ctrlCompressor(v,true);
+        }
+    }
+}
+
+//! Atualiza o duty do PID; erro positivo pede mais frio.
+void ctrlPid(uint8_t v, centi_t temp, centi_t min, centi_t max){
+    const ctrlConfig &cfg = ctrl_cfg[v];
+    ctrlState        &st  = ctrl[v];
+    uint32_t now = millis();
+    int32_t  err = temp - (min + max) / 2;
+    int32_t  deriv = 0;
+
+    if (st.last_ms != 0){
+        int32_t dt_s = (now - st.last_ms) / 1000;
+        if (dt_s <= 0){
+            return;
+        }
+        st.integral += err * dt_s;
+        //anti-windup: a parcela integral sozinha nunca passa de 100%
+        if (cfg.ki > 0){
+            int32_t limit = (int32_t)100 * 100 * 3600 / cfg.ki;
+            if (st.integral > limit)  st.integral = limit;
+            if (st.integral < -limit) st.integral = -limit;
+        }
+        deriv = (err - st.last_err) * 60 / dt_s;
+    }
+    st.last_ms  = now;
+    st.last_err = err;
+
+    int32_t out = (cfg.kp * err + cfg.ki * (st.integral / 3600) + cfg.kd * deriv) / 100;
+    st.duty = out < 0 ? 0 : (out > 100 ? 100 : out);
+}
+
+//! Fim da parcela ligada da janela.
+void ctrlState::windowOff(){
+    ctrlCompressor(vessel,false);
+}
+
+//! Inicio de cada janela do modo PID.
+void ctrlState::window(){
+    const ctrlConfig &cfg = ctrl_cfg[vessel];
+    uint32_t w    = cfg.window_s;
+    uint32_t on_s = w * duty / 100;
+    if (on_s < cfg.min_on_s){
+        on_s = 0;
+    }
+    else if (w - on_s < cfg.min_off_s){
+        on_s = w;
+    }
+
+    if (on_s == 0){
+        ctrlCompressor(vessel,false);
+        return;
+    }
+    ctrlCompressor(vessel,true);
+    if (on_s < w){
+        off_timer.initializeMs(on_s*1000,TimerDelegate(&ctrlState::windowOff,this)).startOnce();
+    }
+}
+
+//! Aplica ctrl_cfg[v]: arma ou para os Timers do modo PID da cuba v.
+void ctrlApplyConfig(uint8_t v){
+    ctrlState &st = ctrl[v];
+    st.off_timer.stop();
+    st.integral = 0;
+    st.last_ms  = 0;
+    st.duty     = 0;
+    st.vessel   = v;
+    if (ctrl_cfg[v].mode == CTRL_PID){
+        st.window_timer.initializeMs((uint32_t)ctrl_cfg[v].window_s*1000,TimerDelegate(&ctrlState::window,&st)).start();
+    }
+    else{
+        st.window_timer.stop();
+    }
+}
+
+//! system_get_time() da primeira decisao do controlador apos o reset.
+static uint32_t boot_decision_us = 0;
+
+//! Entrada do controlador: uma leitura da cuba v em centesimos de grau.
+void ctrlUpdate(uint8_t v, centi_t temp){
+    STATS_SCOPE(ST_CONTROL);
+    if (boot_decision_us == 0){
+        boot_decision_us = system_get_time();
+    }
+    if (ctrl_cfg[v].mode == CTRL_PID){
+        ctrlPid(v,temp,vessels[v].temp_min,vessels[v].temp_max);
+    }
+    else if (ctrl_cfg[v].mode == CTRL_PRED){
+        ctrlPred(v,temp,vessels[v].temp_min,vessels[v].temp_max);
+    }
+    else{
+        ctrlBang(v,temp,vessels[v].temp_min,vessels[v].temp_max);
+    }
+}
+
+#define CTRL_TICK_MS  5000
+#define CTRL_STALE_MS 600000
+
+//! Tarefa TASK_CONTROL: uma decisao por cuba com a ultima leitura.
+void ctrlTick(){
+    uint32_t now = millis();
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        const vessel &ves = vessels[v];
+        ctrlState    &st  = ctrl[v];
+        if (ves.reading_ms == 0){
+            continue; //sem leitura desde o boot: mantem o estado restaurado
+        }
+        if (now - ves.reading_ms > CTRL_STALE_MS){
+            if (!st.stale){
+                st.stale = true;
+                logEvent(EV_STALE,v);
+                CON_WARN("Cuba %u sem leitura; compressor desligado.",v);
+            }
+            st.duty = 0;
+            ctrlCompressor(v,false);
+            continue;
+        }
+        st.stale = false;
+        ctrlModelUpdate(v,ves.last_temp,now);
+        ctrlUpdate(v,ves.last_temp);
+    }
+}
+
+//! Le B|HISTERESE|MIN_ON|MIN_OFF, M|HISTERESE|MIN_ON|MIN_OFF ou
+//! P|KP|KI|KD|JANELA (ex.: B|0.2|60|180).
+parseError parseControl(const char *s, size_t len, ctrlConfig *cfg){
+    const char *field[5];
+    size_t      flen[5];
+    size_t      n = splitFields(s,len,field,flen,5);
+    if (n == 0 || flen[0] != 1){
+        return PARSE_FIELDS;
+    }
+
+    ctrlConfig tmp = *cfg;
+    int32_t    v[4];
+    parseError err = PARSE_OK;
+    if (field[0][0] == CTRL_BANG || field[0][0] == CTRL_PRED){
+        if (n != 4){
+            return PARSE_FIELDS;
+        }
+        err = parseCenti(field[1],flen[1],&tmp.hysteresis);
+        for (int i=2;i<4 && err == PARSE_OK;i++){
+            err = parseInt(field[i],flen[i],0,3600,&v[i]);
+        }
+        if (err != PARSE_OK){
+            return err;
+        }
+        if (tmp.hysteresis < 0){
+            return PARSE_RANGE;
+        }
+        tmp.min_on_s  = v[2];
+        tmp.min_off_s = v[3];
+    }
+    else if (field[0][0] == CTRL_PID){
+        if (n != 5){
+            return PARSE_FIELDS;
+        }
+        for (int i=1;i<5 && err == PARSE_OK;i++){
+            err = i < 4 ? parseInt(field[i],flen[i],0,1000,&v[i-1])
+                        : parseInt(field[i],flen[i],60,3600,&v[i-1]);
+        }
+        if (err != PARSE_OK){
+            return err;
+        }
+        tmp.kp       = v[0];
+        tmp.ki       = v[1];
+        tmp.kd       = v[2];
+        tmp.window_s = v[3];
+    }
+    else{
+        return PARSE_FIELDS;
+    }
+    tmp.mode = field[0][0];
+    *cfg = tmp;
+    return PARSE_OK;
+}
+//-----------------FIM CONTROLE-------------------//
+
+//-------------------- CAIXA DE SAIDA ------------------//
+/*! Tudo o que vai para o broker sem ser resposta imediata (lotes de
+ * telemetria e de eventos, alertas) passa por outboxSend(). Com a sessao MQTT aberta e
+ * a fila vazia o payload e publicado na hora; caso contrario ele e anexado a
+ * OUTBOX_FILE como um registro [outboxHeader][payload].
+ *
+ * A fila e limitada: quando OUTBOX_FILE passaria de OUTBOX_MAX_BYTES ele vira
+ * OUTBOX_OLD_FILE e o OUTBOX_OLD_FILE anterior, o mais antigo, e descartado
+ * (contado em outbox_dropped). A flash nunca guarda mais que
+ * 2 * OUTBOX_MAX_BYTES, o suficiente para alguns dias de telemetria.
+ *
+ * Quando a sessao volta, TASK_OUTBOX publica um registro a cada
+ * OUTBOX_DRAIN_MS, do mais antigo para o mais novo, para nao inundar o
+ * broker; enquanto a fila nao esvazia, os lotes novos entram no fim dela e a
+ * ordem se mantem. A posicao de leitura fica so na RAM e so avanca quando
+ * publishWithQoS() aceita o registro: um reboot no meio da drenagem repete
+ * registros ja enviados, nunca os perde. Um envio direto recusado tambem vai
+ * para a fila.
+ *
+ * Uma queda de energia no meio de outboxPush() deixa um registro incompleto
+ * no fim do arquivo. No boot outboxRepair() corta cada arquivo no fim do
+ * ultimo registro integro (copiando o prefixo para um .tmp); se
+ * mesmo assim a drenagem encontrar um registro ilegivel, so o resto daquele
+ * arquivo e descartado (contado em outbox_dropped).
+ */
+#define OUTBOX_FILE       "/flash/outbox.bin"
+#define OUTBOX_OLD_FILE   "/flash/outbox.0.bin"
+#define OUTBOX_TMP        "/flash/outbox.tmp"
+#define OUTBOX_OLD_TMP    "/flash/outbox.0.tmp"
+#define OUTBOX_MAX_BYTES  16384
+#define OUTBOX_DRAIN_MS   1000
+#define OUTBOX_RECORD_MAX 600
+#define OUTBOX_TELEMETRY  'T'
+#define OUTBOX_EVENTS     'E'
+#define OUTBOX_ALERT      'A'
+
+//! Cabecalho de cada registro da fila.
+struct outboxHeader{
+    uint8_t  type; /*!< OUTBOX_TELEMETRY, OUTBOX_EVENTS ou OUTBOX_ALERT */
+    uint8_t  qos;  /*!< QoS da publicacao */
+    uint16_t len;  /*!< bytes do payload */
+};
+
+static bool     outbox_pending = false; //ha registros em flash
+static int32_t  outbox_size    = -1;    //tamanho de OUTBOX_FILE; -1 ate consultar
+static uint32_t outbox_read    = 0;     //proximo registro do arquivo sendo drenado
+static uint32_t outbox_queued  = 0;     //registros enfileirados
+static uint32_t outbox_sent    = 0;     //registros drenados
+static uint32_t outbox_dropped = 0;     //bytes descartados com a fila cheia
+
+void outboxDrain();
+
+//! Topico de cada tipo de registro.
+const char *outboxTopic(uint8_t type){
+    switch (type){
+        case OUTBOX_EVENTS: return "freezer/events";
+        case OUTBOX_ALERT:  return "freezer/alert";
+    }
+    return "freezer/telemetry";
+}
+
+//! Anexa um registro a OUTBOX_FILE, girando os arquivos se preciso.
+void outboxPush(uint8_t type, const uint8_t *data, size_t len, uint8_t qos){
+    if (outbox_size < 0){
+        outbox_size = fileExist(OUTBOX_FILE) ? fileGetSize(OUTBOX_FILE) : 0;
+    }
+    if (outbox_size + sizeof(outboxHeader) + len > OUTBOX_MAX_BYTES){
+        if (fileExist(OUTBOX_OLD_FILE)){
+            //o antigo estava sendo drenado: perde o que faltava
+            outbox_dropped += fileGetSize(OUTBOX_OLD_FILE) - outbox_read;
+            fileDelete(OUTBOX_OLD_FILE);
+            outbox_read = 0;
+        }
+        //sem antigo, outbox_read ja se refere a OUTBOX_FILE, que vira o antigo
+        fileRename(OUTBOX_FILE,OUTBOX_OLD_FILE);
+        outbox_size = 0;
+    }
+
+    file_t f = fileOpen(OUTBOX_FILE,eFO_CreateIfNotExist|eFO_Append|eFO_WriteOnly);
+    if (f < 0){
+        CON_ERR("Nao pude abrir a fila de saida.");
+        return;
+    }
+    outboxHeader hdr = {type,qos,(uint16_t)len};
+    flashWrite(f,&hdr,sizeof(hdr));
+    flashWrite(f,data,len);
+    fileClose(f);
+    outbox_size += sizeof(hdr) + len;
+    outbox_queued++;
+    if (!outbox_pending){
+        outbox_pending = true;
+        taskStart(TASK_OUTBOX,outboxDrain,OUTBOX_DRAIN_MS,OUTBOX_DRAIN_MS);
+    }
+}
+
+//! Publica agora ou enfileira, mantendo a ordem.
+void outboxSend(uint8_t type, const uint8_t *data, size_t len, uint8_t qos){
+    if (mqttOnline() && !outbox_pending &&
+        mqtt.publishWithQoS(outboxTopic(type),String((const char*)data,len),qos)){
+        return;
+    }
+    outboxPush(type,data,len,qos);
+}
+
+//! Arquivo da fila drenado (ou descartado): apaga e passa ao proximo.
+static void outboxDone(const char *file, bool old){
+    fileDelete(file);
+    files_dirty = true;
+    outbox_read = 0;
+    if (!old){
+        outbox_size    = 0;
+        outbox_pending = false;
+        taskStop(TASK_OUTBOX);
+    }
+}
+
+//! Tarefa TASK_OUTBOX: publica o registro mais antigo.
+void outboxDrain(){
+    if (!mqttOnline()){
+        return;
+    }
+    bool        old  = fileExist(OUTBOX_OLD_FILE);
+    const char *file = old ? OUTBOX_OLD_FILE : OUTBOX_FILE;
+    static_assert(OUTBOX_RECORD_MAX <= POOL_BLOCK,"registro maior que o bloco");
+    poolBuf scratch;
+    if (scratch.p == NULL){
+        return; //tenta de novo no proximo tick
+    }
+    uint8_t *buf = scratch.p;
+    outboxHeader hdr;
+    file_t f = fileOpen(file,eFO_ReadOnly);
+    if (f < 0){
+        return; //tenta de novo no proximo tick
+    }
+    int got = -1;
+    int n   = -1;
+    if (fileSeek(f,outbox_read,eSO_FileStart) >= 0){
+        got = flashRead(f,&hdr,sizeof(hdr));
+        if (got == sizeof(hdr) && hdr.len <= OUTBOX_RECORD_MAX){
+            n = flashRead(f,buf,hdr.len);
+        }
+    }
+    fileClose(f);
+
+    if (got < 0){
+        return; //falha de leitura: mesmo registro no proximo tick
+    }
+    if (got == 0){
+        outboxDone(file,old); //fim do arquivo
+        return;
+    }
+    if (n != hdr.len){
+        //registro ilegivel: sem como achar o proximo, descarta o resto do arquivo
+        uint32_t lost = fileGetSize(file) - outbox_read;
+        CON_WARN("Fila de saida: registro invalido, %u bytes descartados.",lost);
+        outbox_dropped += lost;
+        outboxDone(file,old);
+        return;
+    }
+    if (!mqtt.publishWithQoS(outboxTopic(hdr.type),String((const char*)buf,n),hdr.qos)){
+        return; //nao aceito: o mesmo registro no proximo tick
+    }
+    outbox_read += sizeof(hdr) + n;
+    outbox_sent++;
+}
+
+//! Fim do ultimo registro integro de file.
+uint32_t outboxValidEnd(const char *file){
+    file_t f = fileOpen(file,eFO_ReadOnly);
+    if (f < 0){
+        return 0;
+    }
+    uint32_t     size = fileGetSize(file);
+    uint32_t     end  = 0;
+    outboxHeader hdr;
+    while (end + sizeof(hdr) <= size && fileSeek(f,end,eSO_FileStart) >= 0 &&
+           flashRead(f,&hdr,sizeof(hdr)) == sizeof(hdr) &&
+           hdr.len <= OUTBOX_RECORD_MAX && end + sizeof(hdr) + hdr.len <= size){
+        end += sizeof(hdr) + hdr.len;
+    }
+    fileClose(f);
+    return end;
+}
+
+//! Corta file no fim do ultimo registro integro (queda no meio de um outboxPush()).
+/*! tmp so existe durante a copia: com file presente ele e descartavel; sem
+ * file (queda entre apagar e renomear) ele e a copia completa. */
+void outboxRepair(const char *file, const char *tmp){
+    if (fileExist(tmp)){
+        if (fileExist(file)){
+            fileDelete(tmp);
+        }
+        else{
+            fileRename(tmp,file);
+        }
+    }
+    if (!fileExist(file)){
+        return;
+    }
+    uint32_t size = fileGetSize(file);
+    uint32_t end  = outboxValidEnd(file);
+    if (end == size){
+        return;
+    }
+    CON_WARN("Fila de saida: %u bytes incompletos em %s.",size - end,file);
+    outbox_dropped += size - end;
+    if (end == 0){
+        fileDelete(file);
+        return;
+    }
+    //sem truncamento no SPIFFS: copia o prefixo integro e troca os arquivos
+    poolBuf  scratch;
+    uint32_t done = 0;
+    file_t   src  = fileOpen(file,eFO_ReadOnly);
+    file_t   dst  = fileOpen(tmp,eFO_CreateNewAlways|eFO_WriteOnly);
+    while (scratch.p != NULL && src >= 0 && dst >= 0 && done < end){
+        uint32_t n = end - done < POOL_BLOCK ? end - done : POOL_BLOCK;
+        if (flashRead(src,scratch.p,n) != (int)n || flashWrite(dst,scratch.p,n) != (int)n){
+            break;
+        }
+        done += n;
+    }
+    if (src >= 0){
+        fileClose(src);
+    }
+    if (dst >= 0){
+        fileClose(dst);
+    }
+    if (done != end){
+        //a drenagem descarta o que vier depois do registro incompleto
+        fileDelete(tmp);
+        return;
+    }
+    fileDelete(file);
+    fileRename(tmp,file);
+}
+
+//! Retoma uma fila deixada em flash antes do reset.
+void outboxBegin(){
+    outboxRepair(OUTBOX_OLD_FILE,OUTBOX_OLD_TMP);
+    outboxRepair(OUTBOX_FILE,OUTBOX_TMP);
+    if (fileExist(OUTBOX_FILE) || fileExist(OUTBOX_OLD_FILE)){
+        outbox_pending = true;
+        taskStart(TASK_OUTBOX,outboxDrain,OUTBOX_DRAIN_MS,OUTBOX_DRAIN_MS);
+    }
+}
+//-----------------FIM CAIXA DE SAIDA-------------------//
+
+//-------------------- TELEMETRIA ------------------//
+/*! As leituras do controlador e o estado dos reles sao acumulados em um lote
+ * e publicados de uma vez em freezer/telemetry (pela fila de saida, que os
+ * guarda em flash sem rede), a cada telemetry_interval_s
+ * segundos (no maximo uma amostra a cada TELEMETRY_SAMPLE_S). O payload e
+ * binario, little-endian:
+ *
+ *   uint8  versao (TELEMETRY_VERSION)
+ *   uint8  numero de amostras n
+ *   uint32 timestamp da primeira amostra (segundos)
+ *   n vezes:
+ *     varint  (dt << 5) | (cuba << 2) | reles
+ *             dt em segundos desde a amostra anterior (0 na primeira);
+ *             reles: bit 0 compressor, bit 1 pulso
+ *     varint  zigzag(dtemp)
+ *             diferenca em centesimos para a amostra anterior da mesma cuba
+ *             (a primeira de cada cuba e relativa a zero)
+ *
+ * Com leituras estaveis a cada TELEMETRY_SAMPLE_S cada amostra ocupa 3
+ * bytes: 2 do cabecalho (dt de 4 a 511 s) e 1 da diferenca (ate +-0.63
+ * grau); um JSON por amostra passa de 80 bytes no ar. O pior caso e 8 bytes
+ * por amostra, o que TELEMETRY_PAYLOAD reserva. O intervalo e a QoS podem
+ * ser trocados em beer/telemetry (INTERVALO|QOS, ex.: 60|0).
+ */
+#define TELEMETRY_VERSION    2
+#define TELEMETRY_SAMPLES    64
+#define TELEMETRY_SAMPLE_S   10
+#define TELEMETRY_INTERVAL_S 60
+#define TELEMETRY_PAYLOAD    (6 + TELEMETRY_SAMPLES*8)
+static_assert(TELEMETRY_PAYLOAD <= OUTBOX_RECORD_MAX, "lote maior que um registro da fila");
+static_assert(TELEMETRY_PAYLOAD <= POOL_BLOCK, "lote maior que um bloco do pool");
+
+//! Amostra do lote.
+struct telemetrySample{
+    uint32_t timestamp;
+    centi_t  temp;
+    uint8_t  vessel;
+    uint8_t  relays;
+};
+
+static telemetrySample telemetry[TELEMETRY_SAMPLES];
+static uint8_t  telemetry_count      = 0;
+static uint32_t telemetry_last_s[VESSEL_COUNT]; //ultima amostra de cada cuba
+static uint16_t telemetry_interval_s = TELEMETRY_INTERVAL_S;
+static uint8_t  telemetry_qos        = 0;
+
+static inline uint8_t *putVarint(uint8_t *p, uint32_t v){
+    while (v >= 0x80){
+        *p++ = (v & 0x7F) | 0x80;
+        v  >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+//! Monta o payload do lote em buf; retorna o tamanho.
+size_t telemetryEncode(uint8_t *buf){
+    uint8_t *p = buf;
+    centi_t  prev_temp[VESSEL_COUNT] = {0};
+    uint32_t prev_ts = telemetry[0].timestamp;
+    *p++ = TELEMETRY_VERSION;
+    *p++ = telemetry_count;
+    memcpy(p,&prev_ts,4);
+    p += 4;
+    for (uint8_t i=0;i<telemetry_count;i++){
+        const telemetrySample &cur = telemetry[i];
+        int32_t dtemp = cur.temp - prev_temp[cur.vessel];
+        p = putVarint(p,((cur.timestamp - prev_ts) << 5) | (cur.vessel << 2) | cur.relays);
+        p = putVarint(p,((uint32_t)dtemp << 1) ^ (uint32_t)(dtemp >> 31));
+        prev_ts = cur.timestamp;
+        prev_temp[cur.vessel] = cur.temp;
+    }
+    return p - buf;
+}
+
+//! Publica e esvazia o lote; sem bloco livre o lote fica para a proxima vez.
+void telemetryFlush(){
+    if (telemetry_count > 0){
+        poolBuf buf;
+        if (buf.p != NULL){
+            size_t len = telemetryEncode(buf.p);
+            outboxSend(OUTBOX_TELEMETRY,buf.p,len,telemetry_qos);
+            telemetry_count = 0;
+        }
+    }
+    if (log_events_count > 0){
+        outboxSend(OUTBOX_EVENTS,(const uint8_t*)log_events,log_events_count*sizeof(logRecord),telemetry_qos);
+        log_events_count = 0;
+    }
+}
+
+//! Acrescenta uma leitura da cuba v ao lote.
+void telemetryAdd(uint8_t v, centi_t temp){
+    uint32_t now = nowSeconds();
+    if (telemetry_last_s[v] != 0 && now - telemetry_last_s[v] < TELEMETRY_SAMPLE_S){
+        return;
+    }
+    telemetry_last_s[v] = now;
+    if (telemetry_count == TELEMETRY_SAMPLES){
+        memmove(&telemetry[0],&telemetry[1],(TELEMETRY_SAMPLES-1)*sizeof(telemetrySample));
+        telemetry_count--;
+    }
+    telemetry[telemetry_count++] = {now,temp,v,relayBits(v)};
+}
+
+//! (Re)agenda TASK_TELEMETRY com o intervalo atual.
+void telemetryBegin(){
+    taskStart(TASK_TELEMETRY,telemetryFlush,(uint32_t)telemetry_interval_s*1000,(uint32_t)telemetry_interval_s*1000);
+}
+//-----------------FIM TELEMETRIA-------------------//
+
+void histAdd(uint8_t v, centi_t temp);
+
+//! Caminho comum de toda leitura aceita da cuba v, local ou via MQTT.
+/*! A decisao do controlador fica para o proximo ctrlTick(). */
+void processReading(uint8_t v, centi_t value){
+    vessels[v].last_temp  = value;
+    vessels[v].reading_ms = millis();
+    logTemperature(v);
+    telemetryAdd(v,value);
+    histAdd(v,value);
+}
+
+//-------------------- SENSOR LOCAL ------------------//
+/*! Com SENSOR_PIN definido, um DS18B20 e lido a cada SENSOR_PERIOD_MS por
+ * TASK_SENSOR. A conversao e iniciada em um tick e lida no seguinte, entao o
+ * Timer nunca espera pelo sensor. Uma leitura de exatamente 85.00 graus e o
+ * valor do scratchpad depois de um power-on reset (queda de tensao no
+ * barramento, conversao que nao aconteceu) e e descartada antes do filtro;
+ * nenhum mosto chega a 85 graus. Cada amostra restante passa por:
+ *
+ * - mediana das 3 ultimas leituras brutas (remove espinhos isolados);
+ * - rejeicao de outliers: uma mediana a mais de SENSOR_OUTLIER da media e
+ *   descartada, ate SENSOR_MAX_REJECT vezes seguidas (depois disso e tratada
+ *   como degrau real e a media recomeca dela);
+ * - media exponencial em ponto fixo (centesimos << 4, alfa 1/2^SENSOR_EMA_SHIFT).
+ *
+ * O valor filtrado alimenta o controlador diretamente e e publicado em
+ * freezer/temperature apenas quando muda SENSOR_PUBLISH_DELTA ou mais (no
+ * maximo a cada SENSOR_PUBLISH_MIN_MS) ou quando SENSOR_PUBLISH_MAX_MS passa
+ * sem publicacao. Enquanto o sensor local estiver valido, as leituras de
+ * beer/temperature nao comandam o controlador.
+ */
+#define SENSOR_PERIOD_MS      1000
+#define SENSOR_POWER_ON       8500  //85.00 graus: conversao nao feita
+#define SENSOR_OUTLIER        200   //2.00 graus
+#define SENSOR_MAX_REJECT     5
+#define SENSOR_EMA_SHIFT      2
+#define SENSOR_STALE_MS       30000 //sem amostra valida: volta para beer/temperature
+#define SENSOR_PUBLISH_DELTA  10    //0.10 grau
+#define SENSOR_PUBLISH_MIN_MS 5000
+#define SENSOR_PUBLISH_MAX_MS 60000
+
+//! Estado do filtro do sensor local.
+struct sensorState{
+    centi_t  raw[3];         /*!< ultimas leituras brutas */
+    uint8_t  raw_count;      /*!< leituras em raw (ate 3) */
+    uint8_t  raw_next;       /*!< proxima posicao em raw */
+    uint8_t  rejected;       /*!< outliers seguidos */
+    int32_t  ema;            /*!< media, centesimos << 4 */
+    bool     has_ema;
+    uint32_t last_valid_ms;  /*!< millis() da ultima amostra aceita */
+    centi_t  published;      /*!< ultimo valor publicado */
+    uint32_t published_ms;   /*!< millis() da ultima publicacao */
+};
+
+static sensorState sensor = {};
+
+#ifdef SENSOR_PIN
+DS18S20 ds;
+#endif
+
+//! Verdadeiro enquanto o sensor local fornece amostras validas.
+bool sensorActive(){
+#ifdef SENSOR_PIN
+    return sensor.has_ema && millis() - sensor.last_valid_ms < SENSOR_STALE_MS;
+#else
+    return false;
+#endif
+}
+
+static inline centi_t median3(centi_t a, centi_t b, centi_t c){
+    if (a > b){
+        centi_t t = a; a = b; b = t;
+    }
+    if (b > c){
+        b = c;
+    }
+    return a > b ? a : b;
+}
+
+//! Passa uma leitura bruta pelo filtro; retorna false se foi rejeitada.
+bool sensorFilter(centi_t raw, centi_t *out){
+    sensor.raw[sensor.raw_next] = raw;
+    sensor.raw_next = (sensor.raw_next+1) % 3;
+    if (sensor.raw_count < 3){
+        sensor.raw_count++;
+    }
+    centi_t med = sensor.raw_count < 3 ? raw : median3(sensor.raw[0],sensor.raw[1],sensor.raw[2]);
+
+    if (!sensor.has_ema){
+        sensor.ema     = (int32_t)med << 4;
+        sensor.has_ema = true;
+    }
+    int32_t diff = med - (sensor.ema >> 4);
+    if (diff > SENSOR_OUTLIER || diff < -SENSOR_OUTLIER){
+        if (++sensor.rejected <= SENSOR_MAX_REJECT){
+            return false;
+        }
+        sensor.ema = (int32_t)med << 4;
+    }
+    sensor.rejected = 0;
+    sensor.ema     += (((int32_t)med << 4) - sensor.ema) >> SENSOR_EMA_SHIFT;
+    *out = sensor.ema >> 4;
+    return true;
+}
+
+//! Publica o valor filtrado quando houver mudanca ou a cada SENSOR_PUBLISH_MAX_MS.
+void sensorPublish(centi_t value){
+    uint32_t now     = millis();
+    uint32_t elapsed = now - sensor.published_ms;
+    int32_t  delta   = value - sensor.published;
+    if (delta < 0){
+        delta = -delta;
+    }
+    bool changed = delta >= SENSOR_PUBLISH_DELTA && elapsed >= SENSOR_PUBLISH_MIN_MS;
+    if (sensor.published_ms != 0 && !changed && elapsed < SENSOR_PUBLISH_MAX_MS){
+        return;
+    }
+    if (!mqttOnline()){
+        return;
+    }
+    char buf[8];
+    formatCenti(buf,value);
+    mqtt.publish("freezer/temperature",buf);
+    sensor.published    = value;
+    sensor.published_ms = now;
+}
+
+#ifdef SENSOR_PIN
+//! Tarefa TASK_SENSOR: le a conversao anterior e inicia a proxima.
+void sensorSample(){
+    if (ds.MeasureStatus()){
+        return; //conversao ainda em andamento
+    }
+    if (ds.GetSensorsCount() > 0 && ds.IsValidTemperature(0)){
+        //a biblioteca so entrega float; e a unica conversao por amostra
+        centi_t raw = toCenti(ds.GetCelsius(0));
+        centi_t value;
+        if (raw >= CENTI_MIN && raw <= CENTI_MAX && raw != SENSOR_POWER_ON && sensorFilter(raw,&value)){
+            sensor.last_valid_ms = millis();
+            processReading(0,value);
+            sensorPublish(value);
+        }
+    }
+    ds.StartMeasure();
+}
+#endif
+
+//! Inicia o barramento OneWire e TASK_SENSOR.
+void sensorBegin(){
+#ifdef SENSOR_PIN
+    ds.Init(SENSOR_PIN);
+    ds.StartMeasure();
+    taskStart(TASK_SENSOR,sensorSample,SENSOR_PERIOD_MS,SENSOR_PERIOD_MS);
+#endif
+}
+//-----------------FIM SENSOR LOCAL-------------------//
+
+//-------------------- RELOGIO ------------------//
+/*! Os perfis precisam de hora absoluta, que sobrevive ao reboot. Com a rede
+ * no ar o NtpClient acerta o SystemClock (mantido pelo RTC do ESP8266) a
+ * cada NTP_INTERVAL_S; ate o primeiro acerto clockNow() devolve 0 e quem
+ * depende de hora espera.
+ */
+#define NTP_SERVER     "pool.ntp.org"
+#define NTP_INTERVAL_S 3600
+
+static bool clock_synced = false;
+NtpClient *ntp = NULL;
+
+void profileTickAll();
+
+//! Callback do NtpClient.
+void onNtpTime(NtpClient &client, time_t timestamp){
+    SystemClock.setTime(timestamp,eTZ_UTC);
+    if (!clock_synced){
+        clock_synced = true;
+        profileTickAll();
+    }
+}
+
+//! Segundos desde 1970 (UTC); 0 enquanto o relogio nao foi acertado.
+uint32_t clockNow(){
+    return clock_synced ? SystemClock.now(eTZ_UTC).toUnixTime() : 0;
+}
+
+//! Cria o NtpClient na primeira conexao com a rede.
+void clockBegin(){
+    if (ntp == NULL){
+        ntp = new NtpClient(NTP_SERVER,NTP_INTERVAL_S,onNtpTime);
+    }
+}
+//-----------------FIM RELOGIO-------------------//
+
+//-------------------- HISTORICO ------------------//
+/*! Serie temporal de cada cuba, com hora do relogio (so grava depois do
+ * acerto do NTP):
+ *
+ * - bruto: uma leitura a cada HIST_RAW_S na RAM, cobrindo a ultima hora;
+ * - 1 minuto: minima, maxima e media de cada minuto em
+ *   /flash/hist1m.<cuba>.bin, HIST_1M_SLOTS slots (24 h);
+ * - 15 minutos: o mesmo por quarto de hora em /flash/hist15m.<cuba>.bin,
+ *   HIST_15M_SLOTS slots (14 dias).
+ *
+ * Os arquivos tem tamanho fixo e sao criados zerados no primeiro boot, aos
+ * pedacos, por TASK_PRESIZE (ver flashPresize()). O
+ * bucket que comeca em ts fica no slot (ts / periodo) % slots, entao uma
+ * consulta calcula direto os slots do intervalo e le apenas essas paginas;
+ * o ts gravado em cada histBucket descarta slots de uma volta anterior. Por
+ * dia e por cuba sao 17280 bytes regravados no arquivo de 1 minuto e 1152 no
+ * de 15 minutos; o espaco ocupado e fixo (17280 + 16128 bytes).
+ *
+ * beer/history (ou beer/<cuba>/history) recebe DE|ATE[|RES] em segundos
+ * desde 1970; RES e 0 (bruto), 60 ou 900 e, se omitido, sai do tamanho do
+ * intervalo. A resposta vai para freezer/history em blocos de ate
+ * HIST_CHUNK registros, um a cada HIST_CHUNK_MS, cada um com um histChunk
+ * seguido de histBucket (no bruto min = max = avg). O ultimo bloco tem
+ * last = 1. Uma consulta nova substitui a anterior.
+ */
+#define HIST_RAW_S      10
+#define HIST_RAW_LEN    360
+#define HIST_1M_SLOTS   1440
+#define HIST_15M_SLOTS  1344
+#define HIST_CHUNK      40
+#define HIST_CHUNK_MS   100
+#define HIST_VERSION    1
+
+//! Bucket gravado na flash e enviado nas respostas.
+struct histBucket{
+    uint32_t ts;    /*!< inicio do bucket; 0 se o slot esta vazio */
+    centi_t  min;
+    centi_t  max;
+    centi_t  avg;
+    uint8_t  count; /*!< leituras no bucket (satura em 255) */
+    uint8_t  reserved;
+};
+static_assert(sizeof(histBucket) == 12, "histBucket com padding");
+
+//! Cabecalho de cada bloco da resposta.
+struct histChunk{
+    uint8_t  version; /*!< HIST_VERSION */
+    uint8_t  vessel;
+    uint16_t seq;     /*!< 0, 1, 2... dentro da consulta */
+    uint16_t period;  /*!< 0 (bruto), 60 ou 900 */
+    uint8_t  count;   /*!< registros neste bloco */
+    uint8_t  last;    /*!< 1 no ultimo bloco */
+};
+
+//! Acumulador do bucket aberto.
+struct histAcc{
+    uint32_t ts;
+    centi_t  min;
+    centi_t  max;
+    int32_t  sum;
+    uint16_t count;
+};
+
+//! Consulta em andamento.
+struct histQuery{
+    bool     active;
+    uint8_t  vessel;
+    uint16_t period;
+    uint16_t seq;
+    uint32_t from;
+    uint32_t to;
+    uint32_t next; /*!< proximo slot (ou posicao no anel bruto) */
+    uint32_t end;  /*!< ultimo slot, inclusive */
+};
+
+static uint32_t  hist_raw_ts[VESSEL_COUNT][HIST_RAW_LEN];
+static centi_t   hist_raw_temp[VESSEL_COUNT][HIST_RAW_LEN];
+static uint16_t  hist_raw_head[VESSEL_COUNT]; //proxima posicao de escrita
+static histAcc   hist_minute[VESSEL_COUNT];
+static histAcc   hist_quarter[VESSEL_COUNT];
+static histQuery hist_query;
+
+//! Nome do arquivo de periodo period da cuba v.
+void histFile(uint8_t v, uint16_t period, char *buf, size_t len){
+    m_snprintf(buf,len,period == 60 ? "/flash/hist1m.%u.bin" : "/flash/hist15m.%u.bin",v);
+}
+
+//! Slots do arquivo de periodo period.
+static inline uint32_t histSlots(uint16_t period){
+    return period == 60 ? HIST_1M_SLOTS : HIST_15M_SLOTS;
+}
+
+//! Pede o arquivo zerado se ele nao existir com o tamanho certo.
+void histPrepare(uint8_t v, uint16_t period){
+    char name[28];
+    histFile(v,period,name,sizeof(name));
+    uint32_t size = histSlots(period) * sizeof(histBucket);
+    flashPresize(name,size);
+}
+
+//! Grava um bucket fechado no seu slot.
+void histWrite(uint8_t v, uint16_t period, const histBucket &b){
+    char name[28];
+    histFile(v,period,name,sizeof(name));
+    file_t f = fileOpen(name,eFO_ReadWrite);
+    if (f < 0){
+        return;
+    }
+    uint32_t slot = (b.ts / period) % histSlots(period);
+    if (fileSeek(f,slot*sizeof(histBucket),eSO_FileStart) >= 0){
+        flashWrite(f,&b,sizeof(b));
+    }
+    fileClose(f);
+}
+
+//! Fecha o acumulador em um bucket.
+histBucket histClose(const histAcc &acc){
+    histBucket b;
+    b.ts       = acc.ts;
+    b.min      = acc.min;
+    b.max      = acc.max;
+    b.avg      = acc.sum / acc.count;
+    b.count    = acc.count > 255 ? 255 : acc.count;
+    b.reserved = 0;
+    return b;
+}
+
+//! Soma count leituras (min, max, media avg) ao acumulador do bucket start.
+/*! Devolve verdadeiro, com o bucket anterior em closed, se start abriu um
+ * bucket novo. */
+bool histAccAdd(histAcc &acc, uint32_t start, centi_t min, centi_t max, centi_t avg,
+                uint16_t count, histBucket *closed){
+    bool rolled = false;
+    if (acc.count > 0 && acc.ts != start){
+        *closed   = histClose(acc);
+        acc.count = 0;
+        rolled    = true;
+    }
+    if (acc.count == 0){
+        acc.ts  = start;
+        acc.min = min;
+        acc.max = max;
+        acc.sum = 0;
+    }
+    if (min < acc.min) acc.min = min;
+    if (max > acc.max) acc.max = max;
+    acc.sum   += (int32_t)avg * count;
+    acc.count += count;
+    return rolled;
+}
+
+//! Entrada do historico: uma leitura aceita da cuba v.
+void histAdd(uint8_t v, centi_t temp){
+    uint32_t now = clockNow();
+    if (now == 0){
+        return;
+    }
+    uint16_t last = (hist_raw_head[v] + HIST_RAW_LEN - 1) % HIST_RAW_LEN;
+    if (now - hist_raw_ts[v][last] >= HIST_RAW_S){
+        hist_raw_ts[v][hist_raw_head[v]]   = now;
+        hist_raw_temp[v][hist_raw_head[v]] = temp;
+        hist_raw_head[v] = (hist_raw_head[v] + 1) % HIST_RAW_LEN;
+    }
+
+    histBucket minute;
+    if (!histAccAdd(hist_minute[v],now - now % 60,temp,temp,temp,1,&minute)){
+        return;
+    }
+    histWrite(v,60,minute);
+    histBucket quarter;
+    if (histAccAdd(hist_quarter[v],minute.ts - minute.ts % 900,minute.min,minute.max,
+                   minute.avg,minute.count,&quarter)){
+        histWrite(v,900,quarter);
+    }
+}
+
+//! Tarefa TASK_HISTORY: envia o proximo bloco da consulta.
+void histSendChunk(){
+    histQuery &q = hist_query;
+    if (!q.active || !mqttOnline()){
+        q.active = false;
+        taskStop(TASK_HISTORY);
+        return;
+    }
+    static_assert(sizeof(histChunk) + HIST_CHUNK*sizeof(histBucket) <= POOL_BLOCK,"bloco do historico");
+    poolBuf scratch;
+    if (scratch.p == NULL){
+        return;
+    }
+    uint8_t *buf = scratch.p;
+    histChunk  *hdr = (histChunk*)buf;
+    histBucket *out = (histBucket*)(buf + sizeof(histChunk));
+    uint8_t     n   = 0;
+
+    if (q.period == 0){
+        //bruto: percorre o anel da RAM do mais antigo para o mais novo
+        while (q.next < HIST_RAW_LEN && n < HIST_CHUNK){
+            uint16_t i  = (hist_raw_head[q.vessel] + q.next++) % HIST_RAW_LEN;
+            uint32_t ts = hist_raw_ts[q.vessel][i];
+            if (ts != 0 && ts >= q.from && ts <= q.to){
+                centi_t t = hist_raw_temp[q.vessel][i];
+                out[n++]  = {ts,t,t,t,1,0};
+            }
+        }
+        q.active = q.next < HIST_RAW_LEN;
+    }
+    else{
+        //le apenas os slots do intervalo, em pedacos contiguos do arquivo
+        char name[28];
+        histFile(q.vessel,q.period,name,sizeof(name));
+        file_t f = fileOpen(name,eFO_ReadOnly);
+        uint32_t slots = histSlots(q.period);
+        while (f >= 0 && q.next <= q.end && n == 0){
+            uint32_t slot  = q.next % slots;
+            uint32_t count = q.end - q.next + 1;
+            if (count > HIST_CHUNK)    count = HIST_CHUNK;
+            if (slot + count > slots)  count = slots - slot;
+            int got = -1;
+            if (fileSeek(f,slot*sizeof(histBucket),eSO_FileStart) >= 0){
+                got = flashRead(f,out,count*sizeof(histBucket)) / (int)sizeof(histBucket);
+            }
+            if (got <= 0){
+                break;
+            }
+            //compacta os buckets validos no inicio de out
+            for (int k=0;k<got;k++){
+                uint32_t ts = out[k].ts;
+                if (ts != 0 && ts / q.period == q.next + k && ts >= q.from && ts <= q.to){
+                    out[n++] = out[k];
+                }
+            }
+            q.next += got;
+        }
+        if (f >= 0){
+            fileClose(f);
+        }
+        q.active = f >= 0 && q.next <= q.end;
+    }
+
+    hdr->version = HIST_VERSION;
+    hdr->vessel  = q.vessel;
+    hdr->seq     = q.seq++;
+    hdr->period  = q.period;
+    hdr->count   = n;
+    hdr->last    = q.active ? 0 : 1;
+    mqtt.publish("freezer/history",String((const char*)buf,sizeof(histChunk) + n*sizeof(histBucket)));
+    if (!q.active){
+        taskStop(TASK_HISTORY);
+    }
+}
+
+//! Inicia uma consulta DE|ATE[|RES] da cuba v.
+parseError histQueryStart(uint8_t v, const char *msg, size_t len){
+    const char *field[3];
+    size_t      flen[3];
+    uint32_t    from;
+    uint32_t    to;
+    int32_t     res = -1;
+    size_t      nf  = splitFields(msg,len,field,flen,3);
+    if (nf < 2 || nf > 3){
+        return PARSE_FIELDS;
+    }
+    parseError err = parseUint(field[0],flen[0],&from);
+    if (err == PARSE_OK){
+        err = parseUint(field[1],flen[1],&to);
+    }
+    if (err == PARSE_OK && nf == 3){
+        err = parseInt(field[2],flen[2],0,900,&res);
+    }
+    if (err != PARSE_OK){
+        return err;
+    }
+    if (from > to || (res != -1 && res != 0 && res != 60 && res != 900)){
+        return PARSE_RANGE;
+    }
+    if (res == -1){
+        res = to - from <= 3600 ? 0 : (to - from <= 86400 ? 60 : 900);
+    }
+
+    histQuery &q = hist_query;
+    q.active = true;
+    q.vessel = v;
+    q.period = res;
+    q.seq    = 0;
+    q.from   = from;
+    q.to     = to;
+    if (res == 0){
+        q.next = 0;
+        q.end  = HIST_RAW_LEN - 1;
+    }
+    else{
+        //mais antigo que a retencao do arquivo ja foi sobrescrito
+        uint32_t slots = histSlots(res);
+        q.end  = to / res;
+        q.next = from / res;
+        if (q.end - q.next >= slots){
+            q.next = q.end - slots + 1;
+        }
+    }
+    taskStart(TASK_HISTORY,histSendChunk,HIST_CHUNK_MS,HIST_CHUNK_MS);
+    return PARSE_OK;
+}
+
+//! Pede os arquivos de historico que faltarem.
+void histBegin(){
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        histPrepare(v,60);
+        histPrepare(v,900);
+    }
+}
+//-----------------FIM HISTORICO-------------------//
+
+//-------------------- ANALISE DO COMPRESSOR ------------------//
+/*! Acompanha o compressor (pins[0]) de cada cuba a cada ANA_TICK_MS, com
+ * memoria constante (anaState), e procura sinais de defeito:
+ *
+ * - ANA_NO_COOLING: ligado ha ANA_NOCOOL_MS sem a leitura cair ANA_DROP
+ *   abaixo da leitura da partida (compressor queimado, porta aberta, rele
+ *   que nao fecha);
+ * - ANA_WEAK_COOLING: um ciclo de pelo menos ANA_MIN_ON_MS resfriou menos de
+ *   ANA_WEAK_PCT% da taxa de referencia;
+ * - ANA_SHORT_CYCLE: mais de ANA_MAX_CYCLES_H partidas na mesma hora;
+ * - ANA_LONG_ON: ligado ha mais de ANA_MAX_ON_MS;
+ * - ANA_COOLING_OFF: desligado, passado ANA_OFF_SETTLE_MS da parada, e a
+ *   leitura ainda cai ANA_DROP em ANA_NOCOOL_MS (rele colado).
+ *
+ * A taxa de referencia (base_rate, centesimos por hora) e uma media movel
+ * exponencial (1/8) das taxas dos ciclos de pelo menos ANA_MIN_ON_MS; so
+ * vale depois de ANA_BASE_MIN ciclos. Cada alerta sai uma vez por ciclo
+ * (ANA_SHORT_CYCLE, uma vez por hora), em texto "cuba alerta detalhe", por freezer/alert (caixa de saida, QoS 1)
+ * e vai para o log como EV_ALERT.
+ *
+ * Contadores do dia (tempo ligado, partidas, alertas, taxa media) ficam em
+ * ANA_FILE, um anaDay por cuba e dia em slots fixos ((dia % ANA_DAYS) *
+ * MAX_VESSELS + cuba, arquivo criado ja no tamanho final), gravados a cada ANA_SAVE_MS e na virada do dia. So
+ * gravam com o relogio acertado; o primeiro acerto depois do boot soma o
+ * que ja estava gravado para o dia, entao um reboot nao zera o dia.
+ */
+#define ANA_TICK_MS       5000
+#define ANA_NOCOOL_MS     1200000  //20 min
+#define ANA_DROP          20       //centesimos
+#define ANA_MIN_ON_MS     300000   //5 min
+#define ANA_WEAK_PCT      50
+#define ANA_MAX_CYCLES_H  6
+#define ANA_MAX_ON_MS     14400000 //4 h
+#define ANA_OFF_SETTLE_MS 1800000  //30 min
+#define ANA_BASE_MIN      5
+#define ANA_HOUR_MS       3600000UL
+#define ANA_SAVE_MS       3600000UL
+#define ANA_DAYS          31
+#define ANA_FILE          "/flash/daily.bin"
+#define ANA_VERSION       1
+
+//! Anomalias detectadas.
+enum anaAlert{
+    ANA_NO_COOLING   = 0,
+    ANA_WEAK_COOLING = 1,
+    ANA_SHORT_CYCLE  = 2,
+    ANA_LONG_ON      = 3,
+    ANA_COOLING_OFF  = 4,
+    ANA_ALERTS
+};
+
+static const char *const ana_names[ANA_ALERTS] = {
+    "no_cooling", "weak_cooling", "short_cycle", "long_on", "cooling_off"
+};
+
+//! Contadores de um dia de uma cuba (16 bytes no arquivo).
+struct anaDay{
+    uint32_t day;     /*!< dias desde 1970 (UTC); 0: slot vazio */
+    uint32_t on_s;    /*!< tempo com o compressor ligado */
+    uint16_t cycles;  /*!< partidas */
+    uint16_t alerts;  /*!< alertas emitidos */
+    int16_t  rate;    /*!< taxa media de resfriamento, centesimos/h */
+    uint8_t  vessel;
+    uint8_t  version; /*!< ANA_VERSION */
+};
+
+static_assert(sizeof(anaDay) == 16, "anaDay deve ter 16 bytes");
+
+//! Estado da analise de uma cuba.
+struct anaState{
+    bool     on;          /*!< compressor na ultima amostra */
+    bool     started;     /*!< ja teve uma amostra */
+    bool     settled;     /*!< settle_temp valido (desligado) */
+    uint8_t  fired;       /*!< bit por anaAlert ja emitido neste ciclo */
+    uint32_t since_ms;    /*!< millis() da ultima troca */
+    centi_t  since_temp;  /*!< leitura na ultima troca */
+    centi_t  settle_temp; /*!< leitura ANA_OFF_SETTLE_MS depois de desligar */
+    uint32_t hour_ms;     /*!< inicio da hora das partidas */
+    uint8_t  hour_cycles;
+    uint16_t base_n;      /*!< ciclos na referencia, saturado */
+    int32_t  base_rate;   /*!< centesimos/h */
+    int32_t  rate_sum;    /*!< soma das taxas do dia */
+    uint16_t rate_n;
+    uint32_t on_ms;       /*!< ms ligado ainda nao passados para today.on_s */
+    anaDay   today;
+};
+
+static anaState ana[VESSEL_COUNT];
+static uint32_t ana_save_ms = 0;
+
+//! Publica e registra a anomalia a da cuba v, uma vez por ciclo.
+void anaRaise(uint8_t v, uint8_t a, uint32_t value){
+    anaState &st = ana[v];
+    if (st.fired & (1 << a)){
+        return;
+    }
+    st.fired |= 1 << a;
+    st.today.alerts++;
+    logEvent(EV_ALERT,v);
+    char buf[64];
+    int  n = m_snprintf(buf,sizeof(buf),"%u %s %u",v,ana_names[a],value);
+    outboxSend(OUTBOX_ALERT,(const uint8_t*)buf,n,1);
+    CON_WARN("Alerta: %s",buf);
+}
+
+//! Grava os contadores do dia de cada cuba no seu slot.
+void anaSave(){
+    file_t f = fileOpen(ANA_FILE,eFO_ReadWrite);
+    if (f < 0){
+        return;
+    }
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        anaDay &d = ana[v].today;
+        if (d.day == 0){
+            continue;
+        }
+        d.rate = ana[v].rate_n ? ana[v].rate_sum / ana[v].rate_n : 0;
+        uint32_t slot = (d.day % ANA_DAYS) * MAX_VESSELS + v;
+        if (fileSeek(f,slot*sizeof(anaDay),eSO_FileStart) >= 0){
+            flashWrite(f,&d,sizeof(d));
+        }
+    }
+    fileClose(f);
+}
+
+//! Primeiro acerto do relogio: soma o que ja estava gravado para hoje.
+void anaRestore(uint32_t day){
+    file_t f = fileOpen(ANA_FILE,eFO_ReadOnly);
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        anaState &st = ana[v];
+        anaDay    d;
+        st.today.day    = day;
+        st.today.vessel = v;
+        st.today.version = ANA_VERSION;
+        uint32_t slot = (day % ANA_DAYS) * MAX_VESSELS + v;
+        if (f >= 0 && fileSeek(f,slot*sizeof(anaDay),eSO_FileStart) >= 0 &&
+            flashRead(f,&d,sizeof(d)) == sizeof(d) &&
+            d.day == day && d.version == ANA_VERSION){
+            st.today.on_s   += d.on_s;
+            st.today.cycles += d.cycles;
+            st.today.alerts += d.alerts;
+            if (d.rate != 0){
+                st.rate_sum += d.rate;
+                st.rate_n++;
+            }
+        }
+    }
+    if (f >= 0){
+        fileClose(f);
+    }
+}
+
+//! Virada do dia: grava o dia que terminou e zera os contadores.
+void anaNewDay(uint32_t day){
+    anaSave();
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        anaState &st = ana[v];
+        memset(&st.today,0,sizeof(st.today));
+        st.today.day     = day;
+        st.today.vessel  = v;
+        st.today.version = ANA_VERSION;
+        st.rate_sum      = 0;
+        st.rate_n        = 0;
+    }
+}
+
+//! Fim de um ciclo ligado: taxa de resfriamento e referencia.
+void anaCycleEnd(uint8_t v, centi_t temp, uint32_t dur_ms){
+    anaState &st = ana[v];
+    if (dur_ms < ANA_MIN_ON_MS){
+        return;
+    }
+    int32_t rate = (int32_t)((int64_t)(st.since_temp - temp) * ANA_HOUR_MS / dur_ms);
+    if (st.base_n >= ANA_BASE_MIN && rate * 100 < st.base_rate * ANA_WEAK_PCT){
+        anaRaise(v,ANA_WEAK_COOLING,rate > 0 ? rate : 0);
+    }
+    st.base_rate = st.base_n == 0 ? rate : st.base_rate + (rate - st.base_rate) / 8;
+    if (st.base_n < 0xFFFF){
+        st.base_n++;
+    }
+    st.rate_sum += rate;
+    st.rate_n++;
+}
+
+//! Uma amostra da cuba v: trocas do compressor e verificacoes do ciclo.
+void anaSample(uint8_t v, centi_t temp, uint32_t now){
+    anaState &st = ana[v];
+    bool      on = relayOf(v,RELAY_ONE).level == HIGH;
+    if (!st.started){
+        st.started    = true;
+        st.on         = on;
+        st.since_ms   = now;
+        st.since_temp = temp;
+        st.hour_ms    = now;
+        return;
+    }
+    if (st.on){
+        st.on_ms += ANA_TICK_MS;
+    }
+    if (now - st.hour_ms >= ANA_HOUR_MS){
+        st.hour_ms     = now;
+        st.hour_cycles = 0;
+        st.fired      &= ~(1 << ANA_SHORT_CYCLE);
+    }
+
+    if (on != st.on){
+        if (st.on){
+            anaCycleEnd(v,temp,now - st.since_ms);
+        }
+        else{
+            st.today.cycles++;
+            if (++st.hour_cycles > ANA_MAX_CYCLES_H){
+                anaRaise(v,ANA_SHORT_CYCLE,st.hour_cycles);
+            }
+        }
+        st.on         = on;
+        st.since_ms   = now;
+        st.since_temp = temp;
+        st.settled    = false;
+        st.fired     &= 1 << ANA_SHORT_CYCLE; //short_cycle vale pela hora
+        return;
+    }
+
+    uint32_t elapsed = now - st.since_ms;
+    if (on){
+        if (elapsed >= ANA_NOCOOL_MS && temp > st.since_temp - ANA_DROP){
+            anaRaise(v,ANA_NO_COOLING,elapsed / 1000);
+        }
+        if (elapsed >= ANA_MAX_ON_MS){
+            anaRaise(v,ANA_LONG_ON,elapsed / 1000);
+        }
+        return;
+    }
+    if (!st.settled){
+        if (elapsed >= ANA_OFF_SETTLE_MS){
+            st.settled     = true;
+            st.settle_temp = temp;
+        }
+        return;
+    }
+    if (elapsed >= ANA_OFF_SETTLE_MS + ANA_NOCOOL_MS && temp <= st.settle_temp - ANA_DROP){
+        anaRaise(v,ANA_COOLING_OFF,st.settle_temp - temp);
+    }
+}
+
+//! Tarefa TASK_ANALYTICS.
+void anaTick(){
+    uint32_t now = millis();
+    uint32_t day = clockNow() / 86400;
+    if (day != 0){
+        if (ana[0].today.day == 0){
+            anaRestore(day);
+        }
+        else if (day != ana[0].today.day){
+            anaNewDay(day);
+        }
+    }
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        const vessel &ves = vessels[v];
+        anaState     &st  = ana[v];
+        if (ves.reading_ms == 0 || ctrl[v].stale){
+            continue;
+        }
+        anaSample(v,ves.last_temp,now);
+        st.today.on_s += st.on_ms / 1000;
+        st.on_ms      %= 1000;
+    }
+    if (now - ana_save_ms >= ANA_SAVE_MS){
+        ana_save_ms = now;
+        anaSave();
+    }
+}
+
+//! Pede ANA_FILE com todos os slots zerados, se preciso.
+void anaPrepare(){
+    uint32_t size = (uint32_t)ANA_DAYS * MAX_VESSELS * sizeof(anaDay);
+    flashPresize(ANA_FILE,size);
+}
+
+void anaBegin(){
+    anaPrepare();
+    ana_save_ms = millis();
+    taskStart(TASK_ANALYTICS,anaTick,ANA_TICK_MS,ANA_TICK_MS);
+}
+//-----------------FIM ANALISE DO COMPRESSOR-------------------//
+
+//-------------------- PERFIS ------------------//
+/*! Um perfil e uma lista de passos gravada em /flash/profile.<cuba>.bin, que
+ * substitui a troca manual de programa. Cada passo e um profileStep de 8
+ * bytes: faixa alvo, rampa (centesimos de grau por dia) e tempo de espera
+ * (horas). O passo comeca com a rampa: a faixa anda em linha reta da faixa
+ * do passo anterior ate a do passo atual, na taxa pedida, e depois fica
+ * parada pelo tempo de espera. O primeiro passo, e qualquer passo com
+ * rampa 0, vai direto para a faixa alvo.
+ *
+ * So o passo atual (e a faixa do anterior) fica na RAM; o passo seguinte e
+ * lido do arquivo quando o atual termina. O ponto de controle (passo e hora
+ * de inicio) vai para o registro de configuracoes a cada troca de passo, entao
+ * um reboot retoma o perfil no meio do passo assim que o relogio for acertado.
+ * Enquanto isso o controlador usa a faixa alvo do passo.
+ *
+ * beer/profile recebe os passos como MIN|MAX|HORAS|RAMPA separados por ';'
+ * (ex.: 18|19|72|0;20|21|48|2;0.5|1.5|336|3) e inicia o perfil; mensagem
+ * vazia cancela. Um novo programa em beer/program tambem cancela o perfil.
+ */
+#define PROFILE_NONE      0xFF
+#define PROFILE_MAX_STEPS 32
+#define PROFILE_TICK_MS   60000
+
+//! Passo do perfil, como gravado no arquivo.
+struct profileStep{
+    centi_t  min;    /*!< minima alvo */
+    centi_t  max;    /*!< maxima alvo */
+    uint16_t hold_h; /*!< espera na faixa alvo, em horas */
+    uint16_t ramp;   /*!< centesimos por dia; 0 vai direto ao alvo */
+};
+static_assert(sizeof(profileStep) == 8, "profileStep com padding");
+
+//! Progresso do perfil de uma cuba.
+struct profileState{
+    uint8_t     step;     /*!< passo atual ou PROFILE_NONE */
+    uint32_t    start;    /*!< clockNow() do inicio do passo; 0 se ainda sem relogio */
+    profileStep cur;      /*!< passo atual */
+    centi_t     from_min; /*!< inicio da rampa */
+    centi_t     from_max;
+};
+
+static profileState profiles[VESSEL_COUNT];
+
+//! Nome do arquivo de passos da cuba v.
+void profileFile(uint8_t v, char *buf, size_t len){
+    m_snprintf(buf,len,"/flash/profile.%u.bin",v);
+}
+
+//! Le o passo i do arquivo da cuba v.
+bool profileRead(uint8_t v, uint8_t i, profileStep *step){
+    char name[24];
+    profileFile(v,name,sizeof(name));
+    file_t f = fileOpen(name,eFO_ReadOnly);
+    if (f < 0){
+        return false;
+    }
+    int n = -1;
+    if (fileSeek(f,i*sizeof(profileStep),eSO_FileStart) >= 0){
+        n = flashRead(f,step,sizeof(profileStep));
+    }
+    fileClose(f);
+    return n == sizeof(profileStep);
+}
+
+//! Carrega o passo i (e a faixa do anterior, inicio da rampa).
+bool profileLoad(uint8_t v, uint8_t i){
+    profileState &p = profiles[v];
+    profileStep step;
+    profileStep prev;
+    if (i >= PROFILE_MAX_STEPS || !profileRead(v,i,&step)){
+        return false;
+    }
+    if (i == 0 || step.ramp == 0 || !profileRead(v,i-1,&prev)){
+        prev = step;
+    }
+    p.cur      = step;
+    p.from_min = prev.min;
+    p.from_max = prev.max;
+    return true;
+}
+
+//! Duracao da rampa do passo atual, em segundos.
+uint32_t profileRampS(const profileState &p){
+    if (p.cur.ramp == 0){
+        return 0;
+    }
+    int32_t delta = (p.cur.min + p.cur.max)/2 - (p.from_min + p.from_max)/2;
+    if (delta < 0){
+        delta = -delta;
+    }
+    return (uint32_t)delta * 86400 / p.cur.ramp;
+}
+
+//! Avanca o perfil da cuba v ate now e aplica a faixa do momento.
+/*! now vem de clockNow(); recebido por parametro para que o perfil possa
+ * ser simulado com um relogio acelerado. Passos inteiros vencidos durante
+ * uma queda sao pulados de uma vez. */
+void profileTick(uint8_t v, uint32_t now){
+    profileState &p = profiles[v];
+    if (p.step == PROFILE_NONE || now == 0){
+        return;
+    }
+    bool changed = false;
+    if (p.start == 0){
+        //perfil iniciado antes do acerto do relogio
+        p.start = now;
+        changed = true;
+    }
+
+    uint32_t ramp_s = profileRampS(p);
+    for (;;){
+        uint32_t end = p.start + ramp_s + (uint32_t)p.cur.hold_h*3600;
+        if (now < end){
+            break;
+        }
+        changed = true;
+        if (!profileLoad(v,p.step+1)){
+            CON_INFO("Perfil concluido.");
+            p.step = PROFILE_NONE;
+            break;
+        }
+        p.step++;
+        p.start = end;
+        ramp_s  = profileRampS(p);
+    }
+
+    vessel &ves = vessels[v];
+    uint32_t elapsed = now - p.start;
+    if (p.step != PROFILE_NONE && elapsed < ramp_s){
+        ves.temp_min = p.from_min + (int64_t)(p.cur.min - p.from_min) * elapsed / ramp_s;
+        ves.temp_max = p.from_max + (int64_t)(p.cur.max - p.from_max) * elapsed / ramp_s;
+    }
+    else{
+        ves.temp_min = p.cur.min;
+        ves.temp_max = p.cur.max;
+    }
+
+    if (changed){
+        logEvent(EV_PROFILE,v);
+        settingsChanged();
+    }
+    else if (elapsed < ramp_s){
+        rtcSave(); //faixa da rampa mudou
+    }
+}
+
+//! Tarefa TASK_PROFILE.
+void profileTickAll(){
+    uint32_t now = clockNow();
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        profileTick(v,now);
+    }
+}
+
+//! Retoma o ponto de controle lido das configuracoes.
+void profileResume(uint8_t v){
+    profileState &p = profiles[v];
+    if (p.step == PROFILE_NONE){
+        return;
+    }
+    if (!profileLoad(v,p.step)){
+        CON_WARN("Arquivo de perfil ausente; perfil cancelado.");
+        p.step = PROFILE_NONE;
+        return;
+    }
+    //sem relogio ainda: faixa alvo ate o primeiro profileTick()
+    vessels[v].temp_min = p.cur.min;
+    vessels[v].temp_max = p.cur.max;
+}
+
+//! Cancela o perfil da cuba v, mantendo a faixa atual.
+void profileStop(uint8_t v){
+    if (profiles[v].step == PROFILE_NONE){
+        return;
+    }
+    profiles[v].step = PROFILE_NONE;
+    logEvent(EV_PROFILE,v);
+    settingsChanged();
+}
+
+//! Le um passo MIN|MAX|HORAS|RAMPA.
+parseError parseStep(const char *s, size_t len, profileStep *step){
+    const char *field[4];
+    size_t      flen[4];
+    int32_t     hold;
+    centi_t     ramp;
+    if (splitFields(s,len,field,flen,4) != 4){
+        return PARSE_FIELDS;
+    }
+    parseError err = parseCenti(field[0],flen[0],&step->min);
+    if (err == PARSE_OK){
+        err = parseCenti(field[1],flen[1],&step->max);
+    }
+    if (err == PARSE_OK){
+        err = parseInt(field[2],flen[2],0,8760,&hold);
+    }
+    if (err == PARSE_OK){
+        err = parseCenti(field[3],flen[3],&ramp);
+    }
+    if (err != PARSE_OK){
+        return err;
+    }
+    if (step->min > step->max || ramp < 0){
+        return PARSE_RANGE;
+    }
+    step->hold_h = hold;
+    step->ramp   = ramp;
+    return PARSE_OK;
+}
+
+//! Grava os passos recebidos e inicia o perfil da cuba v.
+parseError profileStart(uint8_t v, const char *msg, size_t len){
+    profileStep steps[PROFILE_MAX_STEPS];
+    uint8_t     n     = 0;
+    size_t      begin = 0;
+    for (size_t i=0;i<=len;i++){
+        if (i < len && msg[i] != ';'){
+            continue;
+        }
+        if (n == PROFILE_MAX_STEPS){
+            return PARSE_TOO_LONG;
+        }
+        parseError err = parseStep(msg+begin,i-begin,&steps[n++]);
+        if (err != PARSE_OK){
+            return err;
+        }
+        begin = i+1;
+    }
+
+    char name[24];
+    profileFile(v,name,sizeof(name));
+    file_t f = fileOpen(name,eFO_CreateNewAlways|eFO_WriteOnly);
+    if (f < 0){
+        CON_ERR("Nao pude abrir o arquivo de perfil.");
+        return PARSE_OK;
+    }
+    int size = flashWrite(f,steps,n*sizeof(profileStep));
+    fileClose(f);
+    if (size != (int)(n*sizeof(profileStep))){
+        CON_ERR("Erro ao gravar o perfil.");
+        return PARSE_OK;
+    }
+
+    profileState &p = profiles[v];
+    p.step  = 0;
+    p.start = 0;
+    profileLoad(v,0);
+    CON_INFO("Perfil iniciado, passos: %u",n);
+    profileTick(v,clockNow());
+    if (p.start == 0){
+        //sem relogio: faixa do primeiro passo ate o acerto
+        vessels[v].temp_min = p.cur.min;
+        vessels[v].temp_max = p.cur.max;
+        logEvent(EV_PROFILE,v);
+        settingsChanged();
+    }
+    return PARSE_OK;
+}
+//-----------------FIM PERFIS-------------------//
+
+//! Aplica o programa escolhido na cuba v.
+/*! Copia para temp_min e temp_max da cuba os limites do programa indicado
+ pela flag ('F', 'M' ou 'P') e atualiza o programa ativo.*/
+void applyProgram(uint8_t v, char flag){
+    vessel &ves = vessels[v];
+    const progs &programs = ves.programs;
+    if (flag == 'F' || flag == 'M' || flag == 'P'){
+        ves.program = flag;
+    }
+    if (flag == 'F'){
+        ves.temp_min = programs.fermentation_min;
+        ves.temp_max = programs.fermentation_max;
+        
+        CON_INFO("Programa carregado: FERMENTATION");
+        printCenti("Minima: ",programs.fermentation_min);
+        printCenti("Maxima: ",programs.fermentation_max);
+    }
+    else if (flag == 'M'){
+        ves.temp_min = programs.maturation_min;
+        ves.temp_max = programs.maturation_max;
+        
+        CON_INFO("Programa carregado: MATURATION");
+        printCenti("Minima: ",programs.maturation_min);
+        printCenti("Maxima: ",programs.maturation_max);
+    }
+    else if (flag == 'P'){
+        ves.temp_min = programs.priming_min;
+        ves.temp_max = programs.priming_max;
+        
+        CON_INFO("Programa carregado: PRIMING");
+        printCenti("Minima: ",programs.priming_min);
+        printCenti("Maxima: ",programs.priming_max);
+    }
+    else{
+        logEvent(EV_BAD_INI,v);
+        CON_WARN("Programa vazio ou corrompido.");
+    }  
+}
+
+//! Se existir, carrega o valor do arquivo program.ini.
+/*! Formato antigo, lido apenas quando ainda nao ha registro de configuracoes
+ (ver settingsLoad()). Retorna a flag lida ou 0. */
+char programLoader(){
+    char flag = 0;
+    if (fileExist(INI_FILE)){
+        file_t inifile = fileOpen(INI_FILE,eFO_ReadOnly);
+        if (inifile >= 0){
+            flashRead(inifile,&flag,1);
+            fileClose(inifile);
+        }
+    }
+    return flag;
+}
+
+//! Escolha da fase
+/*! Quando publicado por MQTT o programa desejado (sendo Fermentation, 
+ Maturation ou Priming), o handler onTopicProgram() do topico beer/program
+ *  se encarrega de chamar essa função. O parâmetro recebido é o tipo escolhido,
+ sendo as opções 'F' para fermentação, 'M' para maturação e 'P' para priming.
+ Um perfil em andamento na cuba e cancelado.*/
+void defineProgram(uint8_t v, char flag){
+    STATS_SCOPE(ST_PROGRAM);
+    profileStop(v);
+    applyProgram(v,flag);
+    logEvent(EV_PROGRAM,v);
+    settingsChanged();
+}
+
+//-------------------- PERSISTENCIA ------------------//
+/*! Programa ativo, os seis limites, a configuracao do controlador e o ponto
+ * de controle do perfil de cada cuba ficam em um unico registro versionado e
+ * protegido por CRC32 (settingsRecord). Ha dois slots em arquivos separados e
+ * cada gravacao vai para o slot que NAO contem o registro mais recente
+ * (seq par em SET_FILE_A, impar em SET_FILE_B). Se a energia cair no meio de
+ * uma gravacao, o slot incompleto falha no CRC e o outro continua valido; na
+ * carga vence o slot valido de maior seq.
+ *
+ * Mudancas seguidas (varias mensagens em beer/minMax, por exemplo) sao
+ * agrupadas: settingsChanged() apenas reagenda TASK_SETTINGS e so a ultima
+ * versao e gravada, SETTINGS_COALESCE_MS depois da ultima mudanca.
+ *
+ * O registro tem espaco fixo para MAX_VESSELS cubas, entao acrescentar uma
+ * cuba na tabela vessels[] nao muda o formato. Registros da versao 3 ganham
+ * o perfil desligado; os das versoes 1 e 2
+ * (uma cuba so) e os antigos program.ini e limits.ini, lidos apenas quando
+ * nenhum slot e valido, sao migrados para a cuba 0.
+ */
+#define SET_FILE_A           "/flash/settings.0"
+#define SET_FILE_B           "/flash/settings.1"
+#define SETTINGS_MAGIC       0x5659 //"YV"
+#define SETTINGS_VERSION     4
+#define SETTINGS_V1_SIZE     24  //registro sem ctrlConfig
+#define SETTINGS_V3_SIZE     252 //cubas sem o ponto de controle do perfil
+#define SETTINGS_V3_VESSEL   30
+#define SETTINGS_COALESCE_MS 2000
+
+//! Configuracoes de uma cuba dentro do registro.
+struct vesselSettings{
+    uint8_t    program;            /*!< 'F', 'M' ou 'P' */
+    uint8_t    profile_step;       /*!< passo do perfil ou PROFILE_NONE */
+    centi_t    limits[LIMITS_LEN]; /*!< limites na ordem da struct progs */
+    ctrlConfig ctrl;               /*!< configuracao do controlador */
+    uint16_t   reserved;
+    uint32_t   profile_start;      /*!< inicio do passo (clockNow()) */
+};
+
+//! Registro gravado em cada slot (campos ja alinhados, sem padding).
+struct settingsRecord{
+    uint16_t magic;              /*!< SETTINGS_MAGIC */
+    uint8_t  version;            /*!< SETTINGS_VERSION */
+    uint8_t  count;              /*!< cubas gravadas */
+    uint32_t seq;                /*!< contador de gravacoes */
+    vesselSettings vessels[MAX_VESSELS];
+    uint32_t crc;                /*!< CRC32 dos campos anteriores */
+};
+static_assert(sizeof(settingsRecord) == 300, "settingsRecord com padding");
+
+//! Registro das versoes 1 e 2 (uma cuba), lido apenas para migracao.
+/*! A versao 1 termina nos limites, com o CRC logo em seguida. */
+struct settingsRecordV2{
+    uint16_t magic;
+    uint8_t  version;
+    uint8_t  program;
+    uint32_t seq;
+    centi_t  limits[LIMITS_LEN];
+    ctrlConfig ctrl;
+    uint32_t crc;
+};
+static_assert(sizeof(settingsRecordV2) == 40, "settingsRecordV2 com padding");
+
+//! Buffer unico para leitura e gravacao; grande demais para a pilha.
+static settingsRecord settings_buf;
+static uint32_t settings_seq = 0;
+
+//! CRC32 (polinomio 0xEDB88320), sem tabela.
+uint32_t crc32(const void *data, size_t len){
+    const uint8_t *p = (const uint8_t*)data;
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--){
+        crc ^= *p++;
+        for (int k=0;k<8;k++){
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+//! Copia o estado atual de todas as cubas para rec.
+void settingsCapture(settingsRecord *rec){
+    memset(rec,0,sizeof(*rec));
+    rec->magic   = SETTINGS_MAGIC;
+    rec->version = SETTINGS_VERSION;
+    rec->count   = VESSEL_COUNT;
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        vesselSettings &vs   = rec->vessels[v];
+        const progs    &prog = vessels[v].programs;
+        vs.program   = vessels[v].program;
+        vs.limits[0] = prog.fermentation_min;
+        vs.limits[1] = prog.fermentation_max;
+        vs.limits[2] = prog.maturation_min;
+        vs.limits[3] = prog.maturation_max;
+        vs.limits[4] = prog.priming_min;
+        vs.limits[5] = prog.priming_max;
+        vs.ctrl      = ctrl_cfg[v];
+        vs.profile_step  = profiles[v].step;
+        vs.profile_start = profiles[v].start;
+    }
+}
+
+//! Le e valida um slot; registros antigos sao convertidos para a versao atual.
+bool settingsRead(const char *file, settingsRecord *rec){
+    file_t f = fileOpen(file,eFO_ReadOnly);
+    if (f < 0){
+        return false;
+    }
+    int size = flashRead(f,rec,sizeof(settingsRecord));
+    fileClose(f);
+    if (size < (int)offsetof(settingsRecord,vessels) || rec->magic != SETTINGS_MAGIC){
+        return false;
+    }
+    if (rec->version == SETTINGS_VERSION){
+        return size == sizeof(settingsRecord)   &&
+               rec->count <= MAX_VESSELS        &&
+               rec->crc == crc32(rec,offsetof(settingsRecord,crc));
+    }
+
+    if (rec->version == 3){
+        //versao 3: abre espaco para o perfil em cada cuba, da ultima para a primeira
+        uint32_t crc;
+        memcpy(&crc,(uint8_t*)rec + SETTINGS_V3_SIZE - sizeof(crc),sizeof(crc));
+        if (size != SETTINGS_V3_SIZE || rec->count > MAX_VESSELS ||
+            crc != crc32(rec,SETTINGS_V3_SIZE - sizeof(crc))){
+            return false;
+        }
+        uint8_t *base = (uint8_t*)rec->vessels;
+        for (int v=MAX_VESSELS-1;v>=0;v--){
+            vesselSettings &vs = rec->vessels[v];
+            memmove(&vs,base + v*SETTINGS_V3_VESSEL,SETTINGS_V3_VESSEL);
+            vs.profile_step  = PROFILE_NONE;
+            vs.reserved      = 0;
+            vs.profile_start = 0;
+        }
+        return true;
+    }
+
+    //versoes 1 e 2: uma cuba, migrada para a cuba 0
+    int old_size = rec->version == 1 ? SETTINGS_V1_SIZE : sizeof(settingsRecordV2);
+    if (rec->version > 2 || size != old_size){
+        return false;
+    }
+    settingsRecordV2 old;
+    uint32_t crc;
+    memcpy(&old,rec,size);
+    memcpy(&crc,(uint8_t*)&old + size - sizeof(crc),sizeof(crc));
+    if (crc != crc32(&old,size - sizeof(crc))){
+        return false;
+    }
+    settingsCapture(rec);
+    rec->seq = old.seq;
+    rec->vessels[0].program = old.program;
+    memcpy(rec->vessels[0].limits,old.limits,sizeof(old.limits));
+    if (old.version == 2){
+        rec->vessels[0].ctrl = old.ctrl;
+    }
+    return true;
+}
+
+//! Grava o estado atual no slot seguinte.
+void settingsFlush(){
+    STATS_SCOPE(ST_SETTINGS);
+    settingsRecord &rec = settings_buf;
+    settingsCapture(&rec);
+    rec.seq = settings_seq + 1;
+    rec.crc = crc32(&rec,offsetof(settingsRecord,crc));
+
+    const char *file = (rec.seq & 1) ? SET_FILE_B : SET_FILE_A;
+    file_t f = fileOpen(file,eFO_CreateNewAlways|eFO_WriteOnly);
+    if (f < 0){
+        CON_ERR("Erro ao abrir o arquivo de configuracoes.");
+        return;
+    }
+    int size = flashWrite(f,&rec,sizeof(rec));
+    fileClose(f);
+    if (size != sizeof(rec)){
+        CON_ERR("Erro ao gravar as configuracoes.");
+        return;
+    }
+    settings_seq = rec.seq;
+    rtcSave();
+}
+
+//! Agenda a gravacao, agrupando mudancas proximas.
+void settingsChanged(){
+    rtcSave();
+    taskStart(TASK_SETTINGS,settingsFlush,SETTINGS_COALESCE_MS,0);
+}
+
+//! Le em rec o slot valido de maior seq; falso se nenhum e valido.
+bool settingsNewest(settingsRecord *rec){
+    bool     valid_a = settingsRead(SET_FILE_A,rec);
+    uint32_t seq_a   = rec->seq;
+    bool     valid_b = settingsRead(SET_FILE_B,rec);
+    if (valid_a && (!valid_b || seq_a > rec->seq)){
+        settingsRead(SET_FILE_A,rec);
+    }
+    return valid_a || valid_b;
+}
+
+//! Partida quente: so os limites dos programas, que nao ficam no RTC.
+/*! Uma mudanca de limites ainda nao gravada (dentro de SETTINGS_COALESCE_MS)
+ * se perde no reset; a faixa ativa vem do RTC e nao muda. */
+void settingsLoadLimits(){
+    settingsRecord &rec = settings_buf;
+    if (!settingsNewest(&rec)){
+        strToProg();
+        return;
+    }
+    for (size_t v=0;v<VESSEL_COUNT && v<rec.count;v++){
+        limitsToProg(vessels[v],rec.vessels[v].limits);
+    }
+}
+
+//! Carrega o slot mais recente; sem slot valido, migra os arquivos antigos.
+void settingsLoad(){
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        ctrl_cfg[v]      = CTRL_DEFAULT;
+        profiles[v].step = PROFILE_NONE;
+    }
+
+    settingsRecord &rec = settings_buf;
+    if (settingsNewest(&rec)){
+        settings_seq = rec.seq;
+        for (size_t v=0;v<VESSEL_COUNT && v<rec.count;v++){
+            ctrl_cfg[v] = rec.vessels[v].ctrl;
+            limitsToProg(vessels[v],rec.vessels[v].limits);
+            applyProgram(v,rec.vessels[v].program);
+            profiles[v].step  = rec.vessels[v].profile_step;
+            profiles[v].start = rec.vessels[v].profile_start;
+            profileResume(v);
+        }
+    }
+    else{
+        CON_INFO("Sem configuracoes validas. Lendo program.ini e limits.ini...");
+        strToProg();
+        char flag = programLoader();
+        if (flag != 0){
+            applyProgram(0,flag);
+        }
+        if (flag != 0 || fileExist(LIM_FILE)){
+            settingsChanged();
+        }
+    }
+
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        ctrlApplyConfig(v);
+    }
+    rtcSave();
+}
+//-----------------FIM PERSISTENCIA-------------------//
+
+//-------------------- PARTIDA QUENTE ------------------//
+/*! Depois de um reset por watchdog, excecao ou queda rapida de tensao a
+ * memoria do RTC continua valida. rtcSave() mantem nela uma copia do estado
+ * de controle de cada cuba (programa, faixa ativa, configuracao do
+ * controlador, passo do perfil e rele do compressor) a cada mudanca, com
+ * CRC32. No boot rtcRestore() e a primeira coisa feita por init(): se o
+ * bloco for valido o controlador e os reles voltam em milissegundos, antes
+ * do SPIFFS e da rede; os limites dos programas vem depois, do registro de
+ * configuracoes. Sem bloco valido (partida a frio, apos falta de energia)
+ * vale o registro de configuracoes do SPIFFS, como antes.
+ *
+ * O rele de pulso nao e restaurado: um pulso interrompido fica em repouso.
+ *
+ * O bloco fica a partir de RTC_BLOCK (blocos de 4 bytes; a area do usuario
+ * vai de 64 a 191 e o inicio dela e usado pelo relogio do Sming).
+ * bootReport() publica em freezer/boot o tipo de partida, o motivo do reset
+ * e o tempo ate a primeira decisao do controlador.
+ */
+#define RTC_BLOCK 96
+#define RTC_MAGIC 0x59565254 //"YVRT"
+
+//! Estado de uma cuba na memoria do RTC.
+/*! Os seis limites dos programas nao entram: mudam pouco e ja estao no
+ * registro de configuracoes, lido por settingsLoadLimits() depois do
+ * spiffs_mount(). O profileState vai aberto, sem o padding da struct. */
+struct rtcVessel{
+    uint8_t     program;
+    uint8_t     relays;       /*!< relayBits() */
+    uint8_t     profile_step;
+    uint8_t     reserved;
+    centi_t     temp_min;     /*!< faixa ativa (programa ou perfil) */
+    centi_t     temp_max;
+    uint32_t    profile_start;
+    profileStep profile_cur;  /*!< passo atual, sem ler o arquivo */
+    centi_t     profile_from_min;
+    centi_t     profile_from_max;
+    ctrlConfig  ctrl;
+    uint16_t    reserved2;
+};
+static_assert(sizeof(rtcVessel) == 44, "rtcVessel com padding");
+
+//! Bloco gravado na memoria do RTC.
+struct rtcState{
+    uint32_t  magic;
+    uint32_t  settings_seq; /*!< para a proxima gravacao ir ao slot certo */
+    rtcVessel state[VESSEL_COUNT];
+    uint32_t  crc;
+};
+static_assert(sizeof(rtcState) % 4 == 0, "rtcState fora de blocos de 4 bytes");
+static_assert(RTC_BLOCK*4 + 3*sizeof(uint32_t) + MAX_VESSELS*sizeof(rtcVessel) <= 768,
+              "MAX_VESSELS cubas nao cabem na memoria do RTC");
+
+static rtcState rtc_buf;
+static bool     boot_warm     = false;
+static bool     boot_reported = false;
+
+void rtcSave(){
+    rtcState &st = rtc_buf;
+    memset(&st,0,sizeof(st));
+    st.magic        = RTC_MAGIC;
+    st.settings_seq = settings_seq;
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        rtcVessel    &rv  = st.state[v];
+        const vessel &ves = vessels[v];
+        const profileState &p = profiles[v];
+        rv.program          = ves.program;
+        rv.relays           = relayBits(v);
+        rv.temp_min         = ves.temp_min;
+        rv.temp_max         = ves.temp_max;
+        rv.ctrl             = ctrl_cfg[v];
+        rv.profile_step     = p.step;
+        rv.profile_start    = p.start;
+        rv.profile_cur      = p.cur;
+        rv.profile_from_min = p.from_min;
+        rv.profile_from_max = p.from_max;
+    }
+    st.crc = crc32(&st,offsetof(rtcState,crc));
+    system_rtc_mem_write(RTC_BLOCK,&st,sizeof(st));
+}
+
+//! Restaura o estado de controle da memoria do RTC; falso na partida a frio.
+bool rtcRestore(){
+    rtcState &st = rtc_buf;
+    if (!system_rtc_mem_read(RTC_BLOCK,&st,sizeof(st)) || st.magic != RTC_MAGIC ||
+        st.crc != crc32(&st,offsetof(rtcState,crc))){
+        return false;
+    }
+    settings_seq = st.settings_seq;
+    uint8_t relays[VESSEL_COUNT];
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        const rtcVessel &rv  = st.state[v];
+        vessel          &ves = vessels[v];
+        profileState    &p   = profiles[v];
+        ves.program  = rv.program;
+        ves.temp_min = rv.temp_min;
+        ves.temp_max = rv.temp_max;
+        ctrl_cfg[v]  = rv.ctrl;
+        p.step       = rv.profile_step;
+        p.start      = rv.profile_start;
+        p.cur        = rv.profile_cur;
+        p.from_min   = rv.profile_from_min;
+        p.from_max   = rv.profile_from_max;
+        ctrlApplyConfig(v);
+        relays[v]    = rv.relays;
+    }
+    //relayWrite() regrava rtc_buf: reles so depois de ler todas as cubas
+    for (size_t v=0;v<VESSEL_COUNT;v++){
+        if (relays[v] & 0x01){
+            relayWrite(relayOf(v,RELAY_ONE),HIGH);
+        }
+    }
+    boot_warm        = true;
+    boot_decision_us = system_get_time();
+    return true;
+}
+
+//! Publica uma vez por boot como foi a partida.
+void bootReport(){
+    if (boot_reported){
+        return;
+    }
+    char buf[64];
+    m_snprintf(buf,sizeof(buf),"%s reset=%u decision_us=%u",
+               boot_warm ? "warm" : "cold",system_get_rst_info()->reason,boot_decision_us);
+    mqtt.publish("freezer/boot",buf);
+    CON_INFO("Partida: %s",buf);
+    boot_reported = true;
+}
+//-----------------FIM PARTIDA QUENTE-------------------//
+
+//-------------------- ARQUIVOS ------------------//
+/*! Acesso aos arquivos do SPIFFS pela rede, sem buffers do tamanho do
+ * arquivo.
+ *
+ * files_index guarda nome e tamanho de cada arquivo. Ele e montado em uma
+ * unica passada pelo diretorio do SPIFFS (SPIFFS_readdir ja traz o tamanho)
+ * e so e refeito quando files_dirty indica que algo foi gravado, apagado ou
+ * renomeado desde a ultima montagem. beer/ls publica a listagem em
+ * freezer/ls, em linhas "nome tamanho", em quantas mensagens forem
+ * necessarias. A ultima linha e sempre "# LISTADOS/TOTAL": com mais de
+ * FILES_MAX arquivos a listagem para em FILES_MAX e TOTAL mostra quantos
+ * existem; com o SPIFFS vazio a resposta e so "# 0/0".
+ *
+ * beer/ini <nome> envia o arquivo em freezer/file, em blocos de FILE_CHUNK
+ * bytes lidos sempre no mesmo buffer estatico, cada um precedido de um
+ * fileChunk. O controle de fluxo e por janela: no maximo FILE_WINDOW blocos
+ * sem confirmacao. O cliente confirma em beer/fileAck com o seq do ultimo
+ * bloco recebido em ordem (confirmacao cumulativa). Sem confirmacao nova em
+ * FILE_ACK_TIMEOUT_MS o envio volta ao primeiro bloco nao confirmado, ate
+ * FILE_RETRIES vezes. No fim, freezer/fileStat recebe "nome bytes ms KB/s".
+ * beer/ini vazio cancela a transferencia.
+ */
+#define FILES_MAX           24
+#define FILE_NAME_LEN       32
+#define FILE_CHUNK          512
+#define FILE_WINDOW         4
+#define FILE_TICK_MS        20
+#define FILE_ACK_TIMEOUT_MS 3000
+#define FILE_RETRIES        5
+
+//! Entrada do indice de arquivos.
+struct fileEntry{
+    char     name[FILE_NAME_LEN];
+    uint32_t size;
+};
+
+//! Cabecalho de cada bloco em freezer/file.
+struct fileChunk{
+    uint16_t seq;      /*!< bloco (offset / FILE_CHUNK) */
+    uint8_t  last;     /*!< 1 no ultimo bloco */
+    uint8_t  reserved;
+    uint32_t offset;   /*!< posicao do bloco no arquivo */
+};
+
+//! Transferencia em andamento.
+struct fileTransfer{
+    bool     active;
+    char     name[FILE_NAME_LEN];
+    uint32_t size;
+    uint32_t next;    /*!< proximo byte a enviar */
+    uint32_t acked;   /*!< bytes confirmados */
+    uint32_t ack_ms;  /*!< millis() da ultima confirmacao nova */
+    uint32_t start_ms;
+    uint8_t  retries;
+};
+
+static fileEntry    files_index[FILES_MAX];
+static uint8_t      files_count = 0;
+static uint16_t     files_total = 0; //arquivos no SPIFFS, listados ou nao
+static fileTransfer file_tx;
+
+//! Refaz files_index se houve mudanca no SPIFFS.
+void filesRefresh(){
+    if (!files_dirty){
+        return;
+    }
+    spiffs_DIR    dir;
+    spiffs_dirent entry;
+    files_count = 0;
+    files_total = 0;
+    if (SPIFFS_opendir(&_filesystemStorageHandle,"/",&dir) != NULL){
+        while (SPIFFS_readdir(&dir,&entry) != NULL){
+            files_total++;
+            if (files_count == FILES_MAX){
+                continue; //so conta: o indice esta cheio
+            }
+            fileEntry &e = files_index[files_count++];
+            strncpy(e.name,(const char*)entry.name,FILE_NAME_LEN-1);
+            e.name[FILE_NAME_LEN-1] = 0;
+            e.size = entry.size;
+        }
+        SPIFFS_closedir(&dir);
+    }
+    files_dirty = false;
+}
+
+//! Lista arquivos no sistema de arquivos SPIFFS
+/*! Uma listagem simples, apenas para ver os arquivos disponíveis.*/
+void ls(){
+    filesRefresh();
+    CON_INFO("Listando arquivos:");
+    for (uint8_t i=0;i<files_count;i++){
+        CON_INFO("%s - %u Bytes",files_index[i].name,files_index[i].size);
+    }
+    if (files_total > files_count){
+        CON_WARN("... e mais %u arquivos fora do indice",files_total - files_count);
+    }
+}
+
+//! Publica a listagem em freezer/ls, quebrada em mensagens de FILE_CHUNK.
+/*! Sempre publica ao menos uma mensagem, terminada em "# LISTADOS/TOTAL". */
+void filesPublishList(){
+    static_assert(FILE_CHUNK <= POOL_BLOCK,"listagem maior que o bloco");
+    poolBuf scratch;
+    if (scratch.p == NULL){
+        return;
+    }
+    char *buf = (char*)scratch.p;
+    filesRefresh();
+    size_t n = 0;
+    for (uint8_t i=0;i<=files_count;i++){
+        char line[FILE_NAME_LEN + 16];
+        int  len;
+        if (i < files_count){
+            len = m_snprintf(line,sizeof(line),"%s %u\n",files_index[i].name,files_index[i].size);
+        }
+        else{
+            len = m_snprintf(line,sizeof(line),"# %u/%u\n",files_count,files_total);
+        }
+        if (n + len > FILE_CHUNK){
+            mqtt.publish("freezer/ls",String(buf,n));
+            n = 0;
+        }
+        memcpy(buf+n,line,len);
+        n += len;
+    }
+    mqtt.publish("freezer/ls",String(buf,n));
+}
+
+//! Tarefa TASK_FILE: envia o que a janela permitir.
+void fileSend(){
+    fileTransfer &t = file_tx;
+    if (!t.active || !mqttOnline()){
+        t.active = false;
+        taskStop(TASK_FILE);
+        return;
+    }
+    if (t.acked >= t.size && t.next >= t.size){
+        uint32_t ms = millis() - t.start_ms;
+        uint32_t rate = ms ? (uint64_t)t.size * 100000 / 1024 / ms : 0; //centesimos de KB/s
+        char buf[80];
+        m_snprintf(buf,sizeof(buf),"%s %u %u %u.%02u",t.name,t.size,ms,rate/100,rate%100);
+        mqtt.publish("freezer/fileStat",buf);
+        CON_INFO("Arquivo enviado: %s",buf);
+        t.active = false;
+        taskStop(TASK_FILE);
+        return;
+    }
+    if (millis() - t.ack_ms > FILE_ACK_TIMEOUT_MS){
+        if (++t.retries > FILE_RETRIES){
+            CON_WARN("Transferencia de %s abortada sem confirmacao.",t.name);
+            t.active = false;
+            taskStop(TASK_FILE);
+            return;
+        }
+        t.next   = t.acked; //volta ao primeiro bloco nao confirmado
+        t.ack_ms = millis();
+    }
+
+    static_assert(sizeof(fileChunk) + FILE_CHUNK <= POOL_BLOCK,"bloco do arquivo");
+    poolBuf scratch;
+    if (scratch.p == NULL){
+        return;
+    }
+    uint8_t *buf = scratch.p;
+    fileChunk *hdr = (fileChunk*)buf;
+    if (t.next >= t.size || t.next - t.acked >= FILE_WINDOW*FILE_CHUNK){
+        return; //janela cheia: espera confirmacao
+    }
+    file_t f = fileOpen(t.name,eFO_ReadOnly);
+    if (f < 0){
+        t.active = false;
+        taskStop(TASK_FILE);
+        return;
+    }
+    while (t.next < t.size && t.next - t.acked < FILE_WINDOW*FILE_CHUNK){
+        int n = -1;
+        if (fileSeek(f,t.next,eSO_FileStart) >= 0){
+            n = flashRead(f,buf + sizeof(fileChunk),FILE_CHUNK);
+        }
+        if (n <= 0){
+            t.size = t.next; //arquivo encolheu
+            break;
+        }
+        hdr->seq      = t.next / FILE_CHUNK;
+        hdr->offset   = t.next;
+        hdr->last     = t.next + n >= t.size ? 1 : 0;
+        hdr->reserved = 0;
+        if (!mqtt.publish("freezer/file",String((const char*)buf,sizeof(fileChunk) + n))){
+            break; //fila do MqttClient cheia: tenta no proximo tick
+        }
+        t.next += n;
+    }
+    fileClose(f);
+}
+
+//! Inicia o envio do arquivo name; vazio cancela o envio atual.
+void fileSendStart(const char *name, size_t len){
+    fileTransfer &t = file_tx;
+    if (len == 0){
+        t.active = false;
+        taskStop(TASK_FILE);
+        return;
+    }
+    if (len >= FILE_NAME_LEN){
+        CON_WARN("Nome de arquivo longo demais.");
+        return;
+    }
+    memcpy(t.name,name,len);
+    t.name[len] = 0;
+    if (!fileExist(t.name)){
+        CON_WARN("Arquivo nao encontrado: %s",t.name);
+        return;
+    }
+    t.size     = fileGetSize(t.name);
+    t.next     = 0;
+    t.acked    = 0;
+    t.retries  = 0;
+    t.start_ms = millis();
+    t.ack_ms   = t.start_ms;
+    t.active   = true;
+    taskStart(TASK_FILE,fileSend,FILE_TICK_MS,FILE_TICK_MS);
+}
+
+//! Confirmacao cumulativa: todos os blocos ate seq chegaram.
+void fileAck(uint16_t seq){
+    fileTransfer &t = file_tx;
+    uint32_t acked = ((uint32_t)seq + 1) * FILE_CHUNK;
+    if (acked > t.size){
+        acked = t.size;
+    }
+    if (!t.active || acked <= t.acked || acked > t.next){
+        return;
+    }
+    t.acked   = acked;
+    t.ack_ms  = millis();
+    t.retries = 0;
+}
+//-----------------FIM ARQUIVOS-------------------//
+
+//-------------------- DESPACHO DE TOPICOS ------------------//
+/*! Todos os topicos tratados pelo controlador estao abaixo de "beer/". O
+ * despacho e feito por uma tabela montada em tempo de compilacao: cada entrada
+ * guarda o hash FNV-1a do sufixo do topico (a parte depois de "beer/") e o
+ * handler correspondente. No callback o hash do sufixo recebido e calculado
+ * uma unica vez e comparado como inteiro; o memcmp final apenas descarta
+ * colisoes. Os handlers recebem a cuba, ponteiro e tamanho da mensagem, sem
+ * copias de String.
+ *
+ * O callback do MQTT nao chama o handler: a mensagem vai para a fila de
+ * entrada (ver ENTRADA) e o handler roda depois, em inDrain(). Entradas
+ * TOPIC_LATEST guardam apenas a mensagem mais nova por cuba; as TOPIC_FIFO
+ * sao todas entregues, na ordem de chegada. Quando a mensagem escolhe o que
+ * e configurado (o programa no fim de beer/minMax, o modo no inicio de
+ * beer/control), esse caractere entra na chave: TOPIC_LATEST_LAST e
+ * TOPIC_LATEST_FIRST guardam a mais nova por cuba e por programa ou modo.
+ *
+ * Um digito logo depois do prefixo escolhe a cuba: beer/1/temperature vai
+ * para a cuba 1 e beer/temperature para a cuba 0. Mensagens para cubas que
+ * nao existem em vessels[] sao descartadas. Topicos globais (ls, ini,
+ * fileAck, telemetry, limits, power, stats, selftest) ignoram a cuba.
+ */
+#define TOPIC_PREFIX     "beer/"
+#define TOPIC_PREFIX_LEN (sizeof(TOPIC_PREFIX)-1)
+
+//! Assinatura dos handlers de topico.
+typedef void (*topicHandler)(uint8_t v, const char *msg, size_t len);
+
+//! Hash FNV-1a de 32 bits, avaliado em tempo de compilacao para a tabela.
+constexpr uint32_t topicHash(const char *s, size_t len, uint32_t h = 2166136261u){
+    return len == 0 ? h : topicHash(s+1, len-1, (h ^ (uint8_t)*s) * 16777619u);
+}
+
+//! Mesmo hash de topicHash(), em laco, para o topico recebido.
+static inline uint32_t topicHashRt(const char *s, size_t len){
+    uint32_t h = 2166136261u;
+    for (size_t i=0;i<len;i++){
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+//! beer/program - F, M ou P
+void onTopicProgram(uint8_t v, const char *msg, size_t len){
+    char flag = len > 0 ? msg[0] : 0;
+    if (flag == 'F' || flag == 'M' || flag == 'P'){
+        defineProgram(v,flag);
+        return;
+    }
+    CON_WARN("Mensagem invalida: %s",msg);
+    logEvent(EV_BAD_PROGRAM,v);
+}
+
+//! beer/temperature - leitura da sonda
+void onTopicTemperature(uint8_t v, const char *msg, size_t len){
+    centi_t temp;
+    parseError err = parseCenti(msg,len,&temp);
+    if (err != PARSE_OK){
+        CON_WARN("beer/temperature invalido: %s",parseErrorStr(err));
+        return;
+    }
+    if (v == 0 && sensorActive()){
+        return; //o sensor local comanda o controlador da cuba 0
+    }
+    processReading(v,temp);
+}
+
+//! beer/ls - lista o SPIFFS em freezer/ls
+void onTopicLs(uint8_t v, const char *msg, size_t len){
+    filesPublishList();
+}
+
+//! beer/ini - envia um arquivo do SPIFFS em freezer/file
+void onTopicIni(uint8_t v, const char *msg, size_t len){
+    fileSendStart(msg,len);
+}
+
+//! beer/fileAck - seq do ultimo bloco recebido em ordem
+void onTopicFileAck(uint8_t v, const char *msg, size_t len){
+    int32_t seq;
+    if (parseInt(msg,len,0,65535,&seq) == PARSE_OK){
+        fileAck(seq);
+    }
+}
+
+//! beer/relay - acionamento manual dos reles
+void onTopicRelay(uint8_t v, const char *msg, size_t len){
+    if (len == 0){
+        return;
+    }
+    switch (msg[0]){
+        case '0': relaySet(relayOf(v,RELAY_ONE),HIGH); break;
+        case '1': relaySet(relayOf(v,RELAY_ONE),LOW);  break;
+        case '2': relaySet(relayOf(v,RELAY_TWO),HIGH); break;
+        case '3': relaySet(relayOf(v,RELAY_TWO),LOW);  break;
+    }
+}
+
+//! beer/minMax - MINIMA|MAXIMA|PROGRAMA
+void onTopicMinMax(uint8_t v, const char *msg, size_t len){
+    settingTemps(v,msg,len);
+}
+
+//! beer/control - configuracao do controlador (ver parseControl())
+void onTopicControl(uint8_t v, const char *msg, size_t len){
+    parseError err = parseControl(msg,len,&ctrl_cfg[v]);
+    if (err != PARSE_OK){
+        CON_WARN("beer/control invalido: %s",parseErrorStr(err));
+        return;
+    }
+    ctrlApplyConfig(v);
+    logEvent(EV_CONTROL,v);
+    settingsChanged();
+}
+
+//! beer/telemetry - INTERVALO|QOS do lote de telemetria
+void onTopicTelemetry(uint8_t v, const char *msg, size_t len){
+    const char *field[2];
+    size_t      flen[2];
+    int32_t     interval;
+    int32_t     qos;
+    parseError  err = PARSE_FIELDS;
+    if (splitFields(msg,len,field,flen,2) == 2){
+        err = parseInt(field[0],flen[0],10,3600,&interval);
+        if (err == PARSE_OK){
+            err = parseInt(field[1],flen[1],0,2,&qos);
+        }
+    }
+    if (err != PARSE_OK){
+        CON_WARN("beer/telemetry invalido: %s",parseErrorStr(err));
+        return;
+    }
+    telemetry_interval_s = interval;
+    telemetry_qos        = qos;
+    telemetryBegin();
+}
+
+//! beer/history - DE|ATE[|RES]; resposta em blocos em freezer/history
+void onTopicHistory(uint8_t v, const char *msg, size_t len){
+    parseError err = histQueryStart(v,msg,len);
+    if (err != PARSE_OK){
+        CON_WARN("beer/history invalido: %s",parseErrorStr(err));
+    }
+}
+
+//! beer/profile - passos MIN|MAX|HORAS|RAMPA separados por ';'; vazio cancela
+void onTopicProfile(uint8_t v, const char *msg, size_t len){
+    if (len == 0){
+        profileStop(v);
+        return;
+    }
+    parseError err = profileStart(v,msg,len);
+    if (err != PARSE_OK){
+        CON_WARN("beer/profile invalido: %s",parseErrorStr(err));
+    }
+}
+
+#ifdef STATS
+void statsPublish(bool reset);
+//! beer/stats - publica a instrumentacao; "reset" zera os slots
+void onTopicStats(uint8_t v, const char *msg, size_t len){
+    statsPublish(len == 5 && memcmp(msg,"reset",5) == 0);
+}
+#endif
+
+#ifdef SELFTEST
+void selftestStart();
+//! beer/selftest - repete a bateria de regressao
+void onTopicSelftest(uint8_t v, const char *msg, size_t len){
+    selftestStart();
+}
+#endif
+
+parseError powerCommand(const char *s, size_t len);
+void powerReport();
+//! beer/power - L, P ou P|PERIODO_S|JANELA_S; vazio so publica freezer/power
+void onTopicPower(uint8_t v, const char *msg, size_t len){
+    if (len > 0){
+        parseError err = powerCommand(msg,len);
+        if (err != PARSE_OK){
+            CON_WARN("beer/power invalido: %s",parseErrorStr(err));
+            return;
+        }
+    }
+    powerReport();
+}
+
+//! beer/limits - recarrega as configuracoes gravadas
+void onTopicLimits(uint8_t v, const char *msg, size_t len){
+    settingsLoad();
+}
+
+//! Politica da fila de entrada para o topico.
+enum topicMode{
+    TOPIC_FIFO   = 0, /*!< toda mensagem e entregue */
+    TOPIC_LATEST = 1, /*!< uma mensagem pendente por cuba; a nova substitui a antiga */
+    TOPIC_LATEST_FIRST = 2, /*!< como TOPIC_LATEST, por cuba e primeiro caractere */
+    TOPIC_LATEST_LAST  = 3, /*!< como TOPIC_LATEST, por cuba e ultimo caractere */
+};
+
+//! Entrada da tabela de topicos.
+struct topicEntry{
+    uint32_t     hash;    /*!< topicHash() do sufixo */
+    const char  *name;    /*!< sufixo depois de "beer/" */
+    uint8_t      len;     /*!< tamanho do sufixo */
+    uint8_t      mode;    /*!< topicMode */
+    topicHandler handler; /*!< funcao chamada com a mensagem */
+};
+
+#define TOPIC_ENTRY(name, mode, fn) { topicHash(name,sizeof(name)-1), name, sizeof(name)-1, mode, fn }
+
+//! Tabela de topicos, ordenada pela frequencia esperada de mensagens.
+static const topicEntry topics[] = {
+    TOPIC_ENTRY("temperature", TOPIC_LATEST,       onTopicTemperature),
+    TOPIC_ENTRY("program",     TOPIC_LATEST,       onTopicProgram),
+    TOPIC_ENTRY("minMax",      TOPIC_LATEST_LAST,  onTopicMinMax),
+    TOPIC_ENTRY("relay",       TOPIC_FIFO,         onTopicRelay),
+    TOPIC_ENTRY("control",     TOPIC_LATEST_FIRST, onTopicControl),
+    TOPIC_ENTRY("profile",     TOPIC_LATEST,       onTopicProfile),
+    TOPIC_ENTRY("history",     TOPIC_FIFO,         onTopicHistory),
+    TOPIC_ENTRY("telemetry",   TOPIC_LATEST,       onTopicTelemetry),
+    TOPIC_ENTRY("limits",      TOPIC_LATEST,       onTopicLimits),
+    TOPIC_ENTRY("power",       TOPIC_FIFO,         onTopicPower),
+    TOPIC_ENTRY("ls",          TOPIC_LATEST,       onTopicLs),
+    TOPIC_ENTRY("ini",         TOPIC_FIFO,         onTopicIni),
+    TOPIC_ENTRY("fileAck",     TOPIC_LATEST,       onTopicFileAck),
+#ifdef STATS
+    TOPIC_ENTRY("stats",       TOPIC_FIFO,         onTopicStats),
+#endif
+#ifdef SELFTEST
+    TOPIC_ENTRY("selftest",    TOPIC_LATEST,       onTopicSelftest),
+#endif
+};
+
+//! Indice em topics[] do sufixo t (sem "beer/" e sem a cuba); -1 se desconhecido.
+int topicFind(const char *t, size_t len){
+    uint32_t h = topicHashRt(t,len);
+    for (size_t i=0;i<sizeof(topics)/sizeof(topics[0]);i++){
+        const topicEntry &e = topics[i];
+        if (e.hash == h && e.len == len && memcmp(e.name,t,len) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+//-----------------FIM DESPACHO DE TOPICOS-------------------//
+
+//-------------------- ENTRADA ------------------//
+/*! Fila das mensagens recebidas. onMessageReceived() apenas copia a mensagem
+ * para in_ring e agenda TASK_INBOUND; inDrain() chama ate IN_DRAIN_BUDGET
+ * handlers por vez e se reagenda enquanto houver mensagens, de modo que uma
+ * rajada do broker nao segura o callback de rede nem gravacoes na flash.
+ *
+ * Cada registro e um inHeader seguido da mensagem, gravados em sequencia no
+ * anel. Para topicos TOPIC_LATEST*, uma mensagem pendente do mesmo topico,
+ * cuba e chave (inKey()) e marcada IN_DEAD (contada em in_coalesced) e a
+ * nova vai para o fim:
+ * vale a ultima, sem perder a ordem em relacao aos outros topicos (o
+ * programa em beer/minMax e beer/program, por exemplo). Mensagens maiores que
+ * IN_MSG_MAX ou que nao cabem no anel sao descartadas em in_dropped.
+ */
+#define IN_RING_LEN     2048
+#define IN_MSG_MAX      800
+#define IN_DRAIN_MS     1
+#define IN_DRAIN_BUDGET 4
+#define IN_DEAD         0xFF
+
+//! Cabecalho de cada mensagem em in_ring.
+struct inHeader{
+    uint8_t  topic; /*!< indice em topics[] ou IN_DEAD */
+    uint8_t  v;     /*!< cuba */
+    uint8_t  key;   /*!< inKey() da mensagem */
+    uint8_t  reserved;
+    uint16_t len;   /*!< bytes da mensagem que seguem */
+};
+
+static uint8_t  in_ring[IN_RING_LEN];
+static uint16_t in_head      = 0; //primeiro registro pendente
+static uint16_t in_count     = 0; //bytes ocupados
+static uint32_t in_received  = 0;
+static uint32_t in_processed = 0;
+static uint32_t in_coalesced = 0;
+static uint32_t in_dropped   = 0;
+
+//! Copia n bytes para o anel a partir de pos.
+static void inCopyIn(uint16_t pos, const void *src, size_t n){
+    const uint8_t *p = (const uint8_t*)src;
+    for (size_t i=0;i<n;i++){
+        in_ring[(pos + i) % IN_RING_LEN] = p[i];
+    }
+}
+
+//! Copia n bytes do anel a partir de pos.
+static void inCopyOut(uint16_t pos, void *dst, size_t n){
+    uint8_t *p = (uint8_t*)dst;
+    for (size_t i=0;i<n;i++){
+        p[i] = in_ring[(pos + i) % IN_RING_LEN];
+    }
+}
+
+//! Chama os handlers das mensagens pendentes, IN_DRAIN_BUDGET por vez.
+void inDrain(){
+    static_assert(IN_MSG_MAX + 1 <= POOL_BLOCK,"mensagem maior que o bloco");
+    poolBuf scratch;
+    if (scratch.p == NULL){
+        taskStart(TASK_INBOUND,inDrain,IN_DRAIN_MS,0);
+        return;
+    }
+    char   *msg     = (char*)scratch.p;
+    uint8_t handled = 0;
+    while (in_count > 0 && handled < IN_DRAIN_BUDGET){
+        inHeader h;
+        inCopyOut(in_head,&h,sizeof(h));
+        inCopyOut((in_head + sizeof(h)) % IN_RING_LEN,msg,h.len);
+        in_head   = (in_head + sizeof(h) + h.len) % IN_RING_LEN;
+        in_count -= sizeof(h) + h.len;
+        if (h.topic == IN_DEAD){
+            continue;
+        }
+        msg[h.len] = 0;
+        {
+            STATS_SCOPE(ST_INBOUND);
+            topics[h.topic].handler(h.v,msg,h.len);
+        }
+        in_processed++;
+        handled++;
+    }
+    if (in_count > 0){
+        taskStart(TASK_INBOUND,inDrain,IN_DRAIN_MS,0);
+    }
+}
+
+//! Chave de agrupamento: primeiro ou ultimo caractere nao branco, conforme o modo.
+static uint8_t inKey(uint8_t mode, const char *msg, size_t len){
+    while (len > 0 && isBlank(*msg)){
+        msg++;
+        len--;
+    }
+    while (len > 0 && isBlank(msg[len-1])){
+        len--;
+    }
+    if (len == 0){
+        return 0;
+    }
+    if (mode == TOPIC_LATEST_FIRST){
+        return msg[0];
+    }
+    return mode == TOPIC_LATEST_LAST ? msg[len-1] : 0;
+}
+
+//! Enfileira a mensagem para topics[topic]; chamada apenas do callback.
+void inPush(uint8_t topic, uint8_t v, const char *msg, size_t len){
+    in_received++;
+    size_t need = sizeof(inHeader) + len;
+    if (len > IN_MSG_MAX){
+        in_dropped++;
+        return;
+    }
+
+    uint8_t mode = topics[topic].mode;
+    uint8_t key  = inKey(mode,msg,len);
+    int32_t old  = -1;
+    if (mode != TOPIC_FIFO){
+        uint16_t pos  = in_head;
+        uint16_t left = in_count;
+        while (left > 0){
+            inHeader h;
+            inCopyOut(pos,&h,sizeof(h));
+            if (h.topic == topic && h.v == v && h.key == key){
+                old = pos;
+                break;
+            }
+            pos   = (pos + sizeof(h) + h.len) % IN_RING_LEN;
+            left -= sizeof(h) + h.len;
+        }
+    }
+    if ((size_t)(IN_RING_LEN - in_count) < need){
+        in_dropped++;
+        return;
+    }
+    if (old >= 0){
+        in_ring[old] = IN_DEAD;
+        in_coalesced++;
+    }
+
+    inHeader h = {topic, v, key, 0, (uint16_t)len};
+    uint16_t tail = (in_head + in_count) % IN_RING_LEN;
+    inCopyIn(tail,&h,sizeof(h));
+    inCopyIn((tail + sizeof(h)) % IN_RING_LEN,msg,len);
+    in_count += need;
+
+    if (!taskActive(TASK_INBOUND)){
+        taskStart(TASK_INBOUND,inDrain,IN_DRAIN_MS,0);
+    }
+}
+//-----------------FIM ENTRADA-------------------//
+
+//! Callback do MQTT
+/*! Essa funcao é utilizada como callback da comunicação MQTT. Apenas separa
+ * a cuba, localiza o topico na tabela topics[] e enfileira a mensagem.*/
+void onMessageReceived(String topic,String msg){
+    STATS_SCOPE(ST_MESSAGE);
+    const char *t = topic.c_str();
+    size_t len    = topic.length();
+
+    if (len <= TOPIC_PREFIX_LEN || memcmp(t,TOPIC_PREFIX,TOPIC_PREFIX_LEN) != 0){
+        return;
+    }
+    t   += TOPIC_PREFIX_LEN;
+    len -= TOPIC_PREFIX_LEN;
+
+    uint8_t v = 0;
+    if (len > 2 && t[0] >= '0' && t[0] <= '9' && t[1] == '/'){
+        v    = t[0] - '0';
+        t   += 2;
+        len -= 2;
+        if (v >= VESSEL_COUNT){
+            return;
+        }
+    }
+
+    int i = topicFind(t,len);
+    if (i >= 0){
+        inPush(i,v,msg.c_str(),msg.length());
+    }
+}
+
+//-------------------- CONEXAO MQTT ------------------//
+/*! Uma unica maquina de estados cuida da conexao com o broker:
+ *
+ *   MQTT_IDLE -> mqttConnect() -> MQTT_CONNECTING
+ *   MQTT_CONNECTING -> sessao confirmada -> MQTT_ONLINE (subscribe unico)
+ *   MQTT_CONNECTING/MQTT_ONLINE -> conexao encerrada -> MQTT_BACKOFF
+ *   MQTT_BACKOFF -> TASK_MQTT -> mqttConnect()
+ *
+ * O encerramento vem do delegate de conclusao do TcpClient
+ * (onMqttComplete()); como o MqttClient nao avisa quando a sessao abre,
+ * TASK_MQTT verifica o estado a cada MQTT_POLL_MS por ate MQTT_CONFIRM_MS
+ * depois do connect. A espera entre tentativas dobra a cada falha, de
+ * MQTT_BACKOFF_MIN_MS ate MQTT_BACKOFF_MAX_MS, com +-25% de jitter para que
+ * varios controladores nao voltem todos ao mesmo tempo. mqttStop() encerra a
+ * sessao e volta a MQTT_IDLE sem nova tentativa (fim das janelas de rede do
+ * modo de baixo consumo).
+ */
+#define MQTT_POLL_MS         200
+#define MQTT_CONFIRM_MS      5000
+#define MQTT_BACKOFF_MIN_MS  1000
+#define MQTT_BACKOFF_MAX_MS  60000
+#define MQTT_KEEPALIVE_S     60
+
+//! Estados da conexao com o broker.
+enum mqttState{
+    MQTT_IDLE,       /*!< ainda nao iniciado */
+    MQTT_CONNECTING, /*!< connect enviado, aguardando a sessao */
+    MQTT_ONLINE,     /*!< sessao aberta e inscrita em beer/# */
+    MQTT_BACKOFF,    /*!< aguardando a proxima tentativa */
+};
+
+static uint8_t  mqtt_state      = MQTT_IDLE;
+static uint32_t mqtt_backoff_ms = MQTT_BACKOFF_MIN_MS;
+static uint32_t mqtt_wait_ms    = 0; //tempo aguardando a sessao
+static uint32_t mqtt_attempts   = 0; //chamadas a connect
+static uint32_t mqtt_sessions   = 0; //sessoes estabelecidas
+static uint16_t mqtt_keepalive_s = MQTT_KEEPALIVE_S; //aplicado no proximo connect
+
+void mqttConnect();
+
+//! Agenda a proxima tentativa com backoff exponencial e jitter.
+void mqttRetry(){
+    uint32_t delay_ms = mqtt_backoff_ms - mqtt_backoff_ms/4 + os_random() % (mqtt_backoff_ms/2 + 1);
+    mqtt_backoff_ms   = mqtt_backoff_ms*2 > MQTT_BACKOFF_MAX_MS ? MQTT_BACKOFF_MAX_MS : mqtt_backoff_ms*2;
+    mqtt_state        = MQTT_BACKOFF;
+    taskStart(TASK_MQTT,mqttConnect,delay_ms,0);
+    CON_INFO("MQTT: nova tentativa em %u ms",delay_ms);
+}
+
+//! Delegate de conclusao do TcpClient: a conexao foi encerrada.
+void onMqttComplete(TcpClient& client, bool successful){
+    if (mqtt_state == MQTT_BACKOFF || mqtt_state == MQTT_IDLE){
+        return;
+    }
+    if (mqtt_state == MQTT_ONLINE){
+        CON_WARN("MQTT Broker Disconnected!!");
+        mqtt_backoff_ms = MQTT_BACKOFF_MIN_MS;
+    }
+    else{
+        CON_WARN("MQTT Broker Unreachable!!");
+    }
+    taskStop(TASK_MQTT);
+    mqttRetry();
+}
+
+//! Verifica se a sessao abriu depois do connect.
+void mqttPoll(){
+    if (mqtt_state != MQTT_CONNECTING){
+        return;
+    }
+    if (mqtt.getConnectionState() == eTCS_Connected){
+        taskStop(TASK_MQTT);
+        mqtt_state      = MQTT_ONLINE;
+        mqtt_backoff_ms = MQTT_BACKOFF_MIN_MS;
+        mqtt_sessions++;
+        mqtt.subscribe("beer/#");
+        mqtt.publish("freezer/alive", "Starting");
+        bootReport();
+        CON_INFO("MQTT: sessao aberta, inscrito em beer/#");
+        return;
+    }
+    mqtt_wait_ms += MQTT_POLL_MS;
+    if (mqtt_wait_ms >= MQTT_CONFIRM_MS){
+        taskStop(TASK_MQTT);
+        mqttRetry();
+    }
+}
+
+//! Envia o connect e passa a aguardar a sessao.
+void mqttConnect(){
+    mqtt_state   = MQTT_CONNECTING;
+    mqtt_wait_ms = 0;
+    mqtt_attempts++;
+    mqtt.setCompleteDelegate(onMqttComplete);
+    mqtt.setKeepAlive(mqtt_keepalive_s);
+    mqtt.connect(MQTT_ID, MQTT_USER, MQTT_PASSWD);
+    taskStart(TASK_MQTT,mqttPoll,MQTT_POLL_MS,MQTT_POLL_MS);
+}
+
+//! Inicia a maquina de estados; chamadas repetidas sao ignoradas.
+void mqttStart(){
+    if (mqtt_state == MQTT_IDLE){
+        mqttConnect();
+    }
+}
+
+//! Encerra a sessao (ou a tentativa em curso) e volta a MQTT_IDLE.
+void mqttStop(){
+    taskStop(TASK_MQTT);
+    bool open  = mqtt_state != MQTT_IDLE && mqtt_state != MQTT_BACKOFF;
+    mqtt_state = MQTT_IDLE;
+    if (open){
+        mqtt.close();
+    }
+}
+
+//! Verdadeiro com a sessao aberta.
+bool mqttOnline(){
+    return mqtt_state == MQTT_ONLINE;
+}
+//-----------------FIM CONEXAO MQTT-------------------//
+
+//! Apenas publica o status da conexão.
+/*! Esse publishing é feito pela tarefa TASK_ALIVE, agendada por powerSet(). A reconexao fica por conta da maquina de estados acima.
+ */
+void publishIamLive(){
+    if (!mqttOnline()){
+        return;
+    }
+	CON_DEBUG("Publicando status");
+	mqtt.publish("freezer/alive", "Alive");
+}
+
+//! Chamada em caso de falha da conexão com o broker.
+void failed(){
+    CON_ERR("Falha na conexao de rede!");
+    //qualquer coisa mais, colocar por aqui.
+    logEvent(EV_NET_FAIL);
+    //as tentativas seguem em backoff ate a rede voltar
+    mqttStart();
+}
+
+//! Chamada em caso de sucesso na conexão com o broker.
+void successful(){
+    CON_INFO("Conexao bem sucedida. Iniciando MQTT...");
+    mqttStart();
+    clockBegin();
+}
+
+//! Configuração inicial da interface sta e desabilitação do modo AP.
+/*! Essa função se encarrega de fazer a primeira conexão com a rede WiFi
+ * especificada nos defines no inicio do programa. Após confirmada a conexão,
+ * o modo AP é desabilitado. Nos resets do ESP8266 essa função não terá mais
+ *  efeito. 
+ */
+void sta_if(){
     if (!WifiStation.isEnabled()){
         WifiStation.enable(true);
-        Serial.println("Ativando interface sta...");
+        CON_INFO("Ativando interface sta...");
     }
     if (!WifiStation.isConnected()){
         WifiStation.config(MY_SSID,MY_PASSWD,true);
-        Serial.println("Conectando ao SSID...");
+        CON_INFO("Conectando ao SSID...");
     }
     if (WifiAccessPoint.isEnabled() && WifiStation.isConnected()){
         WifiAccessPoint.enable(false);
-        Serial.println("Desativando AP...");
+        CON_INFO("Desativando AP...");
     }
     
     WifiStation.waitConnection(successful,20,failed);
 }
-//! Garantia da conexão constate
-/*! Essa função se encarrega de manter a conexão funcional em qualquer situação.
+//-------------------- ENERGIA ------------------//
+/*! Perfis de operacao, escolhidos em beer/power:
+ *
+ * - POWER_LATENCY ("L"): radio sempre ligado, freezer/alive a cada 10 s.
+ * - POWER_LOW ("P" ou "P|PERIODO_S|JANELA_S"): o radio fica desligado e so
+ *   liga numa janela de power_window_s a cada power_period_s. Dentro da
+ *   janela a conexao, a sessao MQTT (keep-alive de POWER_KEEPALIVE_S, em
+ *   modem sleep), freezer/alive e o esvaziamento da caixa de saida acontecem
+ *   juntos; a janela se estende ate POWER_WINDOW_MAX_S enquanto houver
+ *   registros na caixa de saida. Telemetria e eventos gerados fora da janela
+ *   vao para a caixa de saida, como em qualquer queda de rede.
+ *
+ * O controle, o sensor, os perfis e o log nao dependem do radio e seguem
+ * normalmente. Mensagens para beer/# so chegam durante as janelas.
+ *
+ * O tempo de radio ligado e contado nos dois perfis: power_last_hour traz
+ * os ms da ultima hora completa e freezer/power (beer/power vazio) o
+ * perfil, a hora atual, a ultima e o numero de janelas. O perfil inicial e
+ * POWER_DEFAULT e nao e gravado na flash.
+ */
+#define POWER_LATENCY      'L'
+#define POWER_LOW          'P'
+#ifndef POWER_DEFAULT
+#define POWER_DEFAULT      POWER_LATENCY
+#endif
+#define POWER_PERIOD_S     300
+#define POWER_WINDOW_S     20
+#define POWER_WINDOW_MAX_S 60
+#define POWER_KEEPALIVE_S  600
+#define POWER_ACCOUNT_MS   60000
+#define POWER_HOUR_MS      3600000UL
+#define ALIVE_MS           10000
+
+static uint8_t  power_profile     = POWER_LATENCY;
+static uint16_t power_period_s    = POWER_PERIOD_S;
+static uint16_t power_window_s    = POWER_WINDOW_S;
+static bool     power_radio       = true; //radio ligado
+static uint32_t power_radio_since = 0;    //millis() em que o radio ligou
+static uint32_t power_radio_ms    = 0;    //radio ligado, trechos encerrados
+static uint32_t power_hour_start  = 0;    //millis() do inicio da hora atual
+static uint32_t power_hour_base   = 0;    //powerRadioTotal() no inicio da hora
+static uint32_t power_last_hour   = 0;    //ms de radio na ultima hora completa
+static uint32_t power_windows     = 0;
+static uint32_t power_window_ms   = 0;    //millis() da abertura da janela atual
+
+void powerWindowOpen();
+
+//! ms de radio ligado desde o boot (com o trecho em andamento).
+uint32_t powerRadioTotal(uint32_t now){
+    return power_radio_ms + (power_radio ? now - power_radio_since : 0);
+}
+
+//! Fecha as horas completas desde a ultima chamada.
+void powerAccount(){
+    uint32_t now = millis();
+    if (now - power_hour_start < POWER_HOUR_MS){
+        return;
+    }
+    uint32_t total   = powerRadioTotal(now);
+    power_last_hour  = total - power_hour_base;
+    power_hour_base  = total;
+    power_hour_start = now;
+}
+
+//! Liga ou desliga o radio; a sessao MQTT recomeca do zero nos dois casos.
+void powerRadio(bool on){
+    if (on == power_radio){
+        return;
+    }
+    uint32_t now = millis();
+    mqttStop();
+    if (on){
+        power_radio       = true;
+        power_radio_since = now;
+        sta_if(); //successful() abre a sessao
+    }
+    else{
+        power_radio_ms += now - power_radio_since;
+        power_radio     = false;
+        WifiStation.enable(false);
+    }
+}
+
+//! Fim da janela: espera a caixa de saida ou desliga o radio ate a proxima.
+void powerWindowClose(){
+    uint32_t elapsed = millis() - power_window_ms;
+    if (outbox_pending && mqttOnline() && elapsed < POWER_WINDOW_MAX_S*1000UL){
+        taskStart(TASK_POWER,powerWindowClose,1000,0);
+        return;
+    }
+    powerAccount();
+    powerRadio(false);
+    uint32_t period = power_period_s*1000UL;
+    taskStart(TASK_POWER,powerWindowOpen,elapsed < period ? period - elapsed : 0,0);
+}
+
+//! Inicio da janela: radio, sessao e freezer/alive juntos.
+void powerWindowOpen(){
+    powerAccount();
+    power_windows++;
+    power_window_ms = millis();
+    powerRadio(true);
+    taskStart(TASK_ALIVE,publishIamLive,power_window_s*500UL,0);
+    taskStart(TASK_POWER,powerWindowClose,power_window_s*1000UL,0);
+}
+
+//! Publica o perfil e o tempo de radio em freezer/power.
+void powerReport(){
+    if (!mqttOnline()){
+        return;
+    }
+    powerAccount();
+    uint32_t now = millis();
+    char buf[96];
+    m_snprintf(buf,sizeof(buf),"%c period=%u window=%u radio_ms_hour=%u last_hour=%u windows=%u",
+               power_profile,power_period_s,power_window_s,
+               powerRadioTotal(now) - power_hour_base,power_last_hour,power_windows);
+    mqtt.publish("freezer/power",buf);
+}
+
+//! Troca o perfil de energia.
+void powerSet(uint8_t profile, uint16_t period_s, uint16_t window_s){
+    power_profile  = profile;
+    power_period_s = period_s;
+    power_window_s = window_s;
+    if (profile == POWER_LOW){
+        mqtt_keepalive_s = POWER_KEEPALIVE_S;
+        wifi_set_sleep_type(MODEM_SLEEP_T);
+        taskStop(TASK_ALIVE);
+        //o tempo ligado ate aqui conta como a janela atual
+        power_window_ms = millis();
+        taskStart(TASK_POWER,powerWindowClose,power_window_s*1000UL,0);
+    }
+    else{
+        mqtt_keepalive_s = MQTT_KEEPALIVE_S;
+        wifi_set_sleep_type(NONE_SLEEP_T);
+        powerRadio(true);
+        taskStart(TASK_ALIVE,publishIamLive,ALIVE_MS,ALIVE_MS);
+        taskStart(TASK_POWER,powerAccount,POWER_ACCOUNT_MS,POWER_ACCOUNT_MS);
+    }
+}
+
+//! Le L ou P[|PERIODO_S|JANELA_S] (ex.: P|600|30) e aplica o perfil.
+parseError powerCommand(const char *s, size_t len){
+    const char *field[3];
+    size_t      flen[3];
+    size_t      n = splitFields(s,len,field,flen,3);
+    if ((n != 1 && n != 3) || flen[0] != 1 ||
+        (field[0][0] != POWER_LATENCY && field[0][0] != POWER_LOW)){
+        return PARSE_FIELDS;
+    }
+    int32_t period = power_period_s;
+    int32_t window = power_window_s;
+    if (n == 3){
+        parseError err = parseInt(field[1],flen[1],60,86400,&period);
+        if (err == PARSE_OK){
+            err = parseInt(field[2],flen[2],10,POWER_WINDOW_MAX_S,&window);
+        }
+        if (err != PARSE_OK){
+            return err;
+        }
+        if (window >= period){
+            return PARSE_RANGE;
+        }
+    }
+    powerSet(field[0][0],period,window);
+    return PARSE_OK;
+}
+//-----------------FIM ENERGIA-------------------//
+
+#ifdef STATS
+//! Relatorio em montagem num bloco do pool.
+struct statsOut{
+    char  *buf;
+    size_t n;
+};
+
+//! Publica ate a ultima linha completa e move o resto para o inicio.
+static void statsFlush(statsOut &o){
+    size_t cut = o.n;
+    while (cut > 0 && o.buf[cut-1] != '\n'){
+        cut--;
+    }
+    if (cut == 0){
+        cut = o.n; //linha maior que o bloco: vai como esta
+    }
+    if (mqttOnline()){
+        mqtt.publish("freezer/stats",String(o.buf,cut));
+    }
+    memmove(o.buf,o.buf+cut,o.n-cut);
+    o.n -= cut;
+}
+
+//! m_snprintf() no fim do bloco; sem espaco, publica antes as linhas prontas.
+void statsAppend(statsOut &o, const char *fmt, ...){
+    for (int tries=0;tries<2;tries++){
+        va_list args;
+        va_start(args,fmt);
+        int w = m_vsnprintf(o.buf+o.n,POOL_BLOCK-o.n,fmt,args);
+        va_end(args);
+        if (w < 0){
+            return;
+        }
+        if (o.n + w < POOL_BLOCK){
+            o.n += w;
+            return;
+        }
+        statsFlush(o);
+    }
+    o.n = POOL_BLOCK - 1; //truncado
+}
+
+//! Publica o relatorio em freezer/stats, em uma ou mais mensagens.
+/*! O relatorio passa de um bloco do pool: cada mensagem leva linhas
+ * inteiras, na ordem. */
+void statsPublish(bool reset){
+    poolBuf scratch;
+    if (scratch.p == NULL){
+        CON_WARN("Sem bloco livre para freezer/stats.");
+        return;
+    }
+    statsOut o   = {(char*)scratch.p,0};
+    uint32_t mhz = system_get_cpu_freq();
+    statsHeapSample();
+    statsBlockSample();
+    for (uint8_t i=0;i<ST_COUNT;i++){
+        const statsSlot &st = stats_slots[i];
+        uint32_t avg = st.count ? st.sum / st.count : 0;
+        statsAppend(o,"%s n=%u min=%u avg=%u max=%u us h=",
+                        stats_names[i],st.count,st.min/mhz,avg/mhz,st.max/mhz);
+        for (uint8_t b=0;b<STATS_BUCKETS;b++){
+            statsAppend(o,b ? ",%u" : "%u",st.hist[b]);
+        }
+        statsAppend(o,"\n");
+    }
+    for (uint8_t i=0;i<TASK_COUNT;i++){
+        const task &t = tasks[i];
+        statsAppend(o,"task %s n=%u max=%u us over=%u late=%u ms\n",
+                        task_info[i].name,t.runs,t.max_us,t.overruns,t.late_max_ms);
+    }
+    statsAppend(o,"sched deferred=%u\n",sched_deferred);
+    for (uint8_t v=0;v<VESSEL_COUNT;v++){
+        const ctrlModel &m = ctrl_model[v];
+        //centesimos por hora
+        int32_t warm = ((int64_t)m.theta[0] * 3600000 / CTRL_MODEL_SAMPLE_MS) >> 16;
+        int32_t cool = (((int64_t)m.theta[0] + m.theta[1]) * 3600000 / CTRL_MODEL_SAMPLE_MS) >> 16;
+        statsAppend(o,"model %u warm=%d cool=%d c/h lag=%u s n=%u ready=%u\n",
+                        v,warm,cool,m.lag_s,m.samples,ctrlModelReady(v));
+    }
+    statsAppend(o,"heap=%u min=%u block_boot=%u block_min=%u drift=%d\n",
+                    system_get_free_heap_size(),stats_heap_min,stats_block_boot,stats_block_min,
+                    (int32_t)(stats_block_boot - stats_block_min));
+    statsAppend(o,"pool blocks=%u high=%u fail=%u\n",
+                    POOL_BLOCKS,pool_high,pool_fail);
+    statsAppend(o,"flash w=%u wb=%u r=%u rb=%u log_dropped=%u\n",
+                    flash_writes,flash_bytes,flash_reads,flash_read_bytes,log_dropped);
+    statsAppend(o,"console_dropped=%u\n",con_dropped);
+    statsAppend(o,"inbound received=%u processed=%u coalesced=%u dropped=%u\n",
+                    in_received,in_processed,in_coalesced,in_dropped);
+    for (uint8_t v=0;v<VESSEL_COUNT;v++){
+        const anaState &st = ana[v];
+        statsAppend(o,"ana %u cycles_h=%u base_rate=%d c/h n=%u today on_s=%u cycles=%u alerts=%u\n",
+                        v,st.hour_cycles,st.base_rate,st.base_n,st.today.on_s,st.today.cycles,
+                        st.today.alerts);
+    }
+    statsAppend(o,"power %c radio_ms_hour=%u last_hour=%u windows=%u\n",
+                    power_profile,powerRadioTotal(millis()) - power_hour_base,power_last_hour,
+                    power_windows);
+    statsAppend(o,"outbox queued=%u sent=%u dropped=%u\n",
+                    outbox_queued,outbox_sent,outbox_dropped);
+    statsAppend(o,"mqtt attempts=%u sessions=%u",mqtt_attempts,mqtt_sessions);
+
+    if (mqttOnline()){
+        mqtt.publish("freezer/stats",String(o.buf,o.n));
+    }
+    if (reset){
+        memset(stats_slots,0,sizeof(stats_slots));
+        for (uint8_t i=0;i<TASK_COUNT;i++){
+            tasks[i].runs        = 0;
+            tasks[i].max_us      = 0;
+            tasks[i].overruns    = 0;
+            tasks[i].late_max_ms = 0;
+        }
+        sched_deferred = 0;
+        stats_heap_min  = 0xFFFFFFFF;
+        stats_block_min = 0xFFFFFFFF; //a proxima sondagem vem com o proximo relatorio
+        statsHeapSample();
+    }
+}
+#endif
+
+//-------------------- SELFTEST ------------------//
+/*! Bateria de regressao de desempenho, compilada apenas com SELFTEST. Repete
+ * SELFTEST_PASSES vezes o trace selftest_trace[] pelo onMessageReceived(),
+ * exatamente como se as mensagens viessem do broker, e mede:
+ *
+ * - latencia de cada mensagem, do onMessageReceived() ate o fim do handler
+ *   (inDrain() chamado ate a fila esvaziar), em p50, p90, p99 e maxima (us);
+ * - menor heap livre observado durante a repeticao;
+ * - gravacoes na flash ate SELFTEST_SETTLE_MS depois da ultima mensagem
+ *   (tempo para as gravacoes agrupadas acontecerem).
+ *
+ * O trace e montado a partir do estado atual: as leituras giram em torno da
+ * faixa do programa ativo e beer/minMax e beer/program reenviam os valores ja
+ * gravados, de modo que a repeticao nao altera as configuracoes. Qualquer
+ * metrica acima do limite SELFTEST_MAX_* reprova a bateria.
+ *
+ * Em seguida vem a carga: SELFTEST_LOAD_MSGS mensagens do mesmo trace, uma a
+ * cada SELFTEST_LOAD_MS (100 msg/s), com o laco principal livre entre elas.
+ * O relatorio traz quantas foram processadas, agrupadas e descartadas pela
+ * fila de entrada, o maior tempo de callback e o jitter de TASK_CONTROL
+ * (maior atraso em relacao ao horario previsto) com a fila e a manutencao
+ * disputando o escalonador; reprova com descarte, callback acima de
+ * SELFTEST_MAX_CB_US ou jitter acima de SELFTEST_MAX_JITTER_MS. O resultado vai
+ * para a serial e, com o broker disponivel, para freezer/selftest. Roda 10 s
+ * apos o boot e sempre que algo for publicado em beer/selftest; cada etapa
+ * (bateria, relatorio, carga) e agendada em TASK_SELFTEST.
  */
-void keepLooking(){
-    if (mqtt.getConnectionState() != eTCS_Connected){
-        Serial.println("Reconectando!!!");
-        startMqttClient();
+#ifdef SELFTEST
+#define SELFTEST_PASSES        10
+#define SELFTEST_SETTLE_MS     (SETTINGS_COALESCE_MS + 1000)
+#define SELFTEST_MAX_P99_US    5000
+#define SELFTEST_MAX_HEAP_DROP 2048
+#define SELFTEST_MAX_WRITES    4
+#define SELFTEST_LOAD_MSGS     1000
+#define SELFTEST_LOAD_MS       10
+#define SELFTEST_MAX_CB_US     500
+#define SELFTEST_MAX_JITTER_MS (2*SCHED_TICK_MS)
+
+//! Mensagem do trace: leitura relativa ao meio da faixa ou topico de configuracao.
+struct selftestMsg{
+    const char *topic;  /*!< sufixo depois de "beer/" */
+    int16_t     offset; /*!< centesimos somados ao meio da faixa (temperature) */
+};
+
+static const selftestMsg selftest_trace[] = {
+    {"temperature",    0}, {"temperature",   20}, {"temperature",   40},
+    {"temperature",   80}, {"temperature",  150}, {"temperature",  120},
+    {"temperature",   60}, {"temperature",    0}, {"temperature",  -60},
+    {"temperature", -120}, {"temperature", -150}, {"temperature",  -80},
+    {"minMax",         0}, {"minMax",         0}, {"minMax",         0},
+    {"temperature",  -40}, {"temperature",    0}, {"program",        0},
+    {"temperature",   30}, {"temperature", 9999}, {"relay",          0},
+    {"temperature",   10},
+};
+
+#define SELFTEST_LEN (sizeof(selftest_trace)/sizeof(selftest_trace[0]))
+
+static uint32_t selftest_lat[SELFTEST_LEN*SELFTEST_PASSES];
+static uint32_t selftest_heap_start;
+static uint32_t selftest_heap_min;
+static uint32_t selftest_writes_start;
+static uint32_t selftest_load_sent;
+static uint32_t selftest_load_cb_max;
+static uint32_t selftest_load_start[3]; //in_processed, in_coalesced, in_dropped
+static uint32_t selftest_load_runs;
+static uint32_t selftest_load_deferred;
+
+void selftestLoadStart();
+
+//! Monta a mensagem i do trace em buf (topicos sem numero: cuba 0).
+void selftestMessage(const selftestMsg &m, char *buf){
+    const vessel &ves = vessels[0];
+    centi_t min = ves.temp_min;
+    centi_t max = ves.temp_max;
+    if (strcmp(m.topic,"temperature") == 0){
+        if (m.offset == 9999){
+            strcpy(buf,"lixo"); //leitura invalida
+            return;
+        }
+        formatCenti(buf,(min + max)/2 + m.offset);
+    }
+    else if (strcmp(m.topic,"minMax") == 0){
+        char  flag = ves.program;
+        char *p    = buf;
+        p += formatCenti(p,min);
+        *p++ = '|';
+        p += formatCenti(p,max);
+        *p++ = '|';
+        *p++ = flag;
+        *p   = 0;
+    }
+    else if (strcmp(m.topic,"program") == 0){
+        buf[0] = ves.program;
+        buf[1] = 0;
+    }
+    else{
+        //beer/relay: desliga o rele 2, estado de repouso
+        strcpy(buf,"3");
+    }
+}
+
+//! Fim da bateria: calcula os percentis e compara com os limites.
+void selftestReport(){
+    uint32_t n = SELFTEST_LEN*SELFTEST_PASSES;
+    //insercao: n e pequeno e so roda em bancada
+    for (uint32_t i=1;i<n;i++){
+        uint32_t v = selftest_lat[i];
+        uint32_t j = i;
+        while (j > 0 && selftest_lat[j-1] > v){
+            selftest_lat[j] = selftest_lat[j-1];
+            j--;
+        }
+        selftest_lat[j] = v;
+    }
+    uint32_t p50    = selftest_lat[n*50/100];
+    uint32_t p90    = selftest_lat[n*90/100];
+    uint32_t p99    = selftest_lat[n*99/100];
+    uint32_t max    = selftest_lat[n-1];
+    uint32_t drop   = selftest_heap_start - selftest_heap_min;
+    uint32_t writes = flash_writes - selftest_writes_start;
+    bool     ok     = p99 <= SELFTEST_MAX_P99_US && drop <= SELFTEST_MAX_HEAP_DROP &&
+                      writes <= SELFTEST_MAX_WRITES;
+
+    char buf[128];
+    m_snprintf(buf,sizeof(buf),"%s p50=%u p90=%u p99=%u max=%u us heap_min=%u (-%u) flash=%u",
+               ok ? "OK" : "FALHOU",p50,p90,p99,max,selftest_heap_min,drop,writes);
+    CON_ERR("SELFTEST %s",buf);
+    if (mqttOnline()){
+        mqtt.publish("freezer/selftest",buf);
+    }
+    selftestLoadStart();
+}
+
+//! Fim da carga: contadores da fila de entrada desde selftestLoadStart().
+void selftestLoadReport(){
+    uint32_t processed = in_processed - selftest_load_start[0];
+    uint32_t coalesced = in_coalesced - selftest_load_start[1];
+    uint32_t dropped   = in_dropped   - selftest_load_start[2];
+    const task &c      = tasks[TASK_CONTROL];
+    bool     ok        = dropped == 0 && selftest_load_cb_max <= SELFTEST_MAX_CB_US &&
+                         c.late_max_ms <= SELFTEST_MAX_JITTER_MS;
+
+    char buf[192];
+    m_snprintf(buf,sizeof(buf),"LOAD %s sent=%u processed=%u coalesced=%u dropped=%u cb_max=%u us "
+               "control runs=%u jitter_max=%u ms over=%u deferred=%u",
+               ok ? "OK" : "FALHOU",selftest_load_sent,processed,coalesced,dropped,
+               selftest_load_cb_max,c.runs - selftest_load_runs,c.late_max_ms,c.overruns,
+               sched_deferred - selftest_load_deferred);
+    CON_ERR("SELFTEST %s",buf);
+    if (mqttOnline()){
+        mqtt.publish("freezer/selftest",buf);
+    }
+}
+
+//! Uma mensagem da carga por chamada.
+void selftestLoadTick(){
+    char topic[24];
+    char msg[24];
+    const selftestMsg &m = selftest_trace[selftest_load_sent % SELFTEST_LEN];
+    m_snprintf(topic,sizeof(topic),"beer/%s",m.topic);
+    selftestMessage(m,msg);
+    String t(topic);
+    String v(msg);
+
+    uint32_t start = system_get_time();
+    onMessageReceived(t,v);
+    uint32_t us = system_get_time() - start;
+    if (us > selftest_load_cb_max){
+        selftest_load_cb_max = us;
+    }
+    if (++selftest_load_sent >= SELFTEST_LOAD_MSGS){
+        taskStart(TASK_SELFTEST,selftestLoadReport,SELFTEST_SETTLE_MS,0);
+    }
+}
+
+//! Inicia a carga de SELFTEST_LOAD_MSGS mensagens a 100 msg/s.
+void selftestLoadStart(){
+    selftest_load_sent     = 0;
+    selftest_load_cb_max   = 0;
+    selftest_load_start[0] = in_processed;
+    selftest_load_start[1] = in_coalesced;
+    selftest_load_start[2] = in_dropped;
+    selftest_load_runs     = tasks[TASK_CONTROL].runs;
+    selftest_load_deferred = sched_deferred;
+    tasks[TASK_CONTROL].late_max_ms = 0;
+    tasks[TASK_CONTROL].overruns    = 0;
+    taskStart(TASK_SELFTEST,selftestLoadTick,SELFTEST_LOAD_MS,SELFTEST_LOAD_MS);
+}
+
+//! Repete o trace medindo cada mensagem.
+void selftestRun(){
+    char topic[24];
+    char msg[24];
+    selftest_heap_start   = system_get_free_heap_size();
+    selftest_heap_min     = selftest_heap_start;
+    selftest_writes_start = flash_writes;
+
+    uint32_t k = 0;
+    for (int pass=0;pass<SELFTEST_PASSES;pass++){
+        for (size_t i=0;i<SELFTEST_LEN;i++){
+            const selftestMsg &m = selftest_trace[i];
+            m_snprintf(topic,sizeof(topic),"beer/%s",m.topic);
+            selftestMessage(m,msg);
+            String t(topic);
+            String v(msg);
+
+            //o handler roda fora do callback: mede ate a fila esvaziar
+            uint32_t start = system_get_time();
+            onMessageReceived(t,v);
+            uint32_t left;
+            do{
+                left = in_count;
+                inDrain();
+            } while (in_count > 0 && in_count < left);
+            selftest_lat[k++] = system_get_time() - start;
+
+            uint32_t heap = system_get_free_heap_size();
+            if (heap < selftest_heap_min){
+                selftest_heap_min = heap;
+            }
+        }
     }
+    taskStart(TASK_SELFTEST,selftestReport,SELFTEST_SETTLE_MS,0);
 }
 
+//! Agenda a bateria fora do callback que a pediu.
+void selftestStart(){
+    taskStart(TASK_SELFTEST,selftestRun,100,0);
+}
+#endif
+//-----------------FIM SELFTEST-------------------//
+
 //! Inicializador de execução
 void init(){
-    spiffs_mount();
-    sleep(20);
+    //partida quente: reles e controlador antes de qualquer outra coisa
+    relayInit();
+    schedBegin();
     adjustment(HIGH,HIGH,LOW);
+    bool warm = rtcRestore();
+
+    spiffs_mount();
+    logEvent(EV_BOOT);
+    histBegin();
+    if (warm){
+        settingsLoadLimits();
+    }
+    else{
+        settingsLoad();
+    }
+    taskStart(TASK_LOG,logFlush,LOG_CHECK_MS,LOG_CHECK_MS);
+    taskStart(TASK_PROFILE,profileTickAll,PROFILE_TICK_MS,PROFILE_TICK_MS);
+    taskStart(TASK_CONTROL,ctrlTick,CTRL_TICK_MS,CTRL_TICK_MS);
+    anaBegin();
+    outboxBegin();
+#ifdef STATS
+    statsBegin();
+#endif
+    sensorBegin();
+    telemetryBegin();
     
     Serial.begin(115200);
-    sleep(200);
-    Serial.println("Iniciada a serial...");
+    CON_INFO("Iniciada a serial...");
+    ls(); //uma vez por boot; nao a cada reconexao ou janela de rede
     sta_if();
        
-    String ip_adr = WifiStation.getIP().toString();
-    Serial.print("Endereco IP: ");
-    Serial.println(ip_adr);
-    
-    mqtt.connect("ElectroDragon",MQTT_USER,MQTT_PASSWD);
-    Serial.println("Iniciada a conexao com o broker MQTT...");
-    mqtt.subscribe("beer/#");
-    Serial.println("Subscricao para o topico beer/#");
+    CON_INFO("Endereco IP: %s",WifiStation.getIP().toString().c_str());
     
-    checkConn.initializeMs(3000, keepLooking).start();   
-    ESPlives.initializeMs(10000, publishIamLive).start();
-    //loadLimits.initializeMs(10000, strToProg).startOnce();
+    powerSet(POWER_DEFAULT,POWER_PERIOD_S,POWER_WINDOW_S);
+#ifdef SELFTEST
+    taskStart(TASK_SELFTEST,selftestRun,10000,0);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,133 @@
+/*! \file host.h
+ *  \brief Harness dos testes de host
+ *
+ *  Cada teste inclui este arquivo, que compila application.cpp contra a
+ *  emulacao de stub/, e declara os casos com TEST(nome). CHECK e CHECK_EQ
+ *  contam as falhas; main() roda todos os casos e retorna 1 se algum falhou.
+ */
+#pragma once
+#include "../../application.cpp"
+
+//-------------------- ALOCACOES ------------------//
+/*! malloc e interceptado (new da libstdc++ tambem passa por ele) para contar
+ * alocacoes; os testes zeram host_allocs e conferem que um trecho nao tocou
+ * no heap. */
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void*, size_t);
+static unsigned long host_allocs = 0;
+
+extern "C" void *malloc(size_t n){
+    host_allocs++;
+    return __libc_malloc(n);
+}
+extern "C" void *calloc(size_t n, size_t s){
+    host_allocs++;
+    return __libc_calloc(n,s);
+}
+extern "C" void *realloc(void *p, size_t n){
+    host_allocs++;
+    return __libc_realloc(p,n);
+}
+//-----------------FIM ALOCACOES-------------------//
+
+//-------------------- CASOS ------------------//
+static int host_checks   = 0;
+static int host_failures = 0;
+
+#define CHECK(cond) do{ \
+    host_checks++; \
+    if (!(cond)){ \
+        host_failures++; \
+        printf("%s:%d: falhou: %s\n",__FILE__,__LINE__,#cond); \
+    } \
+} while (0)
+
+#define CHECK_EQ(a,b) do{ \
+    long long va_ = (long long)(a), vb_ = (long long)(b); \
+    host_checks++; \
+    if (va_ != vb_){ \
+        host_failures++; \
+        printf("%s:%d: falhou: %s == %s (%lld != %lld)\n",__FILE__,__LINE__,#a,#b,va_,vb_); \
+    } \
+} while (0)
+
+struct hostCase{
+    const char *name;
+    void (*fn)();
+};
+static hostCase host_cases[64];
+static int      host_case_count = 0;
+
+struct hostRegister{
+    hostRegister(const char *name, void (*fn)()){
+        host_cases[host_case_count].name = name;
+        host_cases[host_case_count].fn   = fn;
+        host_case_count++;
+    }
+};
+
+#define TEST(name) \
+    static void name(); \
+    static hostRegister name##_reg(#name,name); \
+    static void name()
+
+//! Volta o host ao estado de uma placa recem ligada (flash vazia).
+static inline void hostReset(){
+    host_fs.clear();
+    host_handles.clear();
+    host_published.clear();
+    host_publish_ok   = true;
+    mqtt.close();
+    host_tcp_state    = eTCS_Connected;
+    host_write_budget = -1;
+    host_broker_up       = true;
+    host_connect_fail_ms = 0;
+    host_connects        = 0;
+    host_ms   = 0;
+    host_us   = 0;
+    host_unix = 0;
+    host_wifi_on       = true;
+    host_wifi_connects = 0;
+    host_uart_fifo     = 0;
+    memset(host_rtc,0,sizeof(host_rtc));
+    memset(tasks,0,sizeof(tasks));
+    presize_count = 0;
+    presize_done  = 0;
+    mqtt_state = MQTT_ONLINE;
+}
+
+//! Avanca o relogio ms milissegundos rodando o escalonador a cada tick.
+static inline void hostRun(uint32_t ms){
+    for (uint32_t t=0;t<ms;t+=SCHED_TICK_MS){
+        host_ms += SCHED_TICK_MS;
+        mqtt.hostPoll();
+        schedTick();
+    }
+}
+
+//! Derruba o broker: a sessao aberta cai e os connects seguintes falham.
+static inline void hostBrokerDown(){
+    host_broker_up = false;
+    if (host_tcp_state == eTCS_Connected){
+        mqtt.hostComplete(false);
+    }
+}
+
+//! Grava um arquivo inteiro na flash emulada.
+static inline void hostFileSet(const char *name, const void *data, size_t len){
+    host_fs[name].assign((const uint8_t*)data,(const uint8_t*)data + len);
+}
+
+int main(){
+    setvbuf(stdout,NULL,_IONBF,0);
+    for (int i=0;i<host_case_count;i++){
+        int before = host_failures;
+        hostReset();
+        host_cases[i].fn();
+        printf("%-32s %s\n",host_cases[i].name,host_failures == before ? "ok" : "FALHOU");
+    }
+    printf("%d verificacoes, %d falhas\n",host_checks,host_failures);
+    return host_failures ? 1 : 0;
+}
+//-----------------FIM CASOS-------------------//
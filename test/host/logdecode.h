@@ -0,0 +1,68 @@
+/*! \file logdecode.h
+ *  \brief Decodificador do log binario (LOG_FILE, LOG_OLD_FILE e
+ *  freezer/events)
+ *
+ *  Le o formato descrito em LOG BINARIO, byte a byte e em little-endian,
+ *  sem usar a struct do firmware: serve tanto ao logdump quanto aos testes,
+ *  que conferem que o firmware grava o que o formato promete.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#define LOGDEC_RECORD 8
+
+//! Registro decodificado.
+struct logDecoded{
+    uint32_t timestamp; /*!< segundos desde o boot */
+    int16_t  temp;      /*!< centesimos; INT16_MIN sem leitura */
+    char     program;   /*!< 'F', 'M', 'P' ou '-' */
+    uint8_t  vessel;
+    bool     relay1;
+    bool     relay2;
+    uint8_t  event;     /*!< codigo do evento (logEventCode) */
+};
+
+static const char *const logdec_events[] = {
+    "temperature", "boot", "relay", "program", "limits", "bad_program",
+    "bad_ini", "net_fail", "bad_limits", "control", "profile", "stale", "alert"
+};
+
+//! Decodifica os LOGDEC_RECORD bytes em p.
+static inline logDecoded logDecode(const uint8_t *p){
+    logDecoded d;
+    d.timestamp = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    d.temp      = (int16_t)(p[4] | p[5] << 8);
+    d.program   = "-FMP"[p[6] & 0x03];
+    d.vessel    = (p[6] >> 2) & 0x07;
+    d.relay1    = (p[7] & 0x01) != 0;
+    d.relay2    = (p[7] & 0x02) != 0;
+    d.event     = p[7] >> 2;
+    return d;
+}
+
+//! Nome do evento, ou NULL para um codigo desconhecido.
+static inline const char *logEventName(uint8_t event){
+    return event < sizeof(logdec_events)/sizeof(logdec_events[0]) ? logdec_events[event] : NULL;
+}
+
+//! Uma linha de texto: "ts cuba programa temp reles evento".
+static inline int logFormat(const logDecoded &d, char *buf, size_t len){
+    char temp[12];
+    if (d.temp == INT16_MIN){
+        snprintf(temp,sizeof(temp),"-");
+    }
+    else{
+        snprintf(temp,sizeof(temp),"%s%d.%02d",d.temp < 0 ? "-" : "",
+                 (d.temp < 0 ? -d.temp : d.temp) / 100,(d.temp < 0 ? -d.temp : d.temp) % 100);
+    }
+    const char *name = logEventName(d.event);
+    char        code[8];
+    if (name == NULL){
+        snprintf(code,sizeof(code),"ev%u",d.event);
+        name = code;
+    }
+    return snprintf(buf,len,"%u %u %c %s %d%d %s",d.timestamp,d.vessel,d.program,temp,
+                    d.relay1,d.relay2,name);
+}
@@ -0,0 +1,34 @@
+/*! \file logdump.cpp
+ *  \brief Imprime em texto um log binario copiado da placa
+ *
+ *  logdump yevesta.0.bin yevesta.bin > log.txt
+ *  Os arquivos sao lidos na ordem dada; um resto menor que um registro e
+ *  avisado e ignorado.
+ */
+#include "logdecode.h"
+
+int main(int argc, char **argv){
+    if (argc < 2){
+        fprintf(stderr,"uso: %s ARQUIVO...\n",argv[0]);
+        return 2;
+    }
+    for (int i=1;i<argc;i++){
+        FILE *f = fopen(argv[i],"rb");
+        if (f == NULL){
+            perror(argv[i]);
+            return 1;
+        }
+        uint8_t rec[LOGDEC_RECORD];
+        size_t  got;
+        while ((got = fread(rec,1,sizeof(rec),f)) == sizeof(rec)){
+            char line[96];
+            logFormat(logDecode(rec),line,sizeof(line));
+            puts(line);
+        }
+        if (got > 0){
+            fprintf(stderr,"%s: %u bytes no fim ignorados\n",argv[i],(unsigned)got);
+        }
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+/*! \file ds18s20.h
+ *  \brief Sensor emulado: a temperatura lida e definida pelo teste
+ */
+#pragma once
+//! Temperatura devolvida pelo sensor emulado.
+static float host_celsius = 20.0f;
+//! Sensor presente e leitura valida.
+static bool host_sensor_ok = true;
+//! Conversao em andamento (MeasureStatus) e conversoes iniciadas.
+static bool     host_sensor_busy   = false;
+static uint32_t host_sensor_starts = 0;
+class DS18S20 {
+public:
+    void Init(uint8_t){}
+    void StartMeasure(){ host_sensor_starts++; }
+    float GetCelsius(uint8_t){ return host_celsius; }
+    bool IsValidTemperature(uint8_t){ return host_sensor_ok; }
+    bool MeasureStatus(){ return host_sensor_busy; }
+    uint8_t GetSensorsCount(){ return host_sensor_ok ? 1 : 0; }
+};
@@ -0,0 +1,371 @@
+/*! \file SmingCore.h
+ *  \brief Emulacao minima da API do Sming para rodar application.cpp no host
+ *
+ *  So o que o firmware usa esta implementado: sistema de arquivos em memoria
+ *  (com orcamento de escrita para simular queda de energia), relogio
+ *  controlado pelo teste, MQTT que grava as publicacoes e memoria RTC.
+ */
+#pragma once
+#include <user_config.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+
+//-------------------- ESTADO DO HOST ------------------//
+struct hostPublish{
+    std::string topic;
+    std::string payload;
+    int qos;
+};
+
+//! Relogio do host em ms, avancado pelos testes.
+static uint32_t host_ms = 0;
+//! Microsegundos extras somados ao relogio (medicoes de latencia).
+static uint32_t host_us = 0;
+//! Tempo unix devolvido por SystemClock.
+static uint32_t host_unix = 0;
+//! Publicacoes MQTT capturadas.
+static std::vector<hostPublish> host_published;
+//! Resultado devolvido por publish/publishWithQoS.
+static bool host_publish_ok = true;
+//! Estado da conexao devolvido pelo cliente MQTT.
+static int host_tcp_state = 2;
+//! Broker no ar. Fora do ar o connect falha depois de host_connect_fail_ms
+//! (-1: o broker nunca responde e so o prazo do firmware encerra a tentativa).
+static bool     host_broker_up       = true;
+static long     host_connect_fail_ms = 0;
+//! Chamadas a connect.
+static uint32_t host_connects = 0;
+//! Memoria RTC (192 blocos de 4 bytes).
+static uint8_t host_rtc[768];
+//! Estado dos pinos.
+static uint8_t host_pins[32];
+//! Saida da serial.
+static std::string host_serial;
+//! Bytes ainda na FIFO de transmissao da UART0.
+static uint32_t host_uart_fifo = 0;
+//! Interface sta ligada e conexoes completadas por waitConnection().
+static bool     host_wifi_on       = true;
+static uint32_t host_wifi_connects = 0;
+
+//! Sistema de arquivos em memoria.
+static std::map<std::string,std::vector<uint8_t> > host_fs;
+//! Bytes que ainda podem ser gravados antes da "queda de energia" (-1 = sem limite).
+static long host_write_budget = -1;
+//! Quantidade de escritas em arquivo.
+static uint32_t host_writes = 0;
+//-----------------FIM ESTADO DO HOST-------------------//
+
+//-------------------- STRING ------------------//
+class String {
+public:
+    String(const char* s = ""){ set(s,strlen(s)); }
+    String(const char* s, unsigned int len){ set(s,len); }
+    String(const String &o){ set(o.buf,o.len); }
+    ~String(){ free(buf); }
+    String& operator=(const String &o){ if (this != &o){ free(buf); set(o.buf,o.len); } return *this; }
+    String& operator=(const char *s){ free(buf); set(s,strlen(s)); return *this; }
+    const char* c_str() const { return buf; }
+    unsigned int length() const { return len; }
+    bool operator==(const char *s) const { return strcmp(buf,s) == 0; }
+    bool operator!=(const char *s) const { return strcmp(buf,s) != 0; }
+private:
+    void set(const char *s, unsigned int n){
+        buf = (char*)malloc(n + 1);
+        memcpy(buf,s,n);
+        buf[n] = 0;
+        len = n;
+    }
+    char *buf;
+    unsigned int len;
+};
+//-----------------FIM STRING-------------------//
+
+//-------------------- DELEGATE/TIMER ------------------//
+template <typename T> class Delegate;
+template <typename R, typename... A> class Delegate<R(A...)> {
+public:
+    Delegate() {}
+    Delegate(R (*f)(A...)) : fn(f) {}
+    template <class C> Delegate(R (C::*m)(A...), C *o) : fn([m,o](A... a){ return (o->*m)(a...); }) {}
+    R operator()(A... a) const { return fn ? fn(a...) : R(); }
+private:
+    std::function<R(A...)> fn;
+};
+typedef void (*InterruptCallback)();
+typedef Delegate<void()> TimerDelegate;
+//! Timer do host: nao dispara sozinho, o teste chama fire().
+class Timer {
+public:
+    Timer() : started(false), interval(0) {}
+    Timer& initializeMs(uint32_t ms, InterruptCallback f){ interval = ms; cb = TimerDelegate(f); return *this; }
+    Timer& initializeMs(uint32_t ms, TimerDelegate f){ interval = ms; cb = f; return *this; }
+    void start(bool = true){ started = true; }
+    void startOnce(){ started = true; }
+    void stop(){ started = false; }
+    bool isStarted(){ return started; }
+    uint32_t getIntervalMs(){ return interval; }
+    void fire(){ if (started) cb(); }
+private:
+    bool started;
+    uint32_t interval;
+    TimerDelegate cb;
+};
+//-----------------FIM DELEGATE/TIMER-------------------//
+
+//-------------------- MQTT ------------------//
+enum TcpClientState { eTCS_Ready, eTCS_Connecting, eTCS_Connected, eTCS_Successful, eTCS_Failed };
+class TcpClient;
+typedef Delegate<void(TcpClient&, bool)> TcpClientCompleteDelegate;
+class TcpClient {
+public:
+    TcpClientState getConnectionState(){ return (TcpClientState)host_tcp_state; }
+    void setCompleteDelegate(TcpClientCompleteDelegate d){ complete = d; }
+    void close(){ host_tcp_state = eTCS_Ready; pending = false; }
+    //! Encerra a conexao como o Sming: muda o estado e chama o delegate de conclusao.
+    void hostComplete(bool ok){
+        pending = false;
+        host_tcp_state = ok ? eTCS_Successful : eTCS_Failed;
+        complete(*this,ok);
+    }
+    //! Chamado a cada tick: falha o connect pendente quando vence o prazo.
+    void hostPoll(){
+        if (pending && host_connect_fail_ms >= 0 && host_ms - pending_ms >= (uint32_t)host_connect_fail_ms){
+            hostComplete(false);
+        }
+    }
+protected:
+    TcpClientCompleteDelegate complete;
+    bool     pending    = false; //connect sem resposta do broker
+    uint32_t pending_ms = 0;
+};
+typedef Delegate<void(String, String)> MqttStringSubscriptionCallback;
+typedef Delegate<void(uint16_t, int)> MqttMessageDeliveredCallback;
+class MqttClient : public TcpClient {
+public:
+    MqttClient(String, int, MqttStringSubscriptionCallback = MqttStringSubscriptionCallback()){}
+    bool connect(String, String = "", String = ""){
+        host_connects++;
+        if (host_broker_up){
+            host_tcp_state = eTCS_Connected;
+        }
+        else{
+            host_tcp_state = eTCS_Connecting;
+            pending    = true;
+            pending_ms = host_ms;
+        }
+        return true;
+    }
+    bool publish(String t, String p, bool = false){ return publishWithQoS(t,p,0); }
+    bool publishWithQoS(String t, String p, int qos, bool = false, MqttMessageDeliveredCallback = MqttMessageDeliveredCallback()){
+        if (!host_publish_ok) return false;
+        hostPublish m;
+        m.topic.assign(t.c_str(),t.length());
+        m.payload.assign(p.c_str(),p.length());
+        m.qos = qos;
+        host_published.push_back(m);
+        return true;
+    }
+    bool subscribe(String){ return true; }
+    bool unsubscribe(String){ return true; }
+    void setKeepAlive(int){}
+};
+//-----------------FIM MQTT-------------------//
+
+//-------------------- ARQUIVOS ------------------//
+typedef int file_t;
+enum FileOpenFlags { eFO_ReadOnly=1, eFO_WriteOnly=2, eFO_ReadWrite=3, eFO_CreateIfNotExist=4, eFO_Append=8, eFO_Truncate=16, eFO_CreateNewAlways=20 };
+inline FileOpenFlags operator|(FileOpenFlags a, FileOpenFlags b){ return (FileOpenFlags)((int)a|(int)b); }
+enum SeekOriginFlags { eSO_FileStart, eSO_CurrentPos, eSO_FileEnd };
+
+struct hostHandle{
+    std::string name;
+    size_t pos;
+    bool open;
+};
+static std::vector<hostHandle> host_handles;
+
+inline file_t fileOpen(const String &name, FileOpenFlags flags){
+    std::string n(name.c_str());
+    bool exists = host_fs.count(n) != 0;
+    if (!exists && !(flags & eFO_CreateIfNotExist)) return -1;
+    if (!exists || (flags & eFO_Truncate)) host_fs[n].clear();
+    hostHandle h;
+    h.name = n;
+    h.pos  = (flags & eFO_Append) ? host_fs[n].size() : 0;
+    h.open = true;
+    host_handles.push_back(h);
+    return (file_t)host_handles.size();
+}
+inline hostHandle* hostFile(file_t f){
+    if (f <= 0 || f > (file_t)host_handles.size() || !host_handles[f-1].open) return 0;
+    return &host_handles[f-1];
+}
+inline void fileClose(file_t f){
+    hostHandle *h = hostFile(f);
+    if (h) h->open = false;
+}
+inline size_t fileWrite(file_t f, const void *data, size_t len){
+    hostHandle *h = hostFile(f);
+    if (!h || !host_fs.count(h->name)) return 0;
+    if (host_write_budget >= 0 && (long)len > host_write_budget) len = host_write_budget;
+    if (host_write_budget >= 0) host_write_budget -= len;
+    std::vector<uint8_t> &d = host_fs[h->name];
+    if (d.size() < h->pos + len) d.resize(h->pos + len);
+    if (len) memcpy(&d[h->pos],data,len);
+    h->pos += len;
+    host_writes++;
+    return len;
+}
+inline size_t fileRead(file_t f, void *data, size_t len){
+    hostHandle *h = hostFile(f);
+    if (!h || !host_fs.count(h->name)) return 0;
+    std::vector<uint8_t> &d = host_fs[h->name];
+    if (h->pos >= d.size()) return 0;
+    if (len > d.size() - h->pos) len = d.size() - h->pos;
+    memcpy(data,&d[h->pos],len);
+    h->pos += len;
+    return len;
+}
+inline int fileSeek(file_t f, int off, SeekOriginFlags origin){
+    hostHandle *h = hostFile(f);
+    if (!h) return -1;
+    long base = origin == eSO_FileStart ? 0 : origin == eSO_CurrentPos ? (long)h->pos : (long)host_fs[h->name].size();
+    long pos  = base + off;
+    if (pos < 0 || pos > (long)host_fs[h->name].size()) return -1;
+    h->pos = pos;
+    return pos;
+}
+inline int fileTell(file_t f){
+    hostHandle *h = hostFile(f);
+    return h ? (int)h->pos : -1;
+}
+inline int fileFlush(file_t){ return 0; }
+inline bool fileIsEOF(file_t f){
+    hostHandle *h = hostFile(f);
+    return !h || h->pos >= host_fs[h->name].size();
+}
+inline int fileGetSize(const String &name){
+    std::map<std::string,std::vector<uint8_t> >::iterator i = host_fs.find(name.c_str());
+    return i == host_fs.end() ? 0 : (int)i->second.size();
+}
+inline void fileDelete(const String &name){ host_fs.erase(name.c_str()); }
+inline bool fileExist(const String &name){ return host_fs.count(name.c_str()) != 0; }
+inline int fileRename(const String &from, const String &to){
+    if (!host_fs.count(from.c_str()) || host_fs.count(to.c_str())) return -1;
+    host_fs[to.c_str()].swap(host_fs[from.c_str()]);
+    host_fs.erase(from.c_str());
+    return 0;
+}
+inline void spiffs_mount(){}
+
+struct spiffs { int dummy; };
+struct spiffs_DIR { size_t next; };
+struct spiffs_dirent { uint16_t obj_id; uint8_t name[32]; uint8_t type; uint32_t size; uint16_t pix; };
+static spiffs _filesystemStorageHandle;
+inline spiffs_DIR* SPIFFS_opendir(spiffs*, const char*, spiffs_DIR *d){ d->next = 0; return d; }
+inline struct spiffs_dirent* SPIFFS_readdir(spiffs_DIR *d, struct spiffs_dirent *e){
+    std::map<std::string,std::vector<uint8_t> >::iterator i = host_fs.begin();
+    for (size_t n=0;n<d->next && i != host_fs.end();n++) ++i;
+    if (i == host_fs.end()) return 0;
+    d->next++;
+    memset(e,0,sizeof(*e));
+    strncpy((char*)e->name,i->first.c_str(),sizeof(e->name) - 1);
+    e->size = i->second.size();
+    return e;
+}
+inline int SPIFFS_closedir(spiffs_DIR*){ return 0; }
+//-----------------FIM ARQUIVOS-------------------//
+
+//-------------------- SERIAL/PINOS ------------------//
+class HardwareSerial {
+public:
+    void begin(int){}
+    size_t print(const char *s){ host_serial += s; return strlen(s); }
+    size_t println(const char *s = ""){ host_serial += s; host_serial += "\r\n"; return strlen(s) + 2; }
+    size_t write(const uint8_t *d, size_t n){ host_serial.append((const char*)d,n); return n; }
+    size_t write(uint8_t c){ host_serial += (char)c; return 1; }
+    void systemDebugOutput(bool){}
+};
+static HardwareSerial Serial;
+#define OUTPUT 1
+#define INPUT 0
+#define HIGH 1
+#define LOW 0
+inline void pinMode(uint16_t, uint8_t){}
+inline void digitalWrite(uint16_t p, uint8_t v){ host_pins[p & 31] = v; }
+inline uint8_t digitalRead(uint16_t p){ return host_pins[p & 31]; }
+//-----------------FIM SERIAL/PINOS-------------------//
+
+//-------------------- SISTEMA ------------------//
+inline unsigned long millis(){ return host_ms; }
+inline unsigned long micros(){ return host_ms*1000UL + host_us; }
+inline void delayMilliseconds(unsigned int ms){ host_ms += ms; }
+inline void delay(unsigned int ms){ host_ms += ms; }
+
+class IPAddress { public: String toString(){ return "127.0.0.1"; } };
+class StationClass {
+public:
+    bool isEnabled(){ return host_wifi_on; }
+    void enable(bool on){ host_wifi_on = on; }
+    bool isConnected(){ return true; }
+    bool config(String, String, bool){ return true; }
+    IPAddress getIP(){ return IPAddress(); }
+    void waitConnection(InterruptCallback ok, int, InterruptCallback){ host_wifi_connects++; ok(); }
+};
+class AccessPointClass { public: bool isEnabled(){ return false; } void enable(bool){} };
+static StationClass WifiStation;
+static AccessPointClass WifiAccessPoint;
+
+inline uint32_t system_get_time(){ return host_ms*1000UL + host_us; }
+inline uint32_t system_get_free_heap_size(){ return 40000; }
+inline uint32_t os_random(){ return rand(); }
+inline bool system_rtc_mem_read(uint8_t block, void *dst, uint16_t len){
+    if (block < 64 || block*4 + len > (int)sizeof(host_rtc)) return false;
+    memcpy(dst,host_rtc + block*4,len);
+    return true;
+}
+inline bool system_rtc_mem_write(uint8_t block, const void *src, uint16_t len){
+    if (block < 64 || block*4 + len > (int)sizeof(host_rtc)) return false;
+    memcpy(host_rtc + block*4,src,len);
+    return true;
+}
+struct rst_info { uint32_t reason; uint32_t exccause, epc1, epc2, epc3, excvaddr, depc; };
+enum rst_reason { REASON_DEFAULT_RST = 0, REASON_WDT_RST, REASON_EXCEPTION_RST, REASON_SOFT_WDT_RST, REASON_SOFT_RESTART, REASON_DEEP_SLEEP_AWAKE, REASON_EXT_SYS_RST };
+static rst_info host_rst;
+inline rst_info* system_get_rst_info(){ return &host_rst; }
+enum sleep_type { NONE_SLEEP_T = 0, LIGHT_SLEEP_T, MODEM_SLEEP_T };
+static sleep_type host_sleep = NONE_SLEEP_T;
+inline bool wifi_set_sleep_type(sleep_type t){ host_sleep = t; return true; }
+inline sleep_type wifi_get_sleep_type(){ return host_sleep; }
+inline void* os_malloc(size_t n){ return malloc(n); }
+inline void os_free(void *p){ free(p); }
+inline int m_vsnprintf(char *b, size_t n, const char *f, va_list a){ return vsnprintf(b,n,f,a); }
+inline int m_snprintf(char *b, size_t n, const char *f, ...){
+    va_list a;
+    va_start(a,f);
+    int r = vsnprintf(b,n,f,a);
+    va_end(a);
+    return r;
+}
+class DateTime { public: uint32_t unix; uint32_t toUnixTime(){ return unix; } };
+class SystemClockClass {
+public:
+    DateTime now(bool = false){ DateTime d; d.unix = host_unix; return d; }
+    bool setTime(uint32_t t, bool = false){ host_unix = t; return true; }
+};
+static SystemClockClass SystemClock;
+class NtpClient;
+typedef Delegate<void(NtpClient&, time_t)> NtpTimeResultDelegate;
+class NtpClient { public: NtpClient(String, int, NtpTimeResultDelegate = NtpTimeResultDelegate()){} void requestTime(){} };
+class System_ { public: void restart(){} };
+static System_ System __attribute__((unused));
+enum dtZone { eTZ_Local = 0, eTZ_UTC = 1 };
+inline uint8_t system_get_cpu_freq(){ return 80; }
+inline uint32_t READ_PERI_REG(uint32_t){ return host_uart_fifo << 16; }
+#define UART_STATUS(i) (0x60000000 + (i)*0xf00 + 0x1C)
+#define UART_TXFIFO_CNT 0x000000FF
+#define UART_TXFIFO_CNT_S 16
+//-----------------FIM SISTEMA-------------------//
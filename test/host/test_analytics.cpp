@@ -0,0 +1,153 @@
+/*! \file test_analytics.cpp
+ *  \brief Analise do compressor a partir de traces de ciclos gravados
+ */
+#include "host.h"
+
+//! Trecho do trace: compressor, duracao e taxa da leitura (centesimos/h).
+struct traceSeg{
+    bool     on;
+    uint32_t secs;
+    int32_t  rate;
+};
+
+//! Ciclo normal gravado em bancada: 10 min resfriando 1.2 C/h, 30 min subindo 0.4 C/h.
+#define HEALTHY_ON  {true,  600, -120}
+#define HEALTHY_OFF {false,1800,   40}
+
+static uint32_t trace_ms;
+static int64_t  trace_temp; //milesimos de centesimo
+
+static void traceReset(){
+    memset(&ana[0],0,sizeof(ana[0]));
+    trace_ms   = 0;
+    trace_temp = 400*1000; //4.00 C
+}
+
+//! Toca o trace em amostras de ANA_TICK_MS, como anaTick() faria.
+static void play(const traceSeg *seg, size_t n){
+    for (size_t i=0;i<n;i++){
+        relayOf(0,RELAY_ONE).level = seg[i].on ? HIGH : LOW;
+        for (uint32_t t=0;t<seg[i].secs*1000;t+=ANA_TICK_MS){
+            trace_ms   += ANA_TICK_MS;
+            trace_temp += (int64_t)seg[i].rate * 1000 * ANA_TICK_MS / (int64_t)ANA_HOUR_MS;
+            anaSample(0,(centi_t)(trace_temp / 1000),trace_ms);
+        }
+    }
+    relayOf(0,RELAY_ONE).level = LOW;
+}
+
+//! Alertas publicados em freezer/alert.
+static std::vector<std::string> alerts(){
+    std::vector<std::string> out;
+    for (size_t i=0;i<host_published.size();i++){
+        if (host_published[i].topic == "freezer/alert"){
+            out.push_back(std::string(host_published[i].payload.begin(),host_published[i].payload.end()));
+        }
+    }
+    return out;
+}
+
+//! Liga e desliga count vezes no padrao normal.
+static void healthy(int count){
+    const traceSeg cycle[] = {HEALTHY_ON,HEALTHY_OFF};
+    for (int i=0;i<count;i++){
+        play(cycle,2);
+    }
+}
+
+TEST(healthy_trace_is_quiet){
+    traceReset();
+    const traceSeg first[] = {{false,60,0}};
+    play(first,1);
+    healthy(8);
+    CHECK(alerts().empty());
+    CHECK_EQ(ana[0].today.cycles,8);
+    CHECK_EQ(ana[0].base_n,8);
+    //taxa aprendida perto de 120 c/h; as amostras de 5 s comem um pouco da queda
+    CHECK(ana[0].base_rate >= 108 && ana[0].base_rate <= 132);
+    CHECK_EQ(ana[0].on_ms,8*600*1000);
+}
+
+TEST(weak_cycle_after_baseline){
+    traceReset();
+    const traceSeg first[] = {{false,60,0}};
+    play(first,1);
+    healthy(ANA_BASE_MIN);
+    //mesmo tempo ligado, um terco da queda
+    const traceSeg weak[] = {{true,600,-40},HEALTHY_OFF};
+    play(weak,2);
+    std::vector<std::string> a = alerts();
+    CHECK(a.size() == 1 && a[0].compare(0,15,"0 weak_cooling ") == 0);
+    CHECK_EQ(ana[0].today.alerts,1);
+}
+
+TEST(weak_needs_baseline){
+    traceReset();
+    const traceSeg first[] = {{false,60,0}};
+    play(first,1);
+    healthy(ANA_BASE_MIN - 1);
+    const traceSeg weak[] = {{true,600,-40},HEALTHY_OFF};
+    play(weak,2);
+    CHECK(alerts().empty());
+}
+
+TEST(stuck_compressor){
+    traceReset();
+    const traceSeg first[] = {{false,60,0}};
+    play(first,1);
+    //ligado sem resfriar: no_cooling uma vez, long_on depois de 4 h
+    const traceSeg stuck[] = {{true,ANA_MAX_ON_MS/1000 + 60,5}};
+    play(stuck,1);
+    std::vector<std::string> a = alerts();
+    CHECK_EQ(a.size(),2);
+    CHECK(a.size() == 2 && a[0] == "0 no_cooling 1200" && a[1].compare(0,10,"0 long_on ") == 0);
+}
+
+TEST(short_cycling_once_per_hour){
+    traceReset();
+    const traceSeg first[] = {{false,60,0}};
+    play(first,1);
+    const traceSeg quick[] = {{true,120,-120},{false,240,40}};
+    for (int i=0;i<ANA_MAX_CYCLES_H + 3;i++){
+        play(quick,2);
+    }
+    std::vector<std::string> a = alerts();
+    CHECK(a.size() == 1 && a[0] == "0 short_cycle 7");
+}
+
+TEST(cooling_while_off){
+    traceReset();
+    const traceSeg first[] = {{false,60,0}};
+    play(first,1);
+    healthy(2);
+    //rele colado: o comando desliga mas a leitura continua caindo
+    const traceSeg welded[] = {{false,ANA_OFF_SETTLE_MS/1000,0},{false,ANA_NOCOOL_MS/1000 + 60,-120}};
+    play(welded,2);
+    std::vector<std::string> a = alerts();
+    CHECK(a.size() == 1 && a[0].compare(0,14,"0 cooling_off ") == 0);
+}
+
+TEST(day_counters_survive_reboot){
+    anaPrepare();
+    while (taskActive(TASK_PRESIZE)){
+        hostRun(SCHED_TICK_MS);
+    }
+    traceReset();
+    uint32_t day = 1700000000 / 86400;
+    anaRestore(day);
+    const traceSeg first[] = {{false,60,0}};
+    play(first,1);
+    healthy(3);
+    ana[0].today.on_s = ana[0].on_ms / 1000;
+    anaSave();
+    //reset: o dia volta somado ao que estava gravado
+    traceReset();
+    anaRestore(day);
+    CHECK_EQ(ana[0].today.cycles,3);
+    CHECK_EQ(ana[0].today.on_s,3*600);
+    CHECK_EQ(ana[0].rate_n,1);
+    //outro dia usa outro slot
+    traceReset();
+    anaRestore(day + 1);
+    CHECK_EQ(ana[0].today.cycles,0);
+}
@@ -0,0 +1,219 @@
+/*! \file test_console.cpp
+ *  \brief Console: niveis fora da compilacao, anel sem espera e descarte
+ *  de linhas inteiras; latencia contra o Serial.println da versao original
+ */
+#define CONSOLE_LEVEL CON_LEVEL_WARN
+#include <chrono>
+#include "host.h"
+
+static int evaluated = 0;
+
+static int sideEffect(){
+    return ++evaluated;
+}
+
+//! Anel vazio e serial limpa.
+static void conReset(){
+    con_head    = 0;
+    con_count   = 0;
+    con_dropped = 0;
+    host_serial.clear();
+}
+
+TEST(disabled_levels_cost_nothing){
+    conReset();
+    CON_INFO("info %d",sideEffect());
+    CON_DEBUG("debug %d",sideEffect());
+    //nem os argumentos sao avaliados
+    CHECK_EQ(evaluated,0);
+    CHECK_EQ(con_count,0);
+    CHECK(!taskActive(TASK_CONSOLE));
+    CON_WARN("warn %d",sideEffect());
+    CHECK_EQ(evaluated,1);
+    CHECK_EQ(con_count,8);
+}
+
+TEST(caller_never_waits_for_uart){
+    conReset();
+    host_uart_fifo = CON_TX_FIFO; //FIFO cheia
+    CON_ERR("falha %u",42);
+    CHECK(host_serial.empty());
+    hostRun(5*CON_DRAIN_MS);
+    CHECK(host_serial.empty());
+    CHECK(taskActive(TASK_CONSOLE));
+    host_uart_fifo = 0;
+    hostRun(CON_DRAIN_MS);
+    CHECK(host_serial == "falha 42\r\n");
+    CHECK_EQ(con_count,0);
+}
+
+TEST(drain_fills_only_free_fifo){
+    conReset();
+    host_uart_fifo = CON_TX_FIFO - 20;
+    for (int i=0;i<10;i++){
+        CON_WARN("linha numero %02d",i);
+    }
+    hostRun(CON_DRAIN_MS);
+    CHECK_EQ(host_serial.size(),20);
+    hostRun(CON_DRAIN_MS);
+    CHECK_EQ(host_serial.size(),40);
+    host_uart_fifo = 0;
+    hostRun(3*CON_DRAIN_MS);
+    CHECK_EQ(host_serial.size(),10*17);
+}
+
+TEST(full_ring_drops_whole_lines){
+    conReset();
+    host_uart_fifo = CON_TX_FIFO;
+    char line[CON_LINE_LEN];
+    memset(line,'x',50);
+    line[50] = 0;
+    for (int i=0;i<30;i++){
+        CON_WARN("%s",line);
+    }
+    //52 bytes por linha: cabem 19 em 1024
+    CHECK_EQ(con_count,19*52);
+    CHECK_EQ(con_dropped,11);
+    host_uart_fifo = 0;
+    hostRun(20*CON_DRAIN_MS);
+    CHECK_EQ(host_serial.size(),19*52);
+    bool whole = true;
+    for (size_t at=0;at<host_serial.size();at+=52){
+        whole = whole && host_serial.compare(at,52,std::string(line) + "\r\n") == 0;
+    }
+    CHECK(whole);
+}
+
+TEST(long_line_is_truncated){
+    conReset();
+    char big[200];
+    memset(big,'y',sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    CON_ERR("%s",big);
+    CHECK_EQ(con_count,CON_LINE_LEN - 1);
+    hostRun(2*CON_DRAIN_MS);
+    CHECK(host_serial.size() == CON_LINE_LEN - 1 && host_serial.substr(host_serial.size() - 2) == "\r\n");
+}
+
+//! Bits por byte na UART (8N1) e taxa da serial do firmware.
+#define UART_BITS 10
+#define UART_BAUD 115200
+
+//! Saida de settingTemps() na versao original: Serial.println direto,
+//! valores em String. Devolve os bytes escritos.
+static size_t legacySettingTemps(const String &toSlice, float tmin, float tmax, char fmp){
+    size_t before = host_serial.size();
+    char num[16];
+    Serial.println(toSlice.c_str());
+    Serial.println("Minima e Maxima:");
+    snprintf(num,sizeof(num),"%.2f",tmin);
+    Serial.println(String(num).c_str());
+    snprintf(num,sizeof(num),"%.2f",tmax);
+    Serial.println(String(num).c_str());
+    Serial.println("----====----====----====----");
+    Serial.print("Nova minima: ");
+    snprintf(num,sizeof(num),"%.2f",tmin);
+    Serial.println(String(num).c_str());
+    Serial.print("Nova maxima: ");
+    snprintf(num,sizeof(num),"%.2f",tmax);
+    Serial.println(String(num).c_str());
+    Serial.print("Programa: ");
+    char p[2] = {fmp,0};
+    Serial.println(p);
+    Serial.println("Novos valores atribuidos ao programa Fermentation.");
+    Serial.println("N\xC3\xA3o esqueca de escolher o programa de atuacao agora.");
+    return host_serial.size() - before;
+}
+
+//! As mesmas linhas pelo anel, como CON_INFO as geraria com o nivel INFO.
+static void ringSettingTemps(const char *toSlice, float tmin, float tmax, char fmp){
+    conPrintf("%s",toSlice);
+    conPrintf("Minima e Maxima:");
+    conPrintf("%.2f",tmin);
+    conPrintf("%.2f",tmax);
+    conPrintf("----====----====----====----");
+    conPrintf("Nova minima: %.2f",tmin);
+    conPrintf("Nova maxima: %.2f",tmax);
+    conPrintf("Programa: %c",fmp);
+    conPrintf("Novos valores atribuidos ao programa Fermentation.");
+    conPrintf("N\xC3\xA3o esqueca de escolher o programa de atuacao agora.");
+}
+
+//! As mesmas linhas com o nivel de producao (WARN): CON_INFO nao gera codigo.
+static void levelSettingTemps(const char *toSlice, float tmin, float tmax, char fmp){
+    CON_INFO("%s",toSlice);
+    CON_INFO("Minima e Maxima:");
+    CON_INFO("%.2f",tmin);
+    CON_INFO("%.2f",tmax);
+    CON_INFO("----====----====----====----");
+    CON_INFO("Nova minima: %.2f",tmin);
+    CON_INFO("Nova maxima: %.2f",tmax);
+    CON_INFO("Programa: %c",fmp);
+    CON_INFO("Novos valores atribuidos ao programa Fermentation.");
+    CON_INFO("N\xC3\xA3o esqueca de escolher o programa de atuacao agora.");
+    (void)toSlice; (void)tmin; (void)tmax; (void)fmp;
+}
+
+TEST(latency_bench){
+    //uma mensagem beer/minMax: as dez linhas de settingTemps()
+    String      slice("13.0|17.5|F");
+    const char *volatile text = "13.0|17.5|F"; //impede que o laco seja calculado uma vez so
+    volatile float tmin = 13.0f;
+    volatile float tmax = 17.5f;
+    const int n = 20000;
+
+    //antes: Serial.println; na placa o chamador espera a FIFO esvaziar
+    conReset();
+    size_t bytes = legacySettingTemps(slice,tmin,tmax,'F');
+    host_serial.clear();
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        legacySettingTemps(slice,tmin,tmax,'F');
+        host_serial.clear();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double legacy = std::chrono::duration<double,std::nano>(t1 - t0).count() / n;
+    //mesmo com a FIFO vazia, o que passa de CON_TX_FIFO sai a 115200 baud
+    double wait_us = bytes > CON_TX_FIFO ? (bytes - CON_TX_FIFO) * UART_BITS * 1e6 / UART_BAUD : 0;
+
+    //depois, nivel INFO: formata no anel, com a FIFO cheia
+    host_uart_fifo = CON_TX_FIFO;
+    host_allocs    = 0;
+    auto t2 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        conReset();
+        ringSettingTemps(text,tmin,tmax,'F');
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    double ring = std::chrono::duration<double,std::nano>(t3 - t2).count() / n;
+    //o anel guardou os mesmos bytes e a UART nem foi tocada
+    CHECK_EQ(con_count,bytes);
+    CHECK_EQ(con_dropped,0);
+    CHECK(host_serial.empty());
+    CHECK_EQ(host_allocs,0);
+
+    //depois, nivel WARN (producao)
+    conReset();
+    taskStop(TASK_CONSOLE);
+    auto t4 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        levelSettingTemps(text,tmin,tmax,'F');
+    }
+    auto t5 = std::chrono::steady_clock::now();
+    double off = std::chrono::duration<double,std::nano>(t5 - t4).count() / n;
+    CHECK_EQ(con_count,0);
+    CHECK(!taskActive(TASK_CONSOLE));
+
+    //o anel esvazia depois, no ritmo da FIFO, sem ninguem esperando
+    conReset();
+    ringSettingTemps(text,tmin,tmax,'F');
+    host_uart_fifo = 0;
+    hostRun(((bytes + CON_TX_FIFO - 1) / CON_TX_FIFO) * CON_DRAIN_MS);
+    CHECK_EQ(host_serial.size(),bytes);
+    CHECK_EQ(con_count,0);
+
+    printf("  beer/minMax, %u bytes de console: Serial.println %.0f ns + %.0f us esperando a UART;"
+           " anel (INFO) %.0f ns sem espera; producao (WARN) %.1f ns\n",
+           (unsigned)bytes,legacy,wait_us,ring,off);
+    CHECK(wait_us > 0);
+}
@@ -0,0 +1,274 @@
+/*! \file test_core.cpp
+ *  \brief Parser, persistencia, telemetria, modelo do controlador e perfil
+ */
+#include "host.h"
+
+//-------------------- PARSER ------------------//
+static parseError centi(const char *s, centi_t *out){
+    return parseCenti(s,strlen(s),out);
+}
+
+TEST(parse_centi){
+    centi_t v = 0;
+    CHECK_EQ(centi("19.5",&v),PARSE_OK);
+    CHECK_EQ(v,1950);
+    CHECK_EQ(centi(" -3.25 ",&v),PARSE_OK);
+    CHECK_EQ(v,-325);
+    CHECK_EQ(centi("1.005",&v),PARSE_OK);
+    CHECK_EQ(v,101);
+    CHECK_EQ(centi("+7",&v),PARSE_OK);
+    CHECK_EQ(v,700);
+    CHECK_EQ(centi("-40",&v),PARSE_OK);
+    CHECK_EQ(v,CENTI_MIN);
+    CHECK_EQ(centi("-40.01",&v),PARSE_RANGE);
+    CHECK_EQ(centi("1001",&v),PARSE_RANGE);
+    CHECK_EQ(centi("abc",&v),PARSE_BAD_CHAR);
+    CHECK_EQ(centi("-",&v),PARSE_EMPTY);
+}
+
+TEST(parse_min_max){
+    centi_t min = 0, max = 0;
+    char    prog = 0;
+    const char *ok = "13.5|14.5|M";
+    CHECK_EQ(parseMinMax(ok,strlen(ok),&min,&max,&prog),PARSE_OK);
+    CHECK_EQ(min,1350);
+    CHECK_EQ(max,1450);
+    CHECK_EQ(prog,'M');
+    const char *inverted = "15|14|F";
+    CHECK_EQ(parseMinMax(inverted,strlen(inverted),&min,&max,&prog),PARSE_RANGE);
+    const char *fields = "13|14";
+    CHECK_EQ(parseMinMax(fields,strlen(fields),&min,&max,&prog),PARSE_FIELDS);
+    const char *extra = "13|14|F|1";
+    CHECK_EQ(parseMinMax(extra,strlen(extra),&min,&max,&prog),PARSE_FIELDS);
+    const char *program = "13|14|X";
+    CHECK_EQ(parseMinMax(program,strlen(program),&min,&max,&prog),PARSE_PROGRAM);
+}
+
+TEST(parse_limits){
+    centi_t lim[LIMITS_LEN] = {0};
+    const char *ok = "19|22|1|2|20|22.5";
+    CHECK_EQ(parseLimits(ok,strlen(ok),lim),PARSE_OK);
+    CHECK_EQ(lim[0],1900);
+    CHECK_EQ(lim[3],200);
+    CHECK_EQ(lim[5],2250);
+    //erro nao altera a saida
+    const char *bad = "19|22|3|2|20|22";
+    CHECK_EQ(parseLimits(bad,strlen(bad),lim),PARSE_RANGE);
+    CHECK_EQ(lim[2],100);
+    const char *few = "19|22|1|2|20";
+    CHECK_EQ(parseLimits(few,strlen(few),lim),PARSE_FIELDS);
+}
+//-----------------FIM PARSER-------------------//
+
+//-------------------- PERSISTENCIA ------------------//
+TEST(crc32_known_value){
+    CHECK_EQ(crc32("123456789",9),0xCBF43926u);
+    CHECK_EQ(crc32("",0),0);
+}
+
+//! Registro da versao 2 com o CRC calculado; version 1 corta o ctrlConfig.
+static size_t settingsImageOld(uint8_t version, uint8_t *buf){
+    settingsRecordV2 old;
+    memset(&old,0,sizeof(old));
+    old.magic   = SETTINGS_MAGIC;
+    old.version = version;
+    old.program = 'M';
+    old.seq     = 7;
+    const centi_t lim[LIMITS_LEN] = {1800,2000,50,150,2100,2300};
+    memcpy(old.limits,lim,sizeof(lim));
+    old.ctrl      = CTRL_DEFAULT;
+    old.ctrl.mode = CTRL_PID;
+    old.ctrl.kp   = 33;
+    size_t size = version == 1 ? SETTINGS_V1_SIZE : sizeof(old);
+    memcpy(buf,&old,size);
+    uint32_t crc = crc32(buf,size - sizeof(crc));
+    memcpy(buf + size - sizeof(crc),&crc,sizeof(crc));
+    return size;
+}
+
+TEST(settings_migrate_v1_v2){
+    static uint8_t img[sizeof(settingsRecord)];
+    for (uint8_t version=1;version<=2;version++){
+        hostReset();
+        hostFileSet(SET_FILE_A,img,settingsImageOld(version,img));
+        settingsLoad();
+        CHECK_EQ(settings_seq,7);
+        CHECK_EQ(vessels[0].program,'M');
+        CHECK_EQ(vessels[0].programs.maturation_min,50);
+        CHECK_EQ(vessels[0].temp_max,150);
+        CHECK_EQ(profiles[0].step,PROFILE_NONE);
+        //a versao 1 nao tinha o controlador: fica a configuracao de fabrica
+        CHECK_EQ(ctrl_cfg[0].mode,version == 1 ? CTRL_BANG : CTRL_PID);
+        CHECK_EQ(ctrl_cfg[0].kp,version == 1 ? 20 : 33);
+    }
+}
+
+TEST(settings_migrate_v3){
+    static uint8_t img[SETTINGS_V3_SIZE];
+    memset(img,0,sizeof(img));
+    settingsRecord *rec = (settingsRecord*)img;
+    rec->magic   = SETTINGS_MAGIC;
+    rec->version = 3;
+    rec->count   = 1;
+    rec->seq     = 11;
+    uint8_t   *v0   = img + offsetof(settingsRecord,vessels);
+    ctrlConfig ctrl = CTRL_DEFAULT;
+    ctrl.hysteresis = 25;
+    v0[0] = 'P';
+    v0[1] = 0x5A; //byte sem uso na versao 3
+    const centi_t lim[LIMITS_LEN] = {1700,1900,100,200,2000,2400};
+    memcpy(v0 + 2,lim,sizeof(lim));
+    memcpy(v0 + 2 + sizeof(lim),&ctrl,sizeof(ctrl));
+    uint32_t crc = crc32(img,SETTINGS_V3_SIZE - 4);
+    memcpy(img + SETTINGS_V3_SIZE - 4,&crc,4);
+    hostFileSet(SET_FILE_B,img,sizeof(img));
+
+    static settingsRecord out;
+    CHECK(settingsRead(SET_FILE_B,&out));
+    CHECK_EQ(out.seq,11);
+    CHECK_EQ(out.vessels[0].program,'P');
+    CHECK_EQ(out.vessels[0].limits[5],2400);
+    CHECK_EQ(out.vessels[0].ctrl.hysteresis,25);
+    CHECK_EQ(out.vessels[0].profile_step,PROFILE_NONE);
+    CHECK_EQ(out.vessels[0].profile_start,0);
+
+    //um byte trocado falha no CRC
+    host_fs[SET_FILE_B][20] ^= 1;
+    CHECK(!settingsRead(SET_FILE_B,&out));
+}
+
+TEST(settings_newest_slot_wins){
+    settingsLoad();
+    vessels[0].programs.fermentation_min = 1500;
+    settingsFlush();
+    vessels[0].programs.fermentation_min = 1600;
+    settingsFlush();
+    CHECK(fileExist(SET_FILE_A));
+    CHECK(fileExist(SET_FILE_B));
+    uint32_t seq = settings_seq;
+    vessels[0].programs.fermentation_min = 0;
+    settingsLoad();
+    CHECK_EQ(settings_seq,seq);
+    CHECK_EQ(vessels[0].programs.fermentation_min,1600);
+}
+//-----------------FIM PERSISTENCIA-------------------//
+
+//-------------------- TELEMETRIA ------------------//
+static uint32_t getVarint(const uint8_t *&p){
+    uint32_t v = 0;
+    for (int shift=0;;shift+=7){
+        uint8_t b = *p++;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)){
+            return v;
+        }
+    }
+}
+
+TEST(telemetry_encode){
+    telemetry[0] = {1000,1950,0,1};
+    telemetry[1] = {1010,1948,0,0};
+    telemetry[2] = {1300,2300,0,2};
+    telemetry_count = 3;
+    uint8_t buf[TELEMETRY_PAYLOAD];
+    size_t  len = telemetryEncode(buf);
+    CHECK(len <= TELEMETRY_PAYLOAD);
+    CHECK_EQ(buf[0],TELEMETRY_VERSION);
+    CHECK_EQ(buf[1],3);
+    uint32_t ts;
+    memcpy(&ts,buf + 2,4);
+    CHECK_EQ(ts,1000);
+
+    const uint8_t *p = buf + 6;
+    centi_t temp = 0;
+    for (int i=0;i<3;i++){
+        uint32_t head = getVarint(p);
+        uint32_t zz   = getVarint(p);
+        int32_t  d    = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+        ts   += head >> 5;
+        temp += d;
+        CHECK_EQ(ts,telemetry[i].timestamp);
+        CHECK_EQ((head >> 2) & 7,telemetry[i].vessel);
+        CHECK_EQ(head & 3,telemetry[i].relays);
+        CHECK_EQ(temp,telemetry[i].temp);
+    }
+    CHECK_EQ(p - buf,(long)len);
+    telemetry_count = 0;
+}
+//-----------------FIM TELEMETRIA-------------------//
+
+//-------------------- MODELO DO CONTROLADOR ------------------//
+TEST(ctrl_model_rls_converges){
+    //planta sintetica: +6 centesimos/amostra desligado, -9 ligado
+    ctrlModelReset(0);
+    ctrlModel &m = ctrl_model[0];
+    for (int i=0;i<300;i++){
+        int32_t u = (i / 7) & 1;
+        int32_t noise = (i % 3) - 1;
+        ctrlModelRls(m,u,(u ? -9 : 6) + noise);
+    }
+    CHECK(abs(m.theta[0] - (6 << 16)) < (1 << 15));
+    CHECK(abs(m.theta[0] + m.theta[1] - (-9 << 16)) < (1 << 15));
+    CHECK(m.p[0][0] > 0 && m.p[0][0] < CTRL_MODEL_P_MAX);
+}
+
+TEST(ctrl_model_ready_after_warmup){
+    //ctrlModelUpdate com a planta acima, compressor em ciclos de 5 minutos
+    ctrlModelReset(0);
+    centi_t  temp = 1900;
+    uint32_t now  = 1000;
+    for (int i=0;i<CTRL_MODEL_WARMUP + 20;i++){
+        bool on = (i / 10) & 1;
+        relayOf(0,RELAY_ONE).level = on ? HIGH : LOW;
+        ctrlModelUpdate(0,temp,now);
+        temp += on ? -9 : 6;
+        now  += CTRL_MODEL_SAMPLE_MS;
+    }
+    CHECK(ctrlModelReady(0));
+    CHECK(ctrl_model[0].lag_s > 0);
+    relayOf(0,RELAY_ONE).level = LOW;
+}
+//-----------------FIM MODELO DO CONTROLADOR-------------------//
+
+//-------------------- PERFIL ------------------//
+TEST(profile_steps_and_ramp){
+    //1 h em 18..20, depois rampa de 8 graus/dia ate 10..12
+    const char *msg = "18|20|1|0;10|12|0|8";
+    CHECK_EQ(profileStart(0,msg,strlen(msg)),PARSE_OK);
+    CHECK_EQ(profiles[0].step,0);
+    CHECK_EQ(vessels[0].temp_min,1800);
+
+    uint32_t t0 = 1700000000;
+    profileTick(0,t0);
+    CHECK_EQ(profiles[0].start,t0);
+    profileTick(0,t0 + 3599);
+    CHECK_EQ(profiles[0].step,0);
+    CHECK_EQ(vessels[0].temp_max,2000);
+
+    profileTick(0,t0 + 3600);
+    CHECK_EQ(profiles[0].step,1);
+    CHECK_EQ(vessels[0].temp_min,1800);
+    profileTick(0,t0 + 3600 + 43200);
+    CHECK_EQ(vessels[0].temp_min,1400);
+    CHECK_EQ(vessels[0].temp_max,1600);
+
+    profileTick(0,t0 + 3600 + 86400);
+    CHECK_EQ(profiles[0].step,PROFILE_NONE);
+    CHECK_EQ(vessels[0].temp_min,1000);
+    CHECK_EQ(vessels[0].temp_max,1200);
+}
+
+TEST(profile_skips_missed_steps){
+    const char *msg = "18|20|1|0;16|18|2|0;4|6|5|0";
+    CHECK_EQ(profileStart(0,msg,strlen(msg)),PARSE_OK);
+    uint32_t t0 = 1700000000;
+    profileTick(0,t0);
+    //energia de volta 4 horas depois: direto para o terceiro passo
+    profileTick(0,t0 + 4*3600);
+    CHECK_EQ(profiles[0].step,2);
+    CHECK_EQ(profiles[0].start,t0 + 3*3600);
+    CHECK_EQ(vessels[0].temp_min,400);
+    profileStop(0);
+    CHECK_EQ(profiles[0].step,PROFILE_NONE);
+}
+//-----------------FIM PERFIL-------------------//
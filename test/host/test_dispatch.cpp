@@ -0,0 +1,119 @@
+/*! \file test_dispatch.cpp
+ *  \brief Despacho de beer/# pela tabela com hash contra a cadeia de
+ *  comparacoes de String da versao original
+ */
+#include <chrono>
+#include "host.h"
+
+//! Cadeia original de onMessageReceived(): a ordem de la, com os topicos
+//! novos no fim. Devolve o indice em topics[] ou -1.
+static int chainFind(const String &topic){
+    static int idx[16];
+    static bool ready = false;
+    static const char *const order[] = {
+        "program","temperature","ls","ini","relay","minMax","limits",
+        "control","profile","history","telemetry","power","fileAck"
+    };
+    if (!ready){
+        for (size_t i=0;i<sizeof(order)/sizeof(order[0]);i++){
+            idx[i] = topicFind(order[i],strlen(order[i]));
+        }
+        ready = true;
+    }
+    if (topic == "beer/program")          return idx[0];
+    else if (topic == "beer/temperature") return idx[1];
+    else if (topic == "beer/ls")          return idx[2];
+    else if (topic == "beer/ini")         return idx[3];
+    else if (topic == "beer/relay")       return idx[4];
+    else if (topic == "beer/minMax")      return idx[5];
+    else if (topic == "beer/limits")      return idx[6];
+    else if (topic == "beer/control")     return idx[7];
+    else if (topic == "beer/profile")     return idx[8];
+    else if (topic == "beer/history")     return idx[9];
+    else if (topic == "beer/telemetry")   return idx[10];
+    else if (topic == "beer/power")       return idx[11];
+    else if (topic == "beer/fileAck")     return idx[12];
+    return -1;
+}
+
+//! Caminho de hoje ate o indice: prefixo, cuba e topicFind().
+static int hashFind(const String &topic){
+    const char *t   = topic.c_str();
+    size_t      len = topic.length();
+    if (len <= TOPIC_PREFIX_LEN || memcmp(t,TOPIC_PREFIX,TOPIC_PREFIX_LEN) != 0){
+        return -1;
+    }
+    t   += TOPIC_PREFIX_LEN;
+    len -= TOPIC_PREFIX_LEN;
+    if (len > 2 && t[0] >= '0' && t[0] <= '9' && t[1] == '/'){
+        t   += 2;
+        len -= 2;
+    }
+    return topicFind(t,len);
+}
+
+TEST(table_finds_every_topic){
+    bool all = true;
+    for (size_t i=0;i<sizeof(topics)/sizeof(topics[0]);i++){
+        all = all && topicFind(topics[i].name,topics[i].len) == (int)i;
+        all = all && topics[i].hash == topicHashRt(topics[i].name,topics[i].len);
+    }
+    CHECK(all);
+    CHECK_EQ(topicFind("minmax",6),-1);
+    CHECK_EQ(topicFind("temperatur",10),-1);
+    CHECK_EQ(topicFind("",0),-1);
+    //as duas formas concordam em todos os topicos da cadeia
+    const char *names[] = {"beer/program","beer/temperature","beer/ls","beer/ini","beer/relay",
+                           "beer/minMax","beer/limits","beer/control","beer/profile","beer/history",
+                           "beer/telemetry","beer/power","beer/fileAck","beer/nothing","freezer/ls"};
+    bool same = true;
+    for (size_t i=0;i<sizeof(names)/sizeof(names[0]);i++){
+        same = same && chainFind(String(names[i])) == hashFind(String(names[i]));
+    }
+    CHECK(same);
+}
+
+TEST(dispatch_bench){
+    //trafego tipico: quase tudo leitura, um pouco de configuracao e o pior
+    //caso da cadeia (topico do fim e topico desconhecido)
+    const String mix[] = {
+        String("beer/temperature"),String("beer/temperature"),String("beer/temperature"),
+        String("beer/temperature"),String("beer/minMax"),String("beer/program"),
+        String("beer/fileAck"),String("beer/nothing")
+    };
+    String last("beer/fileAck");
+    const String *volatile worst = &last; //impede que o laco seja calculado uma vez so
+    const int n = 2000000;
+    const int m = sizeof(mix)/sizeof(mix[0]);
+    long sink = 0;
+    host_allocs = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        sink += chainFind(mix[i % m]);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        sink += hashFind(mix[i % m]);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    double chain = std::chrono::duration<double,std::nano>(t1 - t0).count() / n;
+    double hash  = std::chrono::duration<double,std::nano>(t2 - t1).count() / n;
+
+    //pior caso da cadeia: o ultimo topico
+    auto t3 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        sink += chainFind(*worst);
+    }
+    auto t4 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        sink += hashFind(*worst);
+    }
+    auto t5 = std::chrono::steady_clock::now();
+    double chain_last = std::chrono::duration<double,std::nano>(t4 - t3).count() / n;
+    double hash_last  = std::chrono::duration<double,std::nano>(t5 - t4).count() / n;
+    printf("  despacho: cadeia %.1f ns, tabela %.1f ns por mensagem; ultimo topico %.1f ns contra %.1f ns\n",
+           chain,hash,chain_last,hash_last);
+    CHECK(sink > 0);
+    CHECK_EQ(host_allocs,0);
+    CHECK(hash_last < chain_last);
+}
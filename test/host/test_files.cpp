@@ -0,0 +1,124 @@
+/*! \file test_files.cpp
+ *  \brief beer/ls e beer/ini: listagem com total e envio em janela
+ */
+#include "host.h"
+
+//! Mensagens publicadas em topic, na ordem.
+static std::vector<std::string> messages(const char *topic){
+    std::vector<std::string> out;
+    for (size_t i=0;i<host_published.size();i++){
+        if (host_published[i].topic == topic){
+            out.push_back(std::string(host_published[i].payload.begin(),host_published[i].payload.end()));
+        }
+    }
+    return out;
+}
+
+//! Cria count arquivos /flash/f<i> de i+1 bytes.
+static void makeFiles(int count){
+    for (int i=0;i<count;i++){
+        char name[FILE_NAME_LEN];
+        m_snprintf(name,sizeof(name),"/flash/f%02d",i);
+        std::string data(i + 1,'x');
+        hostFileSet(name,data.data(),data.size());
+    }
+    files_dirty = true;
+}
+
+//! Linhas da listagem, juntando as mensagens.
+static std::vector<std::string> listing(){
+    std::vector<std::string> lines;
+    std::vector<std::string> m = messages("freezer/ls");
+    for (size_t i=0;i<m.size();i++){
+        CHECK(m[i].size() <= FILE_CHUNK);
+        size_t at = 0;
+        while (at < m[i].size()){
+            size_t nl = m[i].find('\n',at);
+            lines.push_back(m[i].substr(at,nl - at));
+            at = nl + 1;
+        }
+    }
+    return lines;
+}
+
+TEST(ls_empty_fs_replies){
+    files_dirty = true;
+    filesPublishList();
+    std::vector<std::string> l = listing();
+    CHECK(l.size() == 1 && l[0] == "# 0/0");
+}
+
+TEST(ls_lists_all_with_total){
+    makeFiles(10);
+    filesPublishList();
+    std::vector<std::string> l = listing();
+    CHECK_EQ(l.size(),11);
+    CHECK(l.size() == 11 && l[0] == "/flash/f00 1" && l[9] == "/flash/f09 10" && l[10] == "# 10/10");
+}
+
+TEST(ls_reports_truncation){
+    makeFiles(FILES_MAX + 7);
+    filesPublishList();
+    std::vector<std::string> l = listing();
+    CHECK_EQ(l.size(),FILES_MAX + 1);
+    char last[16];
+    m_snprintf(last,sizeof(last),"# %u/%u",FILES_MAX,FILES_MAX + 7);
+    CHECK(!l.empty() && l.back() == last);
+}
+
+//! Cabecalhos dos blocos publicados em freezer/file.
+static std::vector<fileChunk> chunks(){
+    std::vector<fileChunk> out;
+    std::vector<std::string> m = messages("freezer/file");
+    for (size_t i=0;i<m.size();i++){
+        fileChunk hdr;
+        memcpy(&hdr,m[i].data(),sizeof(hdr));
+        out.push_back(hdr);
+    }
+    return out;
+}
+
+TEST(ini_streams_in_window){
+    std::string data(FILE_CHUNK*6 + 100,'a');
+    for (size_t i=0;i<data.size();i++){
+        data[i] = (char)(i * 7);
+    }
+    hostFileSet("/flash/big.bin",data.data(),data.size());
+    fileSendStart("/flash/big.bin",14);
+    hostRun(5*FILE_TICK_MS);
+    //sem confirmacao: no maximo FILE_WINDOW blocos
+    CHECK_EQ(chunks().size(),FILE_WINDOW);
+    fileAck(1);
+    hostRun(2*FILE_TICK_MS);
+    CHECK_EQ(chunks().size(),FILE_WINDOW + 2);
+    //confirmacao alem do que foi enviado nao vale
+    fileAck(6);
+    CHECK_EQ(file_tx.acked,2*FILE_CHUNK);
+    fileAck(5);
+    hostRun(2*FILE_TICK_MS);
+    fileAck(6);
+    hostRun(2*FILE_TICK_MS);
+    std::vector<fileChunk> c = chunks();
+    CHECK_EQ(c.size(),7);
+    CHECK(c.size() == 7 && c[6].last == 1 && c[6].offset == FILE_CHUNK*6);
+    //os blocos remontam o arquivo
+    std::string got;
+    std::vector<std::string> m = messages("freezer/file");
+    for (size_t i=0;i<m.size();i++){
+        got += m[i].substr(sizeof(fileChunk));
+    }
+    CHECK(got == data);
+    CHECK_EQ(messages("freezer/fileStat").size(),1);
+    CHECK(!taskActive(TASK_FILE));
+}
+
+TEST(ini_resends_after_timeout){
+    std::string data(FILE_CHUNK*2,'b');
+    hostFileSet("/flash/two.bin",data.data(),data.size());
+    fileSendStart("/flash/two.bin",14);
+    hostRun(2*FILE_TICK_MS);
+    CHECK_EQ(chunks().size(),2);
+    hostRun(FILE_ACK_TIMEOUT_MS + 2*FILE_TICK_MS);
+    std::vector<fileChunk> c = chunks();
+    CHECK(c.size() == 4 && c[2].seq == 0 && c[3].seq == 1);
+}
@@ -0,0 +1,91 @@
+/*! \file test_fixed.cpp
+ *  \brief Ponto fixo no caminho do controle: golden contra o double antigo,
+ *  bordas exatas da histerese e PID inteiro
+ */
+#include "host.h"
+#include <math.h>
+
+TEST(parse_matches_double_golden){
+    //todas as leituras validas com 1 a 3 casas, menos os empates em .xx5
+    int bad = 0;
+    for (int32_t m=CENTI_MIN*10;m<=CENTI_MAX*10;m++){
+        if (abs(m) % 10 == 5){
+            continue;
+        }
+        char s[16];
+        snprintf(s,sizeof(s),"%s%d.%03d",m < 0 ? "-" : "",abs(m) / 1000,abs(m) % 1000);
+        centi_t v;
+        if (parseCenti(s,strlen(s),&v) != PARSE_OK || v != lround(strtod(s,NULL) * 100)){
+            bad++;
+        }
+    }
+    CHECK_EQ(bad,0);
+}
+
+TEST(format_matches_printf_golden){
+    int bad = 0;
+    for (int32_t c=CENTI_MIN;c<=CENTI_MAX;c++){
+        char mine[8];
+        char ref[16];
+        formatCenti(mine,(centi_t)c);
+        snprintf(ref,sizeof(ref),"%.2f",c / 100.0);
+        if (strcmp(mine,ref) != 0){
+            bad++;
+        }
+    }
+    CHECK_EQ(bad,0);
+}
+
+//! Compressor da cuba 0 depois de uma decisao do CTRL_BANG em temp.
+static bool bangAt(centi_t temp, bool before){
+    relayOf(0,RELAY_ONE).level = before ? HIGH : LOW;
+    ctrlBang(0,temp,1800,2000);
+    return relayOf(0,RELAY_ONE).level == HIGH;
+}
+
+TEST(bang_edges_are_exact){
+    ctrl_cfg[0]           = CTRL_DEFAULT;
+    ctrl_cfg[0].min_on_s  = 0;
+    ctrl_cfg[0].min_off_s = 0;
+    const centi_t hyst[] = {0,15,50};
+    for (size_t i=0;i<sizeof(hyst)/sizeof(hyst[0]);i++){
+        centi_t h = hyst[i];
+        ctrl_cfg[0].hysteresis = h;
+        //liga exatamente em max + h, desliga exatamente em min - h
+        CHECK(bangAt(2000 + h,false));
+        CHECK(!bangAt(2000 + h - 1,false));
+        CHECK(!bangAt(1800 - h,true));
+        CHECK(bangAt(1800 - h + 1,true));
+    }
+    //em double 18.11 >= 18.01 + 0.10 e falso; em centesimos a borda e exata
+    volatile double t = 18.11, max = 18.01, h = 0.10;
+    CHECK(!(t >= max + h));
+    ctrl_cfg[0].hysteresis = 10;
+    relayOf(0,RELAY_ONE).level = LOW;
+    ctrlBang(0,1811,1700,1801);
+    CHECK_EQ(relayOf(0,RELAY_ONE).level,HIGH);
+    relayOf(0,RELAY_ONE).level = LOW;
+}
+
+TEST(pid_integer_duty){
+    ctrl_cfg[0]    = CTRL_DEFAULT;
+    ctrl_cfg[0].kp = 20;
+    ctrl_cfg[0].ki = 10;
+    ctrl_cfg[0].kd = 0;
+    ctrl[0].integral = 0;
+    ctrl[0].last_err = 0;
+    ctrl[0].last_ms  = 0;
+    //1 grau acima do meio: so a proporcional
+    host_ms = 1000;
+    ctrlPid(0,2000,1800,2000);
+    CHECK_EQ(ctrl[0].duty,20);
+    //uma hora depois com o mesmo erro: +ki
+    host_ms += 3600000;
+    ctrlPid(0,2000,1800,2000);
+    CHECK_EQ(ctrl[0].integral,100*3600);
+    CHECK_EQ(ctrl[0].duty,30);
+    //abaixo do meio: duty nunca negativo
+    host_ms += 1000;
+    ctrlPid(0,1600,1800,2000);
+    CHECK_EQ(ctrl[0].duty,0);
+}
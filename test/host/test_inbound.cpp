@@ -0,0 +1,150 @@
+/*! \file test_inbound.cpp
+ *  \brief Fila de entrada: agrupamento, ordem, descarte e a medicao do SELFTEST
+ */
+#define SELFTEST
+#include "host.h"
+
+static void receive(const char *topic, const char *msg){
+    onMessageReceived(String(topic),String(msg));
+}
+
+TEST(callback_only_queues){
+    settingsLoad();
+    uint32_t processed = in_processed;
+    receive("beer/minMax","10|12|F");
+    CHECK(in_count > 0);
+    CHECK_EQ(in_processed,processed);
+    CHECK(taskActive(TASK_INBOUND));
+    hostRun(SCHED_TICK_MS);
+    CHECK_EQ(in_count,0);
+    CHECK_EQ(in_processed,processed + 1);
+    CHECK_EQ(vessels[0].programs.fermentation_min,1000);
+}
+
+TEST(latest_coalesces_in_order){
+    settingsLoad();
+    uint32_t coalesced = in_coalesced;
+    uint32_t processed = in_processed;
+    receive("beer/minMax","10|12|F");
+    receive("beer/program","M");
+    receive("beer/minMax","11|13|F");
+    receive("beer/minMax","14|15|F");
+    hostRun(5*SCHED_TICK_MS);
+    //vale o ultimo minMax; o program continua entregue
+    CHECK_EQ(in_coalesced - coalesced,2);
+    CHECK_EQ(in_processed - processed,2);
+    CHECK_EQ(vessels[0].program,'M');
+    CHECK_EQ(vessels[0].programs.fermentation_min,1400);
+    CHECK_EQ(vessels[0].programs.fermentation_max,1500);
+
+    //programas diferentes sao chaves diferentes: a maturacao nao se perde
+    coalesced = in_coalesced;
+    receive("beer/minMax","13|14|M");
+    receive("beer/minMax","18|20|F");
+    receive("beer/minMax","19|21|F ");
+    hostRun(5*SCHED_TICK_MS);
+    CHECK_EQ(in_coalesced - coalesced,1);
+    CHECK_EQ(vessels[0].programs.maturation_min,1300);
+    CHECK_EQ(vessels[0].programs.maturation_max,1400);
+    CHECK_EQ(vessels[0].programs.fermentation_min,1900);
+    CHECK_EQ(vessels[0].programs.fermentation_max,2100);
+}
+
+TEST(control_coalesces_per_mode){
+    settingsLoad();
+    receive("beer/control","P|35|12|4|900");
+    receive("beer/control","B|0.2|60|180");
+    hostRun(5*SCHED_TICK_MS);
+    //os ganhos do PID chegam antes da troca para o modo B
+    CHECK_EQ(ctrl_cfg[0].mode,CTRL_BANG);
+    CHECK_EQ(ctrl_cfg[0].kp,35);
+    CHECK_EQ(ctrl_cfg[0].window_s,900);
+    CHECK_EQ(ctrl_cfg[0].hysteresis,20);
+
+    //mesmo modo: vale o ultimo
+    uint32_t coalesced = in_coalesced;
+    receive("beer/control","B|0.3|60|180");
+    receive("beer/control","B|0.4|60|180");
+    hostRun(5*SCHED_TICK_MS);
+    CHECK_EQ(in_coalesced - coalesced,1);
+    CHECK_EQ(ctrl_cfg[0].hysteresis,40);
+}
+
+TEST(power_command_survives_report){
+    settingsLoad();
+    power_profile = POWER_LATENCY;
+    receive("beer/power","P");
+    receive("beer/power","");
+    hostRun(5*SCHED_TICK_MS);
+    CHECK_EQ(power_profile,POWER_LOW);
+    powerSet(POWER_LATENCY,POWER_PERIOD_S,POWER_WINDOW_S);
+}
+
+TEST(fifo_delivers_every_message){
+    settingsLoad();
+    uint32_t coalesced = in_coalesced;
+    for (int i=0;i<6;i++){
+        receive("beer/relay","3");
+    }
+    hostRun(5*SCHED_TICK_MS);
+    CHECK_EQ(in_coalesced,coalesced);
+    CHECK_EQ(in_count,0);
+}
+
+TEST(full_ring_drops){
+    settingsLoad();
+    static char big[IN_MSG_MAX];
+    memset(big,'1',sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    uint32_t dropped = in_dropped;
+    for (int i=0;i<4;i++){
+        receive("beer/ini",big);
+    }
+    CHECK(in_dropped > dropped);
+    static char huge[IN_MSG_MAX + 2];
+    memset(huge,'1',sizeof(huge) - 1);
+    huge[sizeof(huge) - 1] = 0;
+    hostRun(10*SCHED_TICK_MS);
+    dropped = in_dropped;
+    receive("beer/ini",huge);
+    CHECK_EQ(in_dropped,dropped + 1);
+    CHECK_EQ(in_count,0);
+}
+
+TEST(selftest_gate_times_handlers){
+    //a latencia do gate cobre o handler: a fila esta vazia ao fim de cada medicao
+    settingsLoad();
+    uint32_t processed = in_processed;
+    selftestRun();
+    CHECK_EQ(in_count,0);
+    CHECK_EQ(in_processed - processed,SELFTEST_LEN*SELFTEST_PASSES);
+}
+
+//! Mensagens publicadas em freezer/selftest.
+static std::vector<std::string> selftestReports(){
+    std::vector<std::string> out;
+    for (size_t i=0;i<host_published.size();i++){
+        if (host_published[i].topic == "freezer/selftest"){
+            out.push_back(std::string(host_published[i].payload.begin(),host_published[i].payload.end()));
+        }
+    }
+    return out;
+}
+
+TEST(selftest_runs_as_task){
+    //bateria, relatorio, carga e relatorio da carga, tudo pelo escalonador
+    settingsLoad();
+    taskStart(TASK_CONTROL,ctrlTick,CTRL_TICK_MS,CTRL_TICK_MS);
+    selftestStart();
+    CHECK(taskActive(TASK_SELFTEST));
+    CHECK(selftestReports().empty());
+    hostRun(100 + SELFTEST_SETTLE_MS + SCHED_TICK_MS);
+    std::vector<std::string> r = selftestReports();
+    CHECK_EQ(r.size(),1);
+    hostRun(SELFTEST_LOAD_MSGS*SELFTEST_LOAD_MS + SELFTEST_SETTLE_MS + SCHED_TICK_MS);
+    r = selftestReports();
+    CHECK_EQ(r.size(),2);
+    CHECK_EQ(selftest_load_sent,SELFTEST_LOAD_MSGS);
+    CHECK(r.size() == 2 && r[1].compare(0,8,"LOAD OK ") == 0);
+    CHECK(!taskActive(TASK_SELFTEST));
+}
@@ -0,0 +1,160 @@
+/*! \file test_log.cpp
+ *  \brief Log binario: o arquivo gravado e lido pelo decodificador de
+ *  logdecode.h, descarga em paginas inteiras, escritas por descarga, rotacao
+ *  e vazao de registros no host
+ */
+#include <chrono>
+#include "host.h"
+#include "logdecode.h"
+
+//! Esvazia o anel e esquece o tamanho de LOG_FILE.
+static void logClear(){
+    log_head    = 0;
+    log_count   = 0;
+    log_dropped = 0;
+    log_size    = -1;
+    log_events_count = 0;
+    memset(log_last_temp_s,0,sizeof(log_last_temp_s));
+}
+
+//! Registros de um arquivo do log, decodificados.
+static std::vector<logDecoded> decodeFile(const char *name){
+    std::vector<logDecoded> out;
+    const std::vector<uint8_t> &img = host_fs[name];
+    for (size_t i=0;i + LOGDEC_RECORD <= img.size();i+=LOGDEC_RECORD){
+        out.push_back(logDecode(&img[i]));
+    }
+    return out;
+}
+
+TEST(decoder_reads_firmware_records){
+    logClear();
+    host_ms = 125000;
+    vessels[0].program   = 'M';
+    vessels[0].last_temp = -1234;
+    relayOf(0,RELAY_ONE).level = 1;
+    relayOf(0,RELAY_TWO).level = 0;
+    logEvent(EV_RELAY,0);
+    vessels[0].last_temp = INT16_MIN;
+    vessels[0].program   = 'P';
+    relayOf(0,RELAY_ONE).level = 0;
+    relayOf(0,RELAY_TWO).level = 1;
+    logEvent(EV_ALERT,0);
+    host_ms += LOG_MAX_AGE_S*1000;
+    logFlush();
+
+    std::vector<logDecoded> r = decodeFile(LOG_FILE);
+    CHECK_EQ(host_fs[LOG_FILE].size(),2*sizeof(logRecord));
+    CHECK_EQ(r.size(),2);
+    CHECK_EQ(r[0].timestamp,125);
+    CHECK_EQ(r[0].temp,-1234);
+    CHECK_EQ(r[0].program,'M');
+    CHECK_EQ(r[0].vessel,0);
+    CHECK(r[0].relay1 && !r[0].relay2);
+    CHECK_EQ(r[0].event,EV_RELAY);
+    CHECK_EQ(r[1].temp,INT16_MIN);
+    CHECK_EQ(r[1].program,'P');
+    CHECK(!r[1].relay1 && r[1].relay2);
+    CHECK_EQ(r[1].event,EV_ALERT);
+
+    char line[96];
+    logFormat(r[0],line,sizeof(line));
+    CHECK_EQ(strcmp(line,"125 0 M -12.34 10 relay"),0);
+    logFormat(r[1],line,sizeof(line));
+    CHECK_EQ(strcmp(line,"125 0 P - 01 alert"),0);
+    //a tabela de nomes cobre todos os eventos do firmware
+    CHECK(logEventName(EV_ALERT) != NULL);
+    CHECK(logEventName(EV_ALERT + 1) == NULL);
+    relayOf(0,RELAY_TWO).level = 0;
+    vessels[0].program = 'F';
+}
+
+TEST(flush_writes_whole_pages){
+    logClear();
+    host_ms = 1000;
+    for (int i=0;i<LOG_PAGE_RECORDS + 8;i++){
+        logEvent(EV_CONTROL,0);
+    }
+    uint32_t writes = host_writes;
+    logFlush();
+    //uma pagina vai para a flash, o resto espera completar outra
+    CHECK_EQ(host_fs[LOG_FILE].size(),LOG_PAGE_RECORDS*sizeof(logRecord));
+    CHECK_EQ(host_writes - writes,1);
+    CHECK_EQ(log_count,8);
+    logFlush();
+    CHECK_EQ(host_writes - writes,1);
+    //ate envelhecer
+    host_ms += LOG_MAX_AGE_S*1000;
+    logFlush();
+    CHECK_EQ(host_fs[LOG_FILE].size(),(LOG_PAGE_RECORDS + 8)*sizeof(logRecord));
+    CHECK_EQ(host_writes - writes,2);
+    CHECK_EQ(log_count,0);
+}
+
+TEST(wrapped_ring_costs_two_writes){
+    logClear();
+    host_ms = 1000;
+    //cabeca no meio do anel: a pagina seguinte da a volta
+    log_head = LOG_RING_LEN - LOG_PAGE_RECORDS/2;
+    for (int i=0;i<LOG_PAGE_RECORDS;i++){
+        logEvent(EV_CONTROL,0);
+    }
+    uint32_t writes = host_writes;
+    logFlush();
+    CHECK_EQ(host_writes - writes,2);
+    CHECK_EQ(host_fs[LOG_FILE].size(),LOG_PAGE_RECORDS*sizeof(logRecord));
+    CHECK_EQ(log_head,LOG_PAGE_RECORDS/2);
+}
+
+TEST(rotation_bounds_flash){
+    logClear();
+    host_ms = 1000;
+    uint32_t pages = 2*LOG_MAX_BYTES / (LOG_PAGE_RECORDS*sizeof(logRecord)) + 3;
+    for (uint32_t p=0;p<pages;p++){
+        for (int i=0;i<LOG_PAGE_RECORDS;i++){
+            logEvent(EV_CONTROL,0);
+        }
+        logFlush();
+    }
+    CHECK(host_fs[LOG_FILE].size() <= LOG_MAX_BYTES);
+    CHECK_EQ(host_fs[LOG_OLD_FILE].size(),LOG_MAX_BYTES);
+    CHECK(host_fs[LOG_FILE].size() + host_fs[LOG_OLD_FILE].size() <= 2*LOG_MAX_BYTES);
+    CHECK_EQ(host_fs[LOG_FILE].size() % sizeof(logRecord),0);
+    CHECK_EQ(log_dropped,0);
+}
+
+TEST(log_bench){
+    //uma leitura por minuto e um evento a cada 10 s, com TASK_LOG no seu
+    //intervalo: o custo de um registro e quantas escritas chegam a flash
+    logClear();
+    const uint32_t secs = 6*3600;
+    uint32_t writes  = host_writes;
+    uint32_t records = 0;
+    uint32_t flushes = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint32_t s=1;s<=secs;s++){
+        host_ms = s*1000;
+        vessels[0].last_temp = 1800 + s % 50;
+        logTemperature(0);
+        if (s % 10 == 0){
+            logEvent(EV_CONTROL,0);
+            records++;
+            if (s*1000 % LOG_CHECK_MS == 0){
+                uint32_t before = host_writes;
+                logFlush();
+                flushes += host_writes != before;
+            }
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    records += secs / LOG_TEMP_INTERVAL_S;
+    uint32_t w   = host_writes - writes;
+    double   sec = std::chrono::duration<double>(t1 - t0).count();
+    printf("  log: %.0f registros/s no host, %u registros, %u descargas, %.2f escritas por descarga, %.1f escritas por 1000 registros\n",
+           records / sec,records,flushes,flushes ? (double)w / flushes : 0.0,1000.0*w / records);
+    CHECK_EQ(log_dropped,0);
+    //so paginas inteiras: no maximo 2 escritas (volta do anel) por pagina
+    CHECK(w <= 2*(records / LOG_PAGE_RECORDS + 1));
+    CHECK(flushes <= records / LOG_PAGE_RECORDS + 1);
+    vessels[0].last_temp = INT16_MIN;
+}
@@ -0,0 +1,111 @@
+/*! \file test_mqtt.cpp
+ *  \brief Conexao MQTT contra um broker simulado: queda da sessao, 5 minutos
+ *  fora do ar e a volta
+ */
+#include "host.h"
+
+#define OUTAGE_MS (5*60*1000UL)
+
+//! Maquina de estados do zero, como no boot.
+static void mqttClear(){
+    mqtt_state      = MQTT_IDLE;
+    mqtt_backoff_ms = MQTT_BACKOFF_MIN_MS;
+    mqtt_attempts   = 0;
+    mqtt_sessions   = 0;
+    srand(1);
+}
+
+//! Roda tick a tick ate a sessao abrir ou passar ms; retorna o tempo gasto.
+static uint32_t runUntilOnline(uint32_t ms){
+    uint32_t start = host_ms;
+    while (!mqttOnline() && host_ms - start < ms){
+        hostRun(SCHED_TICK_MS);
+    }
+    return host_ms - start;
+}
+
+//! Roda ms anotando o instante de cada connect.
+static std::vector<uint32_t> runAttempts(uint32_t ms){
+    std::vector<uint32_t> at;
+    uint32_t connects = host_connects;
+    for (uint32_t t=0;t<ms;t+=SCHED_TICK_MS){
+        hostRun(SCHED_TICK_MS);
+        if (host_connects != connects){
+            connects = host_connects;
+            at.push_back(host_ms);
+        }
+    }
+    return at;
+}
+
+//! Uma queda de OUTAGE_MS com o broker recusando (fail_ms) ou calado (-1).
+static void outage(long fail_ms){
+    mqttClear();
+    host_connect_fail_ms = fail_ms;
+    mqttStart();
+    runUntilOnline(MQTT_POLL_MS);
+    CHECK(mqttOnline());
+    CHECK_EQ(mqtt_sessions,1);
+
+    hostBrokerDown();
+    CHECK_EQ(mqtt_state,MQTT_BACKOFF);
+    std::vector<uint32_t> at = runAttempts(OUTAGE_MS);
+    CHECK(!mqttOnline());
+
+    //a primeira tentativa sai apos MQTT_BACKOFF_MIN_MS e os intervalos
+    //seguintes dobram ate o teto, com +-25%; sem resposta cada tentativa
+    //ainda espera MQTT_CONFIRM_MS
+    uint32_t wait = fail_ms < 0 ? MQTT_CONFIRM_MS : fail_ms;
+    uint32_t backoff = 2*MQTT_BACKOFF_MIN_MS;
+    bool     spaced  = true;
+    for (size_t i=1;i<at.size();i++){
+        uint32_t gap = at[i] - at[i-1] - wait;
+        spaced  = spaced && gap + SCHED_TICK_MS >= backoff - backoff/4 && gap <= backoff + backoff/4 + SCHED_TICK_MS;
+        backoff = backoff*2 > MQTT_BACKOFF_MAX_MS ? MQTT_BACKOFF_MAX_MS : backoff*2;
+    }
+    CHECK(spaced);
+    CHECK(at.size() >= 4 && at.size() <= 14);
+    CHECK_EQ(mqtt_attempts,1 + at.size());
+
+    host_broker_up = true;
+    uint32_t latency = runUntilOnline(2*MQTT_BACKOFF_MAX_MS);
+    CHECK(mqttOnline());
+    CHECK_EQ(mqtt_sessions,2);
+    CHECK_EQ(mqtt_backoff_ms,MQTT_BACKOFF_MIN_MS);
+    //no pior caso a volta espera uma tentativa em curso e um intervalo no teto
+    CHECK(latency <= wait + MQTT_BACKOFF_MAX_MS + MQTT_BACKOFF_MAX_MS/4 + MQTT_POLL_MS);
+    printf("  queda de %lu s, broker %s: %u tentativas, volta em %.1f s\n",OUTAGE_MS/1000,
+           fail_ms < 0 ? "calado" : "recusando",(unsigned)at.size(),latency / 1000.0);
+}
+
+TEST(complete_delegate_reaches_state_machine){
+    mqttClear();
+    mqttStart();
+    runUntilOnline(MQTT_POLL_MS);
+    CHECK(mqttOnline());
+    //a queda chega pelo delegate guardado em setCompleteDelegate
+    mqtt.hostComplete(false);
+    CHECK_EQ(mqtt_state,MQTT_BACKOFF);
+    CHECK(taskActive(TASK_MQTT));
+    runUntilOnline(MQTT_BACKOFF_MIN_MS*2);
+    CHECK(mqttOnline());
+    CHECK_EQ(mqtt_attempts,2);
+}
+
+TEST(refused_outage_backs_off_and_returns){
+    outage(500);
+}
+
+TEST(silent_outage_backs_off_and_returns){
+    outage(-1);
+}
+
+TEST(stop_ignores_late_completion){
+    mqttClear();
+    mqttStart();
+    runUntilOnline(MQTT_POLL_MS);
+    mqttStop();
+    mqtt.hostComplete(false);
+    CHECK_EQ(mqtt_state,MQTT_IDLE);
+    CHECK(!taskActive(TASK_MQTT));
+}
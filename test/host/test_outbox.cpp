@@ -0,0 +1,154 @@
+/*! \file test_outbox.cpp
+ *  \brief Fila de saida: envio recusado, giro dos arquivos e recuperacao
+ */
+#include "host.h"
+
+#define PAYLOAD 100
+
+//! Envia o registro numero seq pela fila.
+static void send(uint32_t seq){
+    uint8_t buf[PAYLOAD];
+    memset(buf,0xA5,sizeof(buf));
+    memcpy(buf,&seq,sizeof(seq));
+    outboxSend(OUTBOX_TELEMETRY,buf,sizeof(buf),0);
+}
+
+//! Numeros dos registros publicados, na ordem.
+static std::vector<uint32_t> published(){
+    std::vector<uint32_t> out;
+    for (size_t i=0;i<host_published.size();i++){
+        uint32_t seq;
+        memcpy(&seq,host_published[i].payload.data(),sizeof(seq));
+        out.push_back(seq);
+    }
+    return out;
+}
+
+//! Reset: a fila em flash fica, o estado da RAM volta ao de compilacao.
+static void reboot(){
+    outbox_pending = false;
+    outbox_size    = -1;
+    outbox_read    = 0;
+    outbox_dropped = 0;
+    taskStop(TASK_OUTBOX);
+    outboxBegin();
+}
+
+static void drain(uint32_t records){
+    hostRun(records * OUTBOX_DRAIN_MS + OUTBOX_DRAIN_MS);
+}
+
+TEST(direct_send){
+    reboot();
+    send(1);
+    CHECK_EQ(host_published.size(),1);
+    CHECK(!fileExist(OUTBOX_FILE));
+}
+
+TEST(refused_send_is_queued){
+    reboot();
+    host_publish_ok = false;
+    send(1);
+    CHECK(fileExist(OUTBOX_FILE));
+    //sessao aberta mas publicacao recusada: a drenagem nao avanca
+    drain(3);
+    CHECK_EQ(outbox_read,0);
+    CHECK(outbox_pending);
+    host_publish_ok = true;
+    send(2);
+    drain(3);
+    std::vector<uint32_t> got = published();
+    CHECK_EQ(got.size(),2);
+    CHECK(got.size() == 2 && got[0] == 1 && got[1] == 2);
+    CHECK(!outbox_pending);
+    CHECK(!fileExist(OUTBOX_FILE));
+}
+
+TEST(wrap_keeps_order){
+    reboot();
+    mqtt_state = MQTT_IDLE;
+    const uint32_t per_file = OUTBOX_MAX_BYTES / (sizeof(outboxHeader) + PAYLOAD);
+    const uint32_t total    = per_file*3 + 5;
+    for (uint32_t i=0;i<total;i++){
+        send(i);
+    }
+    CHECK(fileExist(OUTBOX_OLD_FILE));
+    CHECK(fileGetSize(OUTBOX_FILE) <= OUTBOX_MAX_BYTES);
+    CHECK(outbox_dropped > 0);
+
+    mqtt_state = MQTT_ONLINE;
+    drain(total);
+    std::vector<uint32_t> got = published();
+    //dois giros: sobram o arquivo antigo inteiro e os 5 do atual
+    CHECK_EQ(got.size(),per_file + 5);
+    bool ordered = true;
+    for (size_t i=1;i<got.size();i++){
+        ordered = ordered && got[i] == got[i-1] + 1;
+    }
+    CHECK(ordered);
+    CHECK(!got.empty() && got.back() == total - 1);
+    CHECK_EQ(outbox_dropped,(total - got.size()) * (sizeof(outboxHeader) + PAYLOAD));
+    CHECK(!outbox_pending);
+}
+
+TEST(torn_tail_is_cut_on_boot){
+    reboot();
+    mqtt_state = MQTT_IDLE;
+    for (uint32_t i=0;i<3;i++){
+        send(i);
+    }
+    //queda no meio do quarto outboxPush()
+    host_write_budget = sizeof(outboxHeader) + 10;
+    send(3);
+    host_write_budget = -1;
+    reboot();
+    CHECK_EQ(fileGetSize(OUTBOX_FILE),3*(sizeof(outboxHeader) + PAYLOAD));
+    CHECK_EQ(outbox_dropped,sizeof(outboxHeader) + 10);
+    CHECK(!fileExist(OUTBOX_TMP));
+    send(4);
+
+    mqtt_state = MQTT_ONLINE;
+    drain(5);
+    std::vector<uint32_t> got = published();
+    CHECK_EQ(got.size(),4);
+    CHECK(got.size() == 4 && got[2] == 2 && got[3] == 4);
+}
+
+TEST(bad_record_drops_rest_of_one_file){
+    reboot();
+    mqtt_state = MQTT_IDLE;
+    const uint32_t per_file = OUTBOX_MAX_BYTES / (sizeof(outboxHeader) + PAYLOAD);
+    for (uint32_t i=0;i<per_file + 2;i++){
+        send(i);
+    }
+    CHECK(fileExist(OUTBOX_OLD_FILE));
+    //cabecalho do segundo registro do arquivo antigo corrompido
+    std::vector<uint8_t> &old = host_fs[OUTBOX_OLD_FILE];
+    old[sizeof(outboxHeader) + PAYLOAD + 2] = 0xFF;
+    old[sizeof(outboxHeader) + PAYLOAD + 3] = 0xFF;
+
+    mqtt_state = MQTT_ONLINE;
+    drain(per_file + 2);
+    std::vector<uint32_t> got = published();
+    //o primeiro do antigo e todos do atual chegam
+    CHECK_EQ(got.size(),3);
+    CHECK(got.size() == 3 && got[0] == 0 && got[1] == per_file && got[2] == per_file + 1);
+    CHECK_EQ(outbox_dropped,(per_file - 1) * (sizeof(outboxHeader) + PAYLOAD));
+    CHECK(!outbox_pending);
+}
+
+TEST(repair_interrupted_before_rename){
+    reboot();
+    mqtt_state = MQTT_IDLE;
+    send(7);
+    //queda entre apagar o original e renomear a copia
+    host_fs[OUTBOX_TMP] = host_fs[OUTBOX_FILE];
+    host_fs.erase(OUTBOX_FILE);
+    reboot();
+    CHECK(fileExist(OUTBOX_FILE));
+    CHECK(!fileExist(OUTBOX_TMP));
+    mqtt_state = MQTT_ONLINE;
+    drain(2);
+    std::vector<uint32_t> got = published();
+    CHECK(got.size() == 1 && got[0] == 7);
+}
@@ -0,0 +1,155 @@
+/*! \file test_parser.cpp
+ *  \brief Entradas mal formadas, longas e de fronteira no parser, sem heap
+ */
+#include "host.h"
+#include <chrono>
+
+static parseError centi(const char *s, centi_t *out){
+    return parseCenti(s,strlen(s),out);
+}
+
+TEST(parse_centi_boundaries){
+    centi_t v = 77;
+    host_allocs = 0;
+    CHECK_EQ(centi("-0.005",&v),PARSE_OK);
+    CHECK_EQ(v,-1);
+    CHECK_EQ(centi("-0.004",&v),PARSE_OK);
+    CHECK_EQ(v,0);
+    CHECK_EQ(centi("125.004",&v),PARSE_OK);
+    CHECK_EQ(v,CENTI_MAX);
+    CHECK_EQ(centi("125.005",&v),PARSE_RANGE);
+    CHECK_EQ(centi("-40.004",&v),PARSE_OK);
+    CHECK_EQ(v,CENTI_MIN);
+    CHECK_EQ(centi("5.",&v),PARSE_OK);
+    CHECK_EQ(v,500);
+    CHECK_EQ(centi(".5",&v),PARSE_OK);
+    CHECK_EQ(v,50);
+    CHECK_EQ(centi("0000000000019.5",&v),PARSE_OK);
+    CHECK_EQ(v,1950);
+    CHECK_EQ(centi("19.5000000000001",&v),PARSE_OK);
+    CHECK_EQ(v,1950);
+    CHECK_EQ(host_allocs,0);
+}
+
+TEST(parse_centi_malformed){
+    centi_t v = 77;
+    host_allocs = 0;
+    CHECK_EQ(centi("",&v),PARSE_EMPTY);
+    CHECK_EQ(centi("   ",&v),PARSE_EMPTY);
+    CHECK_EQ(centi(".",&v),PARSE_EMPTY);
+    CHECK_EQ(centi("-.",&v),PARSE_EMPTY);
+    CHECK_EQ(centi("1.2.3",&v),PARSE_BAD_CHAR);
+    CHECK_EQ(centi("--1",&v),PARSE_BAD_CHAR);
+    CHECK_EQ(centi("1e2",&v),PARSE_BAD_CHAR);
+    CHECK_EQ(centi("1 2",&v),PARSE_BAD_CHAR);
+    CHECK_EQ(centi("99999999999999999999",&v),PARSE_RANGE);
+    //erro nao altera a saida
+    CHECK_EQ(v,77);
+    CHECK_EQ(host_allocs,0);
+}
+
+TEST(parse_min_max_malformed){
+    centi_t min = 0, max = 0;
+    char    prog = 0;
+    const char *cases[] = {"", "|", "||", "1||F", "|2|F", "1|2|", "1|2|FF", "1|2|f",
+                           "-12.50|-12.5|M|", "1|2|F|", "1.2.3|4|F", "5.|.5|P"};
+    const parseError expect[] = {PARSE_FIELDS, PARSE_FIELDS, PARSE_EMPTY, PARSE_EMPTY,
+                                 PARSE_EMPTY, PARSE_PROGRAM, PARSE_PROGRAM, PARSE_PROGRAM,
+                                 PARSE_FIELDS, PARSE_FIELDS, PARSE_BAD_CHAR, PARSE_RANGE};
+    host_allocs = 0;
+    for (size_t i=0;i<sizeof(cases)/sizeof(cases[0]);i++){
+        parseError err = parseMinMax(cases[i],strlen(cases[i]),&min,&max,&prog);
+        if (err != expect[i]){
+            printf("  '%s': %s\n",cases[i],parseErrorStr(err));
+        }
+        CHECK_EQ(err,expect[i]);
+    }
+    const char *neg = "-12.50|-12.5|M";
+    CHECK_EQ(parseMinMax(neg,strlen(neg),&min,&max,&prog),PARSE_OK);
+    CHECK_EQ(min,-1250);
+    CHECK_EQ(max,-1250);
+    CHECK_EQ(host_allocs,0);
+}
+
+TEST(limits_ini_overlong){
+    //limits.ini maior que o buffer e rejeitado sem tocar nos limites
+    char big[LIM_BUF_LEN + 8];
+    memset(big,' ',sizeof(big));
+    memcpy(big,"1|2|3|4|5|6",11);
+    hostFileSet(LIM_FILE,big,sizeof(big));
+    progs before = vessels[0].programs;
+    strToProg();
+    CHECK_EQ(vessels[0].programs.fermentation_min,before.fermentation_min);
+    CHECK_EQ(vessels[0].programs.priming_max,before.priming_max);
+
+    const char *ok = "1|2|3|4|5|6";
+    hostFileSet(LIM_FILE,ok,strlen(ok));
+    strToProg();
+    CHECK_EQ(vessels[0].programs.fermentation_min,100);
+    CHECK_EQ(vessels[0].programs.priming_max,600);
+    vessels[0].programs = before;
+}
+
+TEST(parse_centi_round_trip){
+    //todo valor valido sobrevive a formatCenti + parseCenti
+    char buf[8];
+    int  bad = 0;
+    host_allocs = 0;
+    for (int32_t v=CENTI_MIN;v<=CENTI_MAX;v++){
+        centi_t out;
+        size_t  n = formatCenti(buf,v);
+        if (parseCenti(buf,n,&out) != PARSE_OK || out != v){
+            bad++;
+        }
+    }
+    CHECK_EQ(bad,0);
+    CHECK_EQ(host_allocs,0);
+}
+
+TEST(parse_fuzz){
+    //bytes aleatorios do alfabeto do formato: sem crash, sem heap, saida na faixa
+    static const char alphabet[] = "0123456789.-+| \tFMPx";
+    char     buf[40];
+    uint32_t seed = 12345;
+    int      ok = 0, out_of_range = 0;
+    host_allocs = 0;
+    for (int i=0;i<200000;i++){
+        seed = seed*1103515245 + 12345;
+        size_t len = (seed >> 16) % sizeof(buf);
+        for (size_t k=0;k<len;k++){
+            seed   = seed*1103515245 + 12345;
+            buf[k] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        }
+        centi_t min, max, lim[LIMITS_LEN];
+        char    prog;
+        if (parseCenti(buf,len,&min) == PARSE_OK){
+            ok++;
+            out_of_range += min < CENTI_MIN || min > CENTI_MAX;
+        }
+        if (parseMinMax(buf,len,&min,&max,&prog) == PARSE_OK){
+            out_of_range += min > max;
+        }
+        parseLimits(buf,len,lim);
+    }
+    CHECK(ok > 0);
+    CHECK_EQ(out_of_range,0);
+    CHECK_EQ(host_allocs,0);
+}
+
+TEST(parse_bench){
+    const char *msg = "13.5|14.5|M";
+    const char *lim = "19|22|1|2|20|22.5";
+    const int   runs = 1000000;
+    centi_t     min, max, out[LIMITS_LEN];
+    char        prog;
+    host_allocs = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i=0;i<runs;i++){
+        parseMinMax(msg,strlen(msg),&min,&max,&prog);
+        parseLimits(lim,strlen(lim),out);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double,std::nano>(t1 - t0).count() / runs;
+    printf("  minMax + limits: %.0f ns por par no host, %lu alocacoes\n",ns,host_allocs);
+    CHECK_EQ(host_allocs,0);
+}
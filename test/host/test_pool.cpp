@@ -0,0 +1,88 @@
+/*! \file test_pool.cpp
+ *  \brief Buffers grandes saem do pool: telemetria, relatorio de STATS e
+ *  arquivos zerados
+ */
+#define STATS
+#include "host.h"
+
+//! Mensagens publicadas em topic, na ordem.
+static std::vector<std::string> messages(const char *topic){
+    std::vector<std::string> out;
+    for (size_t i=0;i<host_published.size();i++){
+        if (host_published[i].topic == topic){
+            out.push_back(std::string(host_published[i].payload.begin(),host_published[i].payload.end()));
+        }
+    }
+    return out;
+}
+
+TEST(telemetry_waits_for_a_block){
+    clock_synced = true;
+    host_unix    = 1700000000;
+    telemetryAdd(0,1234);
+    //os dois blocos presos: o lote fica para a proxima vez
+    void *a = poolAlloc();
+    void *b = poolAlloc();
+    telemetryFlush();
+    CHECK_EQ(telemetry_count,1);
+    CHECK(messages("freezer/telemetry").empty());
+    poolFree(a);
+    poolFree(b);
+    telemetryFlush();
+    CHECK_EQ(telemetry_count,0);
+    CHECK_EQ(messages("freezer/telemetry").size(),1);
+    CHECK_EQ(pool_used,0);
+}
+
+TEST(stats_split_in_whole_lines){
+    //inDrain() segura um bloco enquanto o handler de beer/stats roda
+    poolBuf msg;
+    statsPublish(false);
+    std::vector<std::string> m = messages("freezer/stats");
+    CHECK(m.size() > 1);
+    std::string all;
+    bool fits  = true;
+    bool whole = true;
+    for (size_t i=0;i<m.size();i++){
+        fits  = fits && m[i].size() < POOL_BLOCK;
+        whole = whole && (i + 1 == m.size() || m[i][m[i].size() - 1] == '\n');
+        all  += m[i];
+    }
+    CHECK(fits);
+    CHECK(whole);
+    //o relatorio chega inteiro, da primeira a ultima linha
+    CHECK_EQ(all.find(stats_names[0]),0);
+    CHECK(all.find("pool blocks=") != std::string::npos);
+    CHECK(all.find("mqtt attempts=") != std::string::npos);
+    CHECK_EQ(pool_used,1);
+}
+
+TEST(stats_without_block_keeps_counters){
+    tasks[TASK_CONTROL].runs = 5;
+    void *a = poolAlloc();
+    void *b = poolAlloc();
+    uint32_t fail = pool_fail;
+    statsPublish(true);
+    CHECK(messages("freezer/stats").empty());
+    CHECK_EQ(pool_fail,fail + 1);
+    CHECK_EQ(tasks[TASK_CONTROL].runs,5);
+    poolFree(a);
+    poolFree(b);
+    tasks[TASK_CONTROL].runs = 0;
+}
+
+TEST(presize_fills_zeros_from_pool){
+    char name[28];
+    histFile(0,60,name,sizeof(name));
+    histPrepare(0,60);
+    hostRun(HIST_1M_SLOTS*sizeof(histBucket) / POOL_BLOCK * SCHED_TICK_MS + 10*SCHED_TICK_MS);
+    CHECK(fileExist(name));
+    CHECK_EQ(fileGetSize(name),HIST_1M_SLOTS*sizeof(histBucket));
+    const std::vector<uint8_t> &img = host_fs[name];
+    bool zero = true;
+    for (size_t i=0;i<img.size();i++){
+        zero = zero && img[i] == 0;
+    }
+    CHECK(zero);
+    CHECK_EQ(pool_used,0);
+}
@@ -0,0 +1,64 @@
+/*! \file test_power.cpp
+ *  \brief Baixo consumo: janelas de rede, tempo de radio e reconexao leve
+ */
+#include "host.h"
+
+//! Boot com radio ligado desde host_ms = 0.
+static void powerReset(){
+    power_radio       = true;
+    power_radio_since = 0;
+    power_radio_ms    = 0;
+    power_hour_start  = 0;
+    power_hour_base   = 0;
+    power_last_hour   = 0;
+    power_windows     = 0;
+    outbox_pending    = false;
+}
+
+static size_t count(const char *topic){
+    size_t n = 0;
+    for (size_t i=0;i<host_published.size();i++){
+        n += host_published[i].topic == topic;
+    }
+    return n;
+}
+
+TEST(low_power_windows){
+    powerReset();
+    powerSet(POWER_LOW,POWER_PERIOD_S,POWER_WINDOW_S);
+    hostRun(POWER_WINDOW_S*1000 + SCHED_TICK_MS);
+    CHECK(!power_radio);
+    CHECK(!host_wifi_on);
+    CHECK(!mqttOnline());
+
+    hostRun((POWER_PERIOD_S - POWER_WINDOW_S)*1000);
+    CHECK(power_radio);
+    CHECK_EQ(power_windows,1);
+    CHECK_EQ(host_wifi_connects,1);
+
+    //uma hora: a janela inicial e mais 11, de POWER_WINDOW_S cada
+    hostRun(3600000 - POWER_PERIOD_S*1000);
+    CHECK_EQ(power_windows,12);
+    CHECK_EQ(power_last_hour,12*POWER_WINDOW_S*1000);
+}
+
+TEST(wake_does_not_list_files){
+    powerReset();
+    hostFileSet("/flash/a.bin","x",1);
+    files_dirty = true;
+    powerSet(POWER_LOW,POWER_PERIOD_S,POWER_WINDOW_S);
+    hostRun(5*POWER_PERIOD_S*1000);
+    CHECK_EQ(host_wifi_connects,5);
+    //nenhuma janela passou pelo SPIFFS para listar arquivos
+    CHECK(files_dirty);
+    CHECK(host_serial.find("Listando") == std::string::npos);
+}
+
+TEST(latency_keeps_radio_and_alive){
+    powerReset();
+    powerSet(POWER_LATENCY,POWER_PERIOD_S,POWER_WINDOW_S);
+    hostRun(6*ALIVE_MS);
+    CHECK(power_radio);
+    CHECK_EQ(host_wifi_connects,0);
+    CHECK_EQ(count("freezer/alive"),6);
+}
@@ -0,0 +1,174 @@
+/*! \file test_profile.cpp
+ *  \brief Perfil de 3 semanas com relogio acelerado: TASK_PROFILE roda uma
+ *  vez por minuto simulado e a faixa e comparada com um modelo de referencia
+ *  em todos os minutos, com partidas quente (RTC) e fria (configuracoes) no
+ *  meio
+ */
+#include <math.h>
+#include "host.h"
+
+//! 4 dias em 18..19, 1 dia de rampa ate 22..23 e 2 dias nela, 3 dias de
+//! rampa ate 1..2 e 11 dias nela: 21 dias.
+static const char *const PROFILE_MSG = "18|19|96|0;22|23|48|4;1|2|264|7";
+
+#define H 3600UL
+
+//! Passos do perfil, como o teste os entende.
+struct refStep{
+    int32_t  min;
+    int32_t  max;
+    uint32_t hold_s;
+    int32_t  ramp; //centesimos por dia
+};
+static const refStep ref_steps[] = {
+    {1800,1900, 96*H,  0},
+    {2200,2300, 48*H,400},
+    { 100, 200,264*H,700},
+};
+#define REF_STEPS (sizeof(ref_steps)/sizeof(ref_steps[0]))
+
+//! Inicio de cada passo e fim de cada rampa, em segundos desde o inicio.
+static uint32_t ref_begin[REF_STEPS + 1];
+static uint32_t ref_ramp_end[REF_STEPS];
+
+static void refBuild(){
+    uint32_t t = 0;
+    for (size_t i=0;i<REF_STEPS;i++){
+        uint32_t ramp = 0;
+        if (i > 0 && ref_steps[i].ramp > 0){
+            int32_t delta = (ref_steps[i].min + ref_steps[i].max)/2 - (ref_steps[i-1].min + ref_steps[i-1].max)/2;
+            ramp = (uint32_t)abs(delta) * 86400 / ref_steps[i].ramp;
+        }
+        ref_begin[i]    = t;
+        ref_ramp_end[i] = t + ramp;
+        t += ramp + ref_steps[i].hold_s;
+    }
+    ref_begin[REF_STEPS] = t;
+}
+
+//! Faixa esperada s segundos depois do inicio do perfil.
+static void refBand(uint32_t s, int32_t *min, int32_t *max){
+    size_t i = 0;
+    while (i < REF_STEPS && s >= ref_begin[i+1]){
+        i++;
+    }
+    if (i == REF_STEPS){
+        *min = ref_steps[REF_STEPS-1].min;
+        *max = ref_steps[REF_STEPS-1].max;
+        return;
+    }
+    if (s >= ref_ramp_end[i]){
+        *min = ref_steps[i].min;
+        *max = ref_steps[i].max;
+        return;
+    }
+    double f = (double)(s - ref_begin[i]) / (ref_ramp_end[i] - ref_begin[i]);
+    *min = lround(ref_steps[i-1].min + f*(ref_steps[i].min - ref_steps[i-1].min));
+    *max = lround(ref_steps[i-1].max + f*(ref_steps[i].max - ref_steps[i-1].max));
+}
+
+static uint32_t t0;
+
+//! Um minuto simulado: relogio e millis() andam PROFILE_TICK_MS e o
+//! escalonador roda uma vez (TASK_PROFILE e a gravacao das configuracoes).
+static void minute(){
+    host_unix += PROFILE_TICK_MS/1000;
+    host_ms   += PROFILE_TICK_MS;
+    schedTick();
+}
+
+//! Diferenca, em centesimos, entre a faixa ativa e a de referencia.
+static int32_t bandError(){
+    int32_t min, max;
+    refBand(host_unix - t0,&min,&max);
+    return std::max(abs(vessels[0].temp_min - min),abs(vessels[0].temp_max - max));
+}
+
+//! Reset com a RAM perdida; o RTC so sobrevive se warm.
+static void reboot(bool warm){
+    memset(&profiles[0],0,sizeof(profiles[0]));
+    vessels[0].temp_min = 0;
+    vessels[0].temp_max = 0;
+    memset(tasks,0,sizeof(tasks));
+    if (warm){
+        CHECK(rtcRestore());
+    }
+    else{
+        memset(host_rtc,0,sizeof(host_rtc));
+        CHECK(!rtcRestore());
+        settingsLoad();
+    }
+    taskStart(TASK_PROFILE,profileTickAll,PROFILE_TICK_MS,PROFILE_TICK_MS);
+}
+
+TEST(three_weeks_minute_by_minute){
+    refBuild();
+    CHECK_EQ(ref_begin[REF_STEPS],21*24*H);
+    settingsLoad();
+    clock_synced = true;
+    t0 = host_unix = 1700000000;
+    CHECK_EQ(profileStart(0,PROFILE_MSG,strlen(PROFILE_MSG)),PARSE_OK);
+    CHECK_EQ(profiles[0].start,t0);
+    taskStart(TASK_PROFILE,profileTickAll,PROFILE_TICK_MS,PROFILE_TICK_MS);
+
+    //reboots: quente no meio da primeira rampa, frio apos 6 h sem energia
+    //no meio da segunda, frio de novo na espera final
+    const uint32_t warm_at  = 108*H;
+    const uint32_t cold_at  = 200*H;
+    const uint32_t cold_off = 6*H;
+    const uint32_t cold2_at = 400*H;
+
+    int32_t  worst   = 0;
+    uint32_t minutes = 0;
+    bool     steps_ok = true;
+    while (host_unix - t0 < ref_begin[REF_STEPS] + 2*H){
+        minute();
+        uint32_t s = host_unix - t0;
+        minutes++;
+        worst = std::max(worst,bandError());
+
+        //cada troca de passo acontece no minuto exato
+        for (size_t i=1;i<=REF_STEPS;i++){
+            uint8_t want = i < REF_STEPS ? i : PROFILE_NONE;
+            if (s == ref_begin[i] - PROFILE_TICK_MS/1000){
+                steps_ok = steps_ok && profiles[0].step == i - 1;
+            }
+            if (s == ref_begin[i]){
+                steps_ok = steps_ok && profiles[0].step == want;
+            }
+        }
+        //pontas das rampas: comeca na faixa anterior e termina na alvo
+        for (size_t i=1;i<REF_STEPS;i++){
+            if (s == ref_begin[i]){
+                CHECK_EQ(vessels[0].temp_min,ref_steps[i-1].min);
+                CHECK_EQ(vessels[0].temp_max,ref_steps[i-1].max);
+            }
+            if (s == ref_ramp_end[i]){
+                CHECK_EQ(vessels[0].temp_min,ref_steps[i].min);
+                CHECK_EQ(vessels[0].temp_max,ref_steps[i].max);
+            }
+        }
+
+        if (s == warm_at){
+            reboot(true);
+            //a faixa da rampa volta do RTC antes do primeiro tick
+            CHECK(bandError() <= 1);
+        }
+        if (s == cold_at || s == cold2_at){
+            reboot(false);
+            CHECK_EQ(profiles[0].step,2);
+            if (s == cold_at){
+                //a energia volta 6 h depois; ate o tick vale a faixa alvo
+                host_unix += cold_off;
+                host_ms   += cold_off*1000;
+                CHECK_EQ(vessels[0].temp_min,ref_steps[2].min);
+            }
+        }
+    }
+    printf("  %u minutos simulados, erro maximo da faixa %d centesimo(s)\n",minutes,worst);
+    CHECK(steps_ok);
+    CHECK(worst <= 1);
+    CHECK_EQ(profiles[0].step,PROFILE_NONE);
+    CHECK_EQ(vessels[0].temp_min,100);
+    CHECK_EQ(vessels[0].temp_max,200);
+}
@@ -0,0 +1,101 @@
+/*! \file test_relay.cpp
+ *  \brief Pulso do rele com o callback do MQTT inundado: o callback nao
+ *  espera o pulso e o pulso segue a sequencia original
+ */
+#include <chrono>
+#include "host.h"
+
+#define FLOOD_PER_TICK 40 //mensagens por tick de SCHED_TICK_MS (4000/s)
+
+//! Transicao de um pino, em ms desde o pedido do pulso.
+struct edge{
+    uint8_t  pin;
+    uint8_t  level;
+    uint32_t at;
+};
+
+//! Anota as mudancas de nivel dos dois reles da cuba 0.
+static void sample(std::vector<edge> &edges, uint8_t *last, uint32_t t0){
+    for (uint8_t k=0;k<2;k++){
+        uint8_t pin = vessels[0].pins[k];
+        if (host_pins[pin] != last[k]){
+            last[k] = host_pins[pin];
+            edges.push_back({k,last[k],host_ms - t0});
+        }
+    }
+}
+
+TEST(flood_during_pulse){
+    settingsLoad();
+    relayInit();
+    for (uint8_t k=0;k<2;k++){
+        relaySet(relayOf(0,k),LOW);
+    }
+    ctrl_cfg[0].min_on_s  = 0;
+    ctrl_cfg[0].min_off_s = 0;
+    vessels[0].temp_min   = 1800;
+    vessels[0].temp_max   = 1900;
+    taskStart(TASK_CONTROL,ctrlTick,CTRL_TICK_MS,CTRL_TICK_MS);
+    host_ms = 100000;
+
+    const char *topics[] = {"beer/temperature","beer/ls","beer/nothing","beer/telemetry"};
+    const char *msgs[]   = {"19.50","","x","60"};
+    uint8_t  last[2] = {LOW,LOW};
+    std::vector<edge> edges;
+    relaySeq &pulse = relayOf(0,RELAY_TWO);
+    uint32_t armed_ms = 0;
+    uint32_t t0       = 0;
+    bool     clock_still = true;
+    double   worst_ns = 0, total_ns = 0;
+    unsigned long calls = 0;
+    uint32_t processed = in_processed;
+
+    //leitura acima da faixa: o proximo ctrlTick liga o compressor e pede o pulso
+    onMessageReceived(String("beer/temperature"),String("19.50"));
+    for (uint32_t t=0;t<CTRL_TICK_MS + 3000;t+=SCHED_TICK_MS){
+        for (int i=0;i<FLOOD_PER_TICK;i++){
+            uint32_t before = host_ms;
+            auto a = std::chrono::steady_clock::now();
+            onMessageReceived(String(topics[i % 4]),String(msgs[i % 4]));
+            auto b = std::chrono::steady_clock::now();
+            double ns = std::chrono::duration<double,std::nano>(b - a).count();
+            worst_ns  = std::max(worst_ns,ns);
+            total_ns += ns;
+            calls++;
+            //o callback nunca espera o relogio andar
+            clock_still = clock_still && host_ms == before;
+        }
+        hostRun(SCHED_TICK_MS);
+        if (t0 == 0 && host_pins[vessels[0].pins[0]] == HIGH){
+            t0       = host_ms;
+            armed_ms = host_ms;
+        }
+        //o Timer do rele de pulso dispara quando vence o passo
+        if (pulse.busy && host_ms - armed_ms >= pulse.timer.getIntervalMs()){
+            pulse.timer.fire();
+            armed_ms = host_ms;
+        }
+        sample(edges,last,t0);
+    }
+    printf("  callback: %lu chamadas, media %.0f ns, pior %.0f ns no host\n",calls,total_ns / calls,worst_ns);
+    CHECK(clock_still);
+    //o callback so copia para o anel: microssegundos, nao os 1800 ms do pulso
+    CHECK(total_ns / calls < 20000);
+    CHECK(worst_ns < 300e6);
+    //e a fila continua andando durante o pulso
+    CHECK(in_processed > processed);
+
+    //sequencia original: compressor, 300 ms, pulso ligado por 1500 ms
+    CHECK(t0 != 0);
+    CHECK_EQ(edges.size(),3);
+    if (edges.size() == 3){
+        CHECK(edges[0].pin == RELAY_ONE && edges[0].level == HIGH && edges[0].at == 0);
+        CHECK(edges[1].pin == RELAY_TWO && edges[1].level == HIGH);
+        CHECK(edges[2].pin == RELAY_TWO && edges[2].level == LOW);
+        CHECK(edges[1].at >= 300 && edges[1].at <= 300 + SCHED_TICK_MS);
+        CHECK(edges[2].at - edges[1].at >= 1500 && edges[2].at - edges[1].at <= 1500 + SCHED_TICK_MS);
+    }
+    CHECK(!relayBusy(pulse));
+    CHECK_EQ(host_pins[vessels[0].pins[0]],HIGH);
+    relaySet(relayOf(0,RELAY_ONE),LOW);
+}
@@ -0,0 +1,58 @@
+/*! \file test_rtc.cpp
+ *  \brief Partida quente: bloco do RTC e limites lidos do SPIFFS
+ */
+#include "host.h"
+
+TEST(rtc_block_fits_max_vessels){
+    size_t block = offsetof(rtcState,state) + MAX_VESSELS*sizeof(rtcVessel) + sizeof(uint32_t);
+    CHECK(RTC_BLOCK*4 + block <= sizeof(host_rtc));
+    //o bloco de hoje cabe na area do usuario
+    CHECK(system_rtc_mem_write(RTC_BLOCK,&rtc_buf,sizeof(rtc_buf)));
+}
+
+TEST(rtc_round_trip){
+    settingsLoad();
+    vessels[0].programs.maturation_min = 130;
+    defineProgram(0,'M');
+    const char *msg = "3|5|2|0;1|2|0|0";
+    CHECK_EQ(profileStart(0,msg,strlen(msg)),PARSE_OK);
+    profileTick(0,1700000000);
+    ctrl_cfg[0].hysteresis = 40;
+    relayWrite(relayOf(0,RELAY_ONE),HIGH);
+    hostRun(SETTINGS_COALESCE_MS + 100);
+    rtcSave();
+
+    //reset: RAM de volta ao valor de compilacao, RTC e flash preservados
+    profileState saved = profiles[0];
+    memset(&profiles[0],0,sizeof(profiles[0]));
+    memset(&ctrl_cfg[0],0,sizeof(ctrl_cfg[0]));
+    vessels[0].programs = DEFAULT_PROGS;
+    vessels[0].temp_min = 0;
+    relayOf(0,RELAY_ONE).level = LOW;
+
+    CHECK(rtcRestore());
+    CHECK_EQ(vessels[0].program,'M');
+    CHECK_EQ(vessels[0].temp_min,300);
+    CHECK_EQ(vessels[0].temp_max,500);
+    CHECK_EQ(ctrl_cfg[0].hysteresis,40);
+    CHECK_EQ(profiles[0].step,saved.step);
+    CHECK_EQ(profiles[0].start,1700000000u);
+    CHECK_EQ(profiles[0].cur.hold_h,2);
+    CHECK_EQ(profiles[0].from_max,saved.from_max);
+    CHECK_EQ(relayOf(0,RELAY_ONE).level,HIGH);
+
+    //os limites ficam fora do RTC e voltam do registro de configuracoes
+    CHECK_EQ(vessels[0].programs.maturation_min,100);
+    settingsLoadLimits();
+    CHECK_EQ(vessels[0].programs.maturation_min,130);
+    relayWrite(relayOf(0,RELAY_ONE),LOW);
+}
+
+TEST(rtc_cold_when_corrupt){
+    rtcSave();
+    CHECK(rtcRestore());
+    host_rtc[RTC_BLOCK*4 + 9] ^= 1;
+    CHECK(!rtcRestore());
+    memset(host_rtc,0,sizeof(host_rtc));
+    CHECK(!rtcRestore());
+}
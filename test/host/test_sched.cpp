@@ -0,0 +1,112 @@
+/*! \file test_sched.cpp
+ *  \brief Escalonador: prioridade, fatia da manutencao, periodo sem deriva e
+ *  arquivos pre-alocados aos pedacos
+ */
+#include "host.h"
+
+static std::vector<int> order;
+
+template<int id> static void mark(){
+    order.push_back(id);
+}
+
+TEST(due_tasks_run_by_priority){
+    order.clear();
+    //agendadas fora de ordem, vencem no mesmo tick
+    taskStart(TASK_CONSOLE,mark<TASK_CONSOLE>,0,0);
+    taskStart(TASK_OUTBOX,mark<TASK_OUTBOX>,0,0);
+    taskStart(TASK_CONTROL,mark<TASK_CONTROL>,0,0);
+    taskStart(TASK_MQTT,mark<TASK_MQTT>,0,0);
+    taskStart(TASK_SENSOR,mark<TASK_SENSOR>,0,0);
+    hostRun(SCHED_TICK_MS);
+    CHECK_EQ(order.size(),5);
+    bool sorted = true;
+    for (size_t i=1;i<order.size();i++){
+        sorted = sorted && order[i-1] < order[i];
+    }
+    CHECK(sorted);
+    CHECK(!taskActive(TASK_CONTROL));
+}
+
+//! Controle que gasta mais que a fatia do tick.
+static void slowControl(){
+    order.push_back(TASK_CONTROL);
+    host_us += SCHED_SLICE_US + 1;
+}
+
+TEST(housekeeping_waits_for_next_tick){
+    order.clear();
+    uint32_t deferred = sched_deferred;
+    taskStart(TASK_CONTROL,slowControl,0,0);
+    taskStart(TASK_PROFILE,mark<TASK_PROFILE>,0,0);
+    taskStart(TASK_LOG,mark<TASK_LOG>,0,0);
+    hostRun(SCHED_TICK_MS);
+    //a tarefa de controle seguinte roda; a de manutencao fica para depois
+    CHECK(order.size() == 2 && order[1] == TASK_PROFILE);
+    CHECK_EQ(sched_deferred,deferred + 1);
+    CHECK(taskActive(TASK_LOG));
+    hostRun(SCHED_TICK_MS);
+    CHECK(order.size() == 3 && order[2] == TASK_LOG);
+}
+
+TEST(period_without_drift){
+    order.clear();
+    taskStart(TASK_STATS,mark<TASK_STATS>,100,100);
+    hostRun(1000);
+    CHECK_EQ(order.size(),10);
+    CHECK_EQ(tasks[TASK_STATS].late_max_ms,0);
+}
+
+TEST(presize_in_pieces){
+    uint32_t writes = host_writes;
+    histBegin();
+    anaBegin();
+    //nada gravado no boot
+    CHECK_EQ(host_writes,writes);
+    CHECK(taskActive(TASK_PRESIZE));
+    char m1[28];
+    char m15[28];
+    histFile(0,60,m1,sizeof(m1));
+    histFile(0,900,m15,sizeof(m15));
+    uint32_t size1  = HIST_1M_SLOTS*sizeof(histBucket);
+    uint32_t size15 = HIST_15M_SLOTS*sizeof(histBucket);
+    uint32_t sizea  = ANA_DAYS*MAX_VESSELS*sizeof(anaDay);
+
+    //um bloco por tick; o arquivo so aparece pronto
+    hostRun(SCHED_TICK_MS);
+    CHECK_EQ(host_writes,writes + 1);
+    CHECK(!fileExist(m1));
+    histWrite(0,60,{60,1,1,1,1,0});
+    CHECK(!fileExist(m1));
+
+    uint32_t blocks = (size1 + POOL_BLOCK - 1) / POOL_BLOCK + (size15 + POOL_BLOCK - 1) / POOL_BLOCK +
+                      (sizea + POOL_BLOCK - 1) / POOL_BLOCK;
+    hostRun(blocks * SCHED_TICK_MS);
+    CHECK_EQ(host_writes,writes + blocks);
+    CHECK_EQ(fileGetSize(m1),size1);
+    CHECK_EQ(fileGetSize(m15),size15);
+    CHECK_EQ(fileGetSize(ANA_FILE),sizea);
+    CHECK(!fileExist(PRESIZE_TMP));
+    CHECK(!taskActive(TASK_PRESIZE));
+
+    //segundo boot: nada a fazer
+    histBegin();
+    anaBegin();
+    CHECK(!taskActive(TASK_PRESIZE));
+}
+
+TEST(presize_power_cut_restarts){
+    histBegin();
+    hostRun(5*SCHED_TICK_MS);
+    //reset no meio: a RAM volta ao zero, o temporario fica
+    presize_count = 0;
+    presize_done  = 0;
+    taskStop(TASK_PRESIZE);
+    CHECK(fileExist(PRESIZE_TMP));
+    histBegin();
+    hostRun(100*SCHED_TICK_MS);
+    char m1[28];
+    histFile(0,60,m1,sizeof(m1));
+    CHECK_EQ(fileGetSize(m1),HIST_1M_SLOTS*sizeof(histBucket));
+    CHECK(!fileExist(PRESIZE_TMP));
+}
@@ -0,0 +1,144 @@
+/*! \file test_sensor.cpp
+ *  \brief Sensor local (SENSOR_PIN) pelo DS18S20 emulado: filtro, queda do
+ *  sensor, o 85.00 do power-on reset e o custo de uma amostra no host
+ */
+#define SENSOR_PIN 4
+#include <chrono>
+#include "host.h"
+
+//! Sensor presente lendo c graus, filtro vazio e TASK_SENSOR armada.
+static void sensorReset(float c){
+    memset(&sensor,0,sizeof(sensor));
+    host_celsius       = c;
+    host_sensor_ok     = true;
+    host_sensor_busy   = false;
+    host_sensor_starts = 0;
+    vessels[0].reading_ms = 0;
+    vessels[0].last_temp  = INT16_MIN;
+    host_ms = 1000;
+    sensorBegin();
+}
+
+//! Uma amostra de TASK_SENSOR lendo c graus.
+static void sampleAt(float c){
+    host_celsius = c;
+    hostRun(SENSOR_PERIOD_MS);
+}
+
+TEST(filter_median_and_ema){
+    sensorReset(20.0f);
+    hostRun(3*SENSOR_PERIOD_MS);
+    CHECK(sensorActive());
+    CHECK_EQ(vessels[0].last_temp,2000);
+    //um espinho isolado nao passa da mediana
+    sampleAt(23.5f);
+    CHECK_EQ(vessels[0].last_temp,2000);
+    sampleAt(20.0f);
+    sampleAt(20.0f);
+    CHECK_EQ(vessels[0].last_temp,2000);
+    //degrau de 1 grau: a media chega em poucas amostras, sem passar
+    int samples = 0;
+    while (vessels[0].last_temp < 2095 && samples < 30){
+        sampleAt(21.0f);
+        CHECK(vessels[0].last_temp <= 2100);
+        samples++;
+    }
+    CHECK(samples >= 3 && samples <= 15);
+    CHECK_EQ(host_sensor_starts,1 + 6 + samples);
+}
+
+TEST(outlier_then_real_step){
+    sensorReset(20.0f);
+    hostRun(3*SENSOR_PERIOD_MS);
+    //um degrau de 5 graus: a mediana so o ve na segunda amostra, que e
+    //rejeitada com as seguintes ate SENSOR_MAX_REJECT e depois aceita como real
+    sampleAt(25.0f);
+    CHECK_EQ(vessels[0].last_temp,2000);
+    uint32_t reading = vessels[0].reading_ms;
+    for (int i=0;i<SENSOR_MAX_REJECT;i++){
+        sampleAt(25.0f);
+    }
+    CHECK_EQ(vessels[0].reading_ms,reading);
+    CHECK_EQ(vessels[0].last_temp,2000);
+    sampleAt(25.0f);
+    CHECK_EQ(vessels[0].last_temp,2500);
+    CHECK_EQ(vessels[0].reading_ms,host_ms);
+}
+
+TEST(power_on_value_rejected){
+    //primeira conversao depois de um power-on reset: 85.00 nunca vira a media
+    sensorReset(85.0f);
+    hostRun(3*SENSOR_PERIOD_MS);
+    CHECK(!sensorActive());
+    CHECK_EQ(vessels[0].reading_ms,0);
+    CHECK(!sensor.has_ema);
+    sampleAt(19.0f);
+    CHECK(sensorActive());
+    CHECK_EQ(vessels[0].last_temp,1900);
+    //quedas repetidas no meio da fermentacao: nem como degrau real
+    for (int i=0;i<3*SENSOR_MAX_REJECT;i++){
+        sampleAt(85.0f);
+    }
+    CHECK_EQ(vessels[0].last_temp,1900);
+    CHECK_EQ(sensor.rejected,0);
+    //85.01 e uma leitura (absurda, mas real) e segue o caminho do filtro
+    sampleAt(85.01f);
+    CHECK_EQ(vessels[0].last_temp,1900);
+    CHECK_EQ(sensor.rejected,1);
+}
+
+TEST(dropout_hands_over_to_mqtt){
+    settingsLoad();
+    sensorReset(18.0f);
+    hostRun(3*SENSOR_PERIOD_MS);
+    CHECK(sensorActive());
+    //com o sensor local valido beer/temperature nao comanda a cuba 0
+    onMessageReceived(String("beer/temperature"),String("30.00"));
+    hostRun(SCHED_TICK_MS);
+    CHECK_EQ(vessels[0].last_temp,1800);
+
+    //sensor some do barramento; conversao presa nao trava a tarefa
+    host_sensor_ok = false;
+    hostRun(SENSOR_STALE_MS - 2*SENSOR_PERIOD_MS);
+    CHECK(sensorActive());
+    host_sensor_ok   = true;
+    host_sensor_busy = true;
+    hostRun(3*SENSOR_PERIOD_MS);
+    CHECK(!sensorActive());
+    CHECK_EQ(vessels[0].last_temp,1800);
+    onMessageReceived(String("beer/temperature"),String("30.00"));
+    hostRun(SCHED_TICK_MS);
+    CHECK_EQ(vessels[0].last_temp,3000);
+
+    //sensor de volta: retoma a cuba 0 na primeira amostra
+    host_sensor_busy = false;
+    sampleAt(18.0f);
+    CHECK(sensorActive());
+    CHECK(vessels[0].last_temp < 3000);
+}
+
+TEST(sensor_bench){
+    //amostra completa (leitura, filtro, processReading, publicacao) no host
+    sensorReset(20.0f);
+    hostRun(3*SENSOR_PERIOD_MS);
+    const int n = 200000;
+    host_allocs = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        host_celsius = 20.0f + (i % 7) * 0.01f;
+        host_ms += SENSOR_PERIOD_MS;
+        sensorSample();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    centi_t out;
+    auto t2 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        sensorFilter(2000 + i % 7,&out);
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    double sample_ns = std::chrono::duration<double,std::nano>(t1 - t0).count() / n;
+    double filter_ns = std::chrono::duration<double,std::nano>(t3 - t2).count() / n;
+    printf("  sensor: %.0f ns por amostra, %.1f ns no filtro, %lu alocacoes\n",sample_ns,filter_ns,host_allocs);
+    CHECK(sensorActive());
+    CHECK(filter_ns < sample_ns);
+}
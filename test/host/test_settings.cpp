@@ -0,0 +1,201 @@
+/*! \file test_settings.cpp
+ *  \brief Queda de energia durante a gravacao dos slots e migracao para v4
+ */
+#include "host.h"
+
+typedef std::map<std::string,std::vector<uint8_t> > hostFs;
+
+//! Grava o registro atual com fermentation_min = value.
+static void flushValue(centi_t value){
+    vessels[0].programs.fermentation_min = value;
+    settingsFlush();
+}
+
+//! Carrega do zero e devolve fermentation_min.
+static centi_t loadValue(){
+    vessels[0].programs.fermentation_min = 0;
+    settingsLoad();
+    return vessels[0].programs.fermentation_min;
+}
+
+//! Corta a energia em cada byte da gravacao seguinte; vale o slot anterior.
+static void powerCutEveryOffset(int slots_before){
+    settingsLoad();
+    for (int i=0;i<slots_before;i++){
+        flushValue(1000 + i);
+    }
+    centi_t old  = 1000 + slots_before - 1;
+    hostFs  disk = host_fs;
+    uint32_t seq = settings_seq;
+    int      bad = 0;
+    for (long cut=0;cut<(long)sizeof(settingsRecord);cut++){
+        host_fs       = disk;
+        settings_seq  = seq;
+        host_write_budget = cut;
+        flushValue(1234);
+        host_write_budget = -1;
+        if (settings_seq != seq || loadValue() != old){
+            bad++;
+        }
+    }
+    CHECK_EQ(bad,0);
+
+    //gravacao completa: vale o novo
+    host_fs      = disk;
+    settings_seq = seq;
+    flushValue(1234);
+    CHECK_EQ(settings_seq,seq + 1);
+    CHECK_EQ(loadValue(),1234);
+}
+
+TEST(power_cut_first_slot){
+    //slot A valido, corte gravando o B
+    powerCutEveryOffset(1);
+}
+
+TEST(power_cut_both_slots_valid){
+    //A e B validos, corte regravando o mais antigo
+    powerCutEveryOffset(2);
+    powerCutEveryOffset(3);
+}
+
+TEST(corrupt_every_byte){
+    //qualquer byte trocado no slot novo faz valer o anterior
+    settingsLoad();
+    flushValue(1100);
+    flushValue(1200);
+    const char *newest = (settings_seq & 1) ? SET_FILE_B : SET_FILE_A;
+    hostFs disk = host_fs;
+    int    bad  = 0;
+    for (size_t i=0;i<sizeof(settingsRecord);i++){
+        host_fs = disk;
+        host_fs[newest][i] ^= 0x10;
+        if (loadValue() != 1100){
+            bad++;
+        }
+    }
+    CHECK_EQ(bad,0);
+}
+
+TEST(no_valid_slot_falls_back_to_ini){
+    //slot unico corrompido: valem os limites do limits.ini antigo
+    settingsLoad();
+    flushValue(1300);
+    CHECK(!fileExist(SET_FILE_A));
+    host_fs[SET_FILE_B][10] ^= 1;
+    const char *ini = "17|18|1|2|20|22";
+    hostFileSet(LIM_FILE,ini,strlen(ini));
+    CHECK_EQ(loadValue(),1700);
+    //e a migracao ja grava um slot novo
+    hostRun(SETTINGS_COALESCE_MS + 100);
+    host_fs.erase(LIM_FILE);
+    CHECK_EQ(loadValue(),1700);
+}
+
+//! Grava um registro antigo com CRC no final.
+static void writeOld(const char *file, const void *rec, size_t size){
+    std::vector<uint8_t> img((const uint8_t*)rec,(const uint8_t*)rec + size);
+    uint32_t crc = crc32(&img[0],size - 4);
+    memcpy(&img[size - 4],&crc,4);
+    host_fs[file] = img;
+}
+
+//! Depois de migrar, a proxima gravacao ja e da versao 4 e le de volta igual.
+static void checkRewrittenAsV4(){
+    settingsFlush();
+    const char *file = (settings_seq & 1) ? SET_FILE_B : SET_FILE_A;
+    CHECK_EQ(host_fs[file].size(),sizeof(settingsRecord));
+    CHECK_EQ(host_fs[file][2],SETTINGS_VERSION);
+    ctrlConfig ctrl = ctrl_cfg[0];
+    centi_t    min  = vessels[0].programs.maturation_min;
+    loadValue();
+    CHECK_EQ(ctrl_cfg[0].mode,ctrl.mode);
+    CHECK_EQ(ctrl_cfg[0].hysteresis,ctrl.hysteresis);
+    CHECK_EQ(vessels[0].programs.maturation_min,min);
+}
+
+TEST(migrate_v1_to_v4){
+    settingsRecordV2 old;
+    memset(&old,0,sizeof(old));
+    old.magic   = SETTINGS_MAGIC;
+    old.version = 1;
+    old.program = 'P';
+    old.seq     = 3;
+    old.limits[4] = 2050;
+    old.limits[5] = 2150;
+    writeOld(SET_FILE_B,&old,SETTINGS_V1_SIZE);
+    settingsLoad();
+    const ctrlConfig def = CTRL_DEFAULT;
+    CHECK_EQ(settings_seq,3);
+    CHECK_EQ(vessels[0].program,'P');
+    CHECK_EQ(vessels[0].temp_min,2050);
+    CHECK_EQ(ctrl_cfg[0].mode,def.mode);
+    CHECK_EQ(ctrl_cfg[0].min_off_s,def.min_off_s);
+    CHECK_EQ(ctrl_cfg[0].window_s,def.window_s);
+    CHECK_EQ(profiles[0].step,PROFILE_NONE);
+    checkRewrittenAsV4();
+}
+
+TEST(migrate_v2_to_v4){
+    settingsRecordV2 old;
+    memset(&old,0,sizeof(old));
+    old.magic   = SETTINGS_MAGIC;
+    old.version = 2;
+    old.program = 'M';
+    old.seq     = 9;
+    old.limits[2] = 80;
+    old.limits[3] = 120;
+    old.ctrl            = CTRL_DEFAULT;
+    old.ctrl.mode       = CTRL_PID;
+    old.ctrl.hysteresis = 15;
+    writeOld(SET_FILE_A,&old,sizeof(old));
+    settingsLoad();
+    CHECK_EQ(vessels[0].program,'M');
+    CHECK_EQ(vessels[0].temp_max,120);
+    CHECK_EQ(ctrl_cfg[0].mode,CTRL_PID);
+    CHECK_EQ(ctrl_cfg[0].hysteresis,15);
+    CHECK_EQ(profiles[0].step,PROFILE_NONE);
+    checkRewrittenAsV4();
+}
+
+TEST(migrate_v3_to_v4){
+    uint8_t img[SETTINGS_V3_SIZE];
+    memset(img,0,sizeof(img));
+    settingsRecord *rec = (settingsRecord*)img;
+    rec->magic   = SETTINGS_MAGIC;
+    rec->version = 3;
+    rec->count   = 1;
+    rec->seq     = 21;
+    uint8_t   *v0   = img + offsetof(settingsRecord,vessels);
+    ctrlConfig ctrl = CTRL_DEFAULT;
+    ctrl.mode = CTRL_PRED;
+    const centi_t lim[LIMITS_LEN] = {1600,1800,100,200,2000,2400};
+    v0[0] = 'F';
+    memcpy(v0 + 2,lim,sizeof(lim));
+    memcpy(v0 + 2 + sizeof(lim),&ctrl,sizeof(ctrl));
+    writeOld(SET_FILE_B,img,sizeof(img));
+    settingsLoad();
+    CHECK_EQ(settings_seq,21);
+    CHECK_EQ(vessels[0].temp_min,1600);
+    CHECK_EQ(ctrl_cfg[0].mode,CTRL_PRED);
+    CHECK_EQ(profiles[0].step,PROFILE_NONE);
+    checkRewrittenAsV4();
+}
+
+TEST(coalesced_writes){
+    //cinco mudancas seguidas: uma gravacao so, de um slot
+    settingsLoad();
+    hostRun(SETTINGS_COALESCE_MS + 100);
+    uint32_t writes = host_writes;
+    uint32_t seq    = settings_seq;
+    for (int i=0;i<5;i++){
+        vessels[0].programs.fermentation_min = 1500 + i;
+        settingsChanged();
+        hostRun(200);
+    }
+    hostRun(SETTINGS_COALESCE_MS);
+    CHECK_EQ(settings_seq,seq + 1);
+    CHECK_EQ(host_writes - writes,1);
+    printf("  %u escrita(s) de %u bytes por mudanca agrupada\n",host_writes - writes,(unsigned)sizeof(settingsRecord));
+    CHECK_EQ(loadValue(),1504);
+}
@@ -0,0 +1,71 @@
+/*! \file test_stats.cpp
+ *  \brief Instrumentacao: slots medidos, amostra de heap sem alocar e
+ *  sondagem do maior bloco so no relatorio
+ */
+#define STATS
+#include "host.h"
+
+//! Relatorio publicado em freezer/stats, juntando as mensagens.
+static std::string report(){
+    std::string all;
+    for (size_t i=0;i<host_published.size();i++){
+        if (host_published[i].topic == "freezer/stats"){
+            all.append(host_published[i].payload.begin(),host_published[i].payload.end());
+        }
+    }
+    return all;
+}
+
+TEST(record_fills_histogram){
+    memset(stats_slots,0,sizeof(stats_slots));
+    uint32_t mhz = system_get_cpu_freq();
+    statsRecord(ST_CONTROL,5*mhz);     //<8 us
+    statsRecord(ST_CONTROL,20*mhz);    //<32 us
+    statsRecord(ST_CONTROL,100000*mhz);//>=32 ms
+    const statsSlot &st = stats_slots[ST_CONTROL];
+    CHECK_EQ(st.count,3);
+    CHECK_EQ(st.min,5*mhz);
+    CHECK_EQ(st.max,100000*mhz);
+    CHECK_EQ(st.hist[0],1);
+    CHECK_EQ(st.hist[1],1);
+    CHECK_EQ(st.hist[STATS_BUCKETS-1],1);
+}
+
+TEST(scope_measures_handler){
+    memset(stats_slots,0,sizeof(stats_slots));
+    {
+        STATS_SCOPE(ST_INBOUND);
+        host_us += 40;
+    }
+    const statsSlot &st = stats_slots[ST_INBOUND];
+    CHECK_EQ(st.count,1);
+    CHECK_EQ(st.max / system_get_cpu_freq(),40);
+    CHECK_EQ(st.hist[2],1);
+}
+
+TEST(periodic_sample_does_not_allocate){
+    statsBegin();
+    CHECK(stats_block_boot > 0);
+    host_allocs = 0;
+    hostRun(10*STATS_HEAP_MS);
+    CHECK(tasks[TASK_STATS].runs >= 10);
+    CHECK_EQ(host_allocs,0);
+    CHECK(stats_heap_min != 0xFFFFFFFF);
+}
+
+TEST(report_probes_block_and_resets){
+    statsBegin();
+    stats_block_min = 0xFFFFFFFF;
+    tasks[TASK_CONTROL].runs = 7;
+    host_allocs = 0;
+    statsPublish(false);
+    //a sondagem roda no pedido do relatorio
+    CHECK(host_allocs > 0);
+    CHECK(stats_block_min != 0xFFFFFFFF);
+    statsPublish(true);
+    std::string r = report();
+    CHECK(r.find("task control n=7 ") != std::string::npos);
+    CHECK(r.find("block_min=") != std::string::npos);
+    CHECK_EQ(tasks[TASK_CONTROL].runs,0);
+    CHECK_EQ(stats_block_min,0xFFFFFFFF);
+}
@@ -0,0 +1,104 @@
+/*! \file test_telemetry.cpp
+ *  \brief Bytes no ar do lote de telemetria contra um JSON por amostra e o
+ *  pior caso de um lote cheio dentro de TELEMETRY_PAYLOAD
+ */
+#include "host.h"
+
+//! Bytes de um PUBLISH QoS 0 no ar: cabecalho fixo, tamanho, topico e payload.
+static size_t wireBytes(const std::string &topic, size_t payload){
+    size_t rest = 2 + topic.size() + payload;
+    size_t len  = 1;
+    for (size_t r=rest;r >= 0x80;r >>= 7){
+        len++;
+    }
+    return 1 + len + rest;
+}
+
+//! O que cada leitura publicaria sozinha, como JSON.
+static std::string naiveJson(uint32_t ts, uint8_t v, centi_t temp, uint8_t relays){
+    char t[8];
+    char buf[96];
+    formatCenti(t,temp);
+    snprintf(buf,sizeof(buf),"{\"ts\":%u,\"vessel\":%u,\"temp\":%s,\"relay1\":%u,\"relay2\":%u}",
+             1700000000u + ts,v,t,relays & 1,(relays >> 1) & 1);
+    return buf;
+}
+
+TEST(bytes_on_wire_per_hour){
+    //uma hora de leituras a cada 5 s: deriva lenta, ruido de 1 a 2
+    //centesimos e o compressor ciclando a cada 20 min
+    clock_synced = true;
+    host_unix    = 1700000000;
+    telemetry_count = 0;
+    memset(telemetry_last_s,0,sizeof(telemetry_last_s));
+    telemetryBegin();
+    size_t   json_bytes = 0, json_msgs = 0;
+    uint32_t temp = 185000; //milesimos de centesimo
+    for (uint32_t s=5;s<=3600;s+=5){
+        bool on = (s / 1200) & 1;
+        relayOf(0,RELAY_ONE).level = on ? HIGH : LOW;
+        temp += on ? -40 : 25;
+        centi_t reading = temp / 1000 + (s / 5) % 3 - 1;
+        host_ms = s*1000;
+        uint8_t before = telemetry_count;
+        telemetryAdd(0,reading);
+        if (telemetry_count != before){
+            //a mesma amostra, publicada sozinha
+            std::string j = naiveJson(s,0,reading,relayBits(0));
+            json_bytes += wireBytes("freezer/telemetry",j.size());
+            json_msgs++;
+        }
+        hostRun(0);
+        if (s % telemetry_interval_s == 0){
+            telemetryFlush();
+        }
+    }
+    relayOf(0,RELAY_ONE).level = LOW;
+
+    size_t bin_bytes = 0, bin_msgs = 0, bin_payload = 0;
+    for (size_t i=0;i<host_published.size();i++){
+        if (host_published[i].topic == "freezer/telemetry"){
+            bin_bytes   += wireBytes(host_published[i].topic,host_published[i].payload.size());
+            bin_payload += host_published[i].payload.size();
+            bin_msgs++;
+        }
+    }
+    printf("  por hora: JSON %lu publicacoes, %lu bytes; lote %lu publicacoes, %lu bytes (%.2f bytes/amostra de payload)\n",
+           (unsigned long)json_msgs,(unsigned long)json_bytes,(unsigned long)bin_msgs,(unsigned long)bin_bytes,
+           (double)(bin_payload - 6*bin_msgs) / json_msgs);
+    CHECK_EQ(json_msgs,3600 / TELEMETRY_SAMPLE_S);
+    CHECK_EQ(bin_msgs,3600 / telemetry_interval_s);
+    CHECK(bin_bytes*10 < json_bytes);
+    //leituras estaveis a cada TELEMETRY_SAMPLE_S: 3 bytes por amostra
+    CHECK(bin_payload - 6*bin_msgs <= 3*json_msgs);
+}
+
+TEST(worst_case_full_batch){
+    //dt que pede varint de 5 bytes e temperaturas que saltam de uma ponta a
+    //outra do int16: 8 bytes por amostra, e a primeira (dt 0, temperatura
+    //relativa a zero) com 4
+    telemetry_count = TELEMETRY_SAMPLES;
+    uint32_t ts = 0;
+    for (int i=0;i<TELEMETRY_SAMPLES;i++){
+        telemetry[i] = {ts,(centi_t)(i & 1 ? INT16_MAX : INT16_MIN),0,3};
+        ts += 1u << 26;
+    }
+    uint8_t buf[TELEMETRY_PAYLOAD + 16];
+    memset(buf,0xA5,sizeof(buf));
+    size_t len = telemetryEncode(buf);
+    CHECK_EQ(len,6 + 4 + (TELEMETRY_SAMPLES-1)*8);
+    CHECK(len <= TELEMETRY_PAYLOAD);
+    bool guard = true;
+    for (size_t i=TELEMETRY_PAYLOAD;i<sizeof(buf);i++){
+        guard = guard && buf[i] == 0xA5;
+    }
+    CHECK(guard);
+    CHECK(TELEMETRY_PAYLOAD <= OUTBOX_RECORD_MAX);
+
+    //e um lote cheio de verdade sai em uma publicacao so
+    host_published.clear();
+    telemetryFlush();
+    CHECK_EQ(telemetry_count,0);
+    CHECK_EQ(host_published.size(),1);
+    CHECK(host_published.size() == 1 && host_published[0].payload.size() == len);
+}
@@ -0,0 +1,141 @@
+/*! \file test_vessels.cpp
+ *  \brief Build com MAX_VESSELS cubas: despacho de beer/<n>/, registro de
+ *  configuracoes, bloco do RTC e quanto custa cada cuba a mais
+ */
+#define VESSEL_TABLE VESSEL(0,1) VESSEL(2,3) VESSEL(4,5) VESSEL(6,7) \
+                     VESSEL(8,9) VESSEL(10,11) VESSEL(14,15) VESSEL(16,17)
+#include <chrono>
+#include "host.h"
+
+static void receive(const char *topic, const char *msg){
+    onMessageReceived(String(topic),String(msg));
+}
+
+TEST(eight_vessels_built){
+    CHECK_EQ(VESSEL_COUNT,8);
+    CHECK_EQ(VESSEL_COUNT,MAX_VESSELS);
+    relayInit();
+    CHECK_EQ(relayOf(7,RELAY_TWO).pin,17);
+    CHECK_EQ(relayOf(7,RELAY_TWO).vessel,7);
+}
+
+TEST(dispatch_per_vessel){
+    settingsLoad();
+    char topic[32];
+    char msg[8];
+    //uma rajada com todas as cubas: LATEST agrupa por cuba, nenhuma se perde
+    for (int v=0;v<8;v++){
+        m_snprintf(topic,sizeof(topic),v == 0 ? "beer/temperature" : "beer/%d/temperature",v);
+        m_snprintf(msg,sizeof(msg),"%d.50",10 + v);
+        receive(topic,msg);
+    }
+    receive("beer/7/program","M");
+    receive("beer/3/minMax","4|6|M");
+    receive("beer/8/temperature","1.00");
+    receive("beer/9/program","P");
+    //IN_DRAIN_BUDGET mensagens por tick
+    hostRun(4*SCHED_TICK_MS);
+    bool temps = true;
+    for (int v=0;v<8;v++){
+        temps = temps && vessels[v].last_temp == (10 + v)*100 + 50;
+    }
+    CHECK(temps);
+    CHECK_EQ(vessels[7].program,'M');
+    CHECK_EQ(vessels[0].program,'F');
+    CHECK_EQ(vessels[3].programs.maturation_min,400);
+    CHECK_EQ(vessels[4].programs.maturation_min,vessels[0].programs.maturation_min);
+    CHECK_EQ(in_count,0);
+}
+
+TEST(settings_hold_every_vessel){
+    settingsLoad();
+    CHECK_EQ(sizeof(settingsRecord),300);
+    defineProgram(7,'P');
+    ctrl_cfg[7].hysteresis = 35;
+    ctrl_cfg[6].mode       = CTRL_PRED;
+    settingsChanged();
+    hostRun(SETTINGS_COALESCE_MS + 100);
+    //todas as cubas no mesmo registro, dentro de um bloco do pool
+    CHECK(sizeof(settingsRecord) <= POOL_BLOCK);
+    CHECK_EQ(fileGetSize(SET_FILE_A) + fileGetSize(SET_FILE_B),sizeof(settingsRecord));
+
+    ctrl_cfg[7]        = CTRL_DEFAULT;
+    ctrl_cfg[6]        = CTRL_DEFAULT;
+    vessels[7].program = 'F';
+    settingsLoad();
+    CHECK_EQ(settings_buf.count,8);
+    CHECK_EQ(vessels[7].program,'P');
+    CHECK_EQ(ctrl_cfg[7].hysteresis,35);
+    CHECK_EQ(ctrl_cfg[6].mode,CTRL_PRED);
+    CHECK_EQ(ctrl_cfg[5].mode,CTRL_BANG);
+}
+
+TEST(rtc_block_with_eight_vessels){
+    //o bloco inteiro cabe na memoria do usuario do RTC
+    CHECK_EQ(sizeof(rtcState),3*sizeof(uint32_t) + 8*sizeof(rtcVessel));
+    CHECK(RTC_BLOCK*4 + sizeof(rtcState) <= sizeof(host_rtc));
+    relayInit();
+    vessels[7].temp_min = 123;
+    vessels[7].temp_max = 456;
+    relayWrite(relayOf(7,RELAY_ONE),HIGH);
+    rtcSave();
+    vessels[7].temp_min = 0;
+    vessels[7].temp_max = 0;
+    relayOf(7,RELAY_ONE).level = LOW;
+    CHECK(rtcRestore());
+    CHECK_EQ(vessels[7].temp_min,123);
+    CHECK_EQ(vessels[7].temp_max,456);
+    CHECK_EQ(relayOf(7,RELAY_ONE).level,HIGH);
+    CHECK_EQ(host_pins[17 - 1],HIGH);
+    relayWrite(relayOf(7,RELAY_ONE),LOW);
+}
+
+TEST(scaling_bench){
+    //custo por cuba do caminho de cada leitura e de cada decisao
+    settingsLoad();
+    relayInit();
+    for (int v=0;v<8;v++){
+        ctrl_cfg[v].min_on_s  = 0;
+        ctrl_cfg[v].min_off_s = 0;
+    }
+    const int n = 20000;
+    char topics[8][24];
+    for (int v=0;v<8;v++){
+        m_snprintf(topics[v],sizeof(topics[v]),v == 0 ? "beer/temperature" : "beer/%d/temperature",v);
+    }
+    host_ms = 1000;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        host_ms += CTRL_TICK_MS;
+        for (int v=0;v<8;v++){
+            processReading(v,1800 + (i + v) % 200);
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        host_ms += CTRL_TICK_MS;
+        for (int v=0;v<8;v++){
+            vessels[v].reading_ms = host_ms; //leitura fresca, sem o custo de processReading
+            vessels[v].last_temp  = 1800 + (i + v) % 200;
+        }
+        ctrlTick();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    for (int i=0;i<n;i++){
+        receive(topics[i % 8],"18.25");
+        if (i % IN_DRAIN_BUDGET == IN_DRAIN_BUDGET - 1){
+            inDrain();
+        }
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    double reading = std::chrono::duration<double,std::nano>(t1 - t0).count() / (n*8.0);
+    double tick    = std::chrono::duration<double,std::nano>(t2 - t1).count() / n;
+    double message = std::chrono::duration<double,std::nano>(t3 - t2).count() / n;
+    size_t ram = sizeof(vessel) + 2*sizeof(relaySeq) + sizeof(ctrlConfig) + sizeof(ctrlState) +
+                 sizeof(ctrlModel) + sizeof(profileState) + sizeof(anaState) + sizeof(histAcc)*2 +
+                 HIST_RAW_LEN*(sizeof(uint32_t) + sizeof(centi_t)) + 3*sizeof(uint32_t);
+    printf("  8 cubas: leitura %.0f ns, ctrlTick %.0f ns (%.0f ns por cuba), mensagem %.0f ns, %lu bytes de RAM por cuba (%lu do historico bruto)\n",
+           reading,tick,tick / 8,message,(unsigned long)ram,(unsigned long)(HIST_RAW_LEN*(sizeof(uint32_t) + sizeof(centi_t))));
+    CHECK_EQ(in_dropped,0);
+    CHECK_EQ(in_count,0);
+}